@@ -0,0 +1,223 @@
+
+         /* ****************************************************** *
+          * Copyright ©2024 Run Data Systems,  All rights reserved *
+          *                                                        *
+          * This content is the exclusive intellectual property of *
+          * Run Data Systems, Gauteng, South Africa.               *
+          *                                                        *
+          * See the file COPYRIGHT for more information.           *
+          *                                                        *
+          * ****************************************************** */
+
+/* ************************************************************************
+ * Benchmark for the latency of executing a command as the resident set of
+ * the daemon grows. For each size the process first grows its RSS to that
+ * size, and then times:
+ *
+ *    fork+popen  The previous executor: fork() the daemon, then popen() the
+ *                shell in the child and relay its output over a pipe.
+ *    spawn       kbexec_command(), which starts the shell directly.
+ *    zygote      kbexec_zygote(), which has the zygote (started before the
+ *                RSS is grown) start the shell.
+ *    direct      kbexec_program(), which starts /bin/echo without a shell.
+ *    pool        kbshell_command(), which gives the command to one of a pool
+ *                of shells started before the RSS is grown.
+ *
+ * Usage: bench_exec.elf [iterations [rss-MB ...]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ds_array.h"
+
+#include "kbnode.h"
+#include "kbcancel.h"
+#include "kbwork.h"
+#include "kbsink.h"
+#include "kbctx.h"
+#include "kbexec.h"
+#include "kbutil.h"
+#include "kbshell.h"
+#include "kbzygote.h"
+
+#define BENCH_COMMAND   "echo benchmark"
+
+static double now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+// The process structure of the previous executor, without the node handling.
+static int fork_popen (const char *command, char *dst, size_t dstlen)
+{
+   int fds[2];
+   if ((pipe (fds)) != 0) {
+      return -1;
+   }
+
+   pid_t pid = fork ();
+   if (pid < 0) {
+      close (fds[0]);
+      close (fds[1]);
+      return -1;
+   }
+
+   if (pid == 0) {
+      close (fds[0]);
+      FILE *inf = popen (command, "r");
+      int rc = -1;
+      if (inf) {
+         char buf[32];
+         size_t nbytes;
+         while ((nbytes = fread (buf, 1, sizeof buf, inf)) > 0) {
+            if ((write (fds[1], buf, nbytes)) < 0)
+               break;
+         }
+         rc = pclose (inf);
+      }
+      static const uint8_t delim = 0;
+      if ((write (fds[1], &delim, 1)) < 0 || (write (fds[1], &rc, sizeof rc)) < 0)
+         _exit (EXIT_FAILURE);
+      _exit (EXIT_SUCCESS);
+   }
+
+   close (fds[1]);
+   size_t index = 0;
+   ssize_t nbytes;
+   while (index < dstlen && (nbytes = read (fds[0], &dst[index], dstlen - index)) > 0) {
+      index += (size_t)nbytes;
+   }
+   close (fds[0]);
+   waitpid (pid, NULL, 0);
+
+   int ret = -1;
+   if (index >= sizeof ret + 1) {
+      memcpy (&ret, &dst[index - sizeof ret], sizeof ret);
+   }
+   return ret;
+}
+
+int main (int argc, char **argv)
+{
+   static const size_t default_sizes[] = { 0, 64, 256, 1024 };
+
+   int ret = EXIT_FAILURE;
+   size_t iterations = argc > 1 ? (size_t)atoi (argv[1]) : 50;
+   size_t nsizes = argc > 2 ? (size_t)(argc - 2)
+                            : sizeof default_sizes / sizeof default_sizes[0];
+
+   char *ballast = NULL;
+   size_t ballast_len = 0;
+   kbsink_t *result = NULL;
+   char buf[256];
+   char *echo_argv[] = { (char *)"echo", (char *)"benchmark", NULL };
+
+   if (!iterations) {
+      fprintf (stderr, "Iterations must be at least 1\n");
+      return EXIT_FAILURE;
+   }
+
+   if (!(kbzygote_start ())) {
+      fprintf (stderr, "Failed to start zygote\n");
+      return EXIT_FAILURE;
+   }
+   if (!(kbshell_pool_start (1))) {
+      fprintf (stderr, "Failed to start shell pool\n");
+      kbzygote_stop ();
+      return EXIT_FAILURE;
+   }
+   if (!(result = kbsink_new ("bench", 4096))) {
+      goto cleanup;
+   }
+
+   printf ("%10s %10s %16s %16s %16s %16s %16s\n", "target MB", "RSS MB",
+           "fork+popen ms", "spawn ms", "zygote ms", "direct ms", "pool ms");
+   for (size_t i=0; i<nsizes; i++) {
+      size_t mb = argc > 2 ? (size_t)atoi (argv[i + 2]) : default_sizes[i];
+      size_t len = mb * 1024 * 1024;
+
+      // Grow the resident set, touching every page so that it is mapped.
+      if (len > ballast_len) {
+         char *tmp = realloc (ballast, len);
+         if (!tmp) {
+            fprintf (stderr, "Failed to grow RSS to %zu MB\n", mb);
+            goto cleanup;
+         }
+         ballast = tmp;
+         memset (&ballast[ballast_len], 0x5a, len - ballast_len);
+         ballast_len = len;
+      }
+
+      double start = now ();
+      for (size_t j=0; j<iterations; j++) {
+         if ((fork_popen (BENCH_COMMAND, buf, sizeof buf)) != 0) {
+            fprintf (stderr, "fork+popen of [%s] failed\n", BENCH_COMMAND);
+            goto cleanup;
+         }
+      }
+      double t_fork = (now () - start) / (double)iterations;
+
+      start = now ();
+      for (size_t j=0; j<iterations; j++) {
+         if ((kbexec_command (BENCH_COMMAND, "/", NULL, NULL, -1, 0, 0, NULL,
+                              result)) != 0) {
+            fprintf (stderr, "spawn of [%s] failed\n", BENCH_COMMAND);
+            goto cleanup;
+         }
+      }
+      double t_spawn = (now () - start) / (double)iterations;
+
+      start = now ();
+      for (size_t j=0; j<iterations; j++) {
+         if ((kbexec_zygote (BENCH_COMMAND, "/", NULL, NULL, -1, NULL,
+                             result)) != 0) {
+            fprintf (stderr, "zygote spawn of [%s] failed\n", BENCH_COMMAND);
+            goto cleanup;
+         }
+      }
+      double t_zygote = (now () - start) / (double)iterations;
+
+      start = now ();
+      for (size_t j=0; j<iterations; j++) {
+         if ((kbexec_program ("/bin/echo", echo_argv, "/", NULL, NULL, -1, 0, 0, NULL,
+                              result)) != 0) {
+            fprintf (stderr, "direct run of [/bin/echo] failed\n");
+            goto cleanup;
+         }
+      }
+      double t_direct = (now () - start) / (double)iterations;
+
+      start = now ();
+      for (size_t j=0; j<iterations; j++) {
+         if ((kbshell_command (BENCH_COMMAND, "/", NULL, result)) != 0) {
+            fprintf (stderr, "pooled run of [%s] failed\n", BENCH_COMMAND);
+            goto cleanup;
+         }
+      }
+      double t_pool = (now () - start) / (double)iterations;
+
+      printf ("%10zu %10zu %16.3f %16.3f %16.3f %16.3f %16.3f\n", mb,
+              kbutil_rss () / (1024 * 1024), t_fork * 1e3, t_spawn * 1e3,
+              t_zygote * 1e3, t_direct * 1e3, t_pool * 1e3);
+   }
+
+   ret = EXIT_SUCCESS;
+cleanup:
+   free (ballast);
+   kbsink_del (result);
+   kbshell_pool_stop ();
+   kbzygote_stop ();
+   return ret;
+}
+
@@ -0,0 +1,228 @@
+
+         /* ****************************************************** *
+          * Copyright ©2024 Run Data Systems,  All rights reserved *
+          *                                                        *
+          * This content is the exclusive intellectual property of *
+          * Run Data Systems, Gauteng, South Africa.               *
+          *                                                        *
+          * See the file COPYRIGHT for more information.           *
+          *                                                        *
+          * ****************************************************** */
+
+/* ************************************************************************
+ * Benchmark for walking large instantiated trees. A configuration file is
+ * generated in which every node at level `n` runs every node at level `n+1`,
+ * so that a handful of source nodes instantiate into a tree with
+ * (fanout ^ depth) leaves.
+ *
+ * Usage: bench_tree.elf [fanout [depth [iterations]]] 2>/dev/null
+ *
+ * The instantiation messages are written to stderr, hence the redirection.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "ds_array.h"
+
+#include "kbnode.h"
+#include "kbindex.h"
+#include "kbtree.h"
+#include "kbutil.h"
+
+#define BENCH_FNAME     "/tmp/kubeka-bench-tree.kubeka"
+
+static double now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+static bool generate (const char *fname, size_t fanout, size_t depth)
+{
+   FILE *outf = fopen (fname, "w");
+   if (!outf) {
+      fprintf (stderr, "Failed to open [%s] for writing: %m\n", fname);
+      return false;
+   }
+
+   fprintf (outf, "[entrypoint]\nID = bench-root\nMESSAGE = Benchmark root\n");
+   fprintf (outf, "bench_var = root value\n");
+   for (size_t level=0; level<=depth; level++) {
+      size_t nnodes = level == 0 ? 1 : fanout;
+      for (size_t i=0; i<nnodes; i++) {
+         if (level > 0) {
+            fprintf (outf, "\n[job]\nID = bench-%zu-%zu\n", level, i);
+            fprintf (outf, "MESSAGE = Level %zu node %zu of $<bench_var>\n",
+                     level, i);
+         }
+         if (level == depth) {
+            fprintf (outf, "EXEC = echo $<ID> $<bench_var>\n");
+            continue;
+         }
+         const char *delim = "";
+         fprintf (outf, "JOBS[] = [ ");
+         for (size_t j=0; j<fanout; j++) {
+            fprintf (outf, "%sbench-%zu-%zu", delim, level + 1, j);
+            delim = ", ";
+         }
+         fprintf (outf, " ]\n");
+      }
+   }
+
+   fclose (outf);
+   return true;
+}
+
+static size_t walk (const kbnode_t *node)
+{
+   if (!node) {
+      return 0;
+   }
+   size_t ret = 1;
+   size_t njobs = kbnode_njobs (node);
+   size_t nhandlers = kbnode_nhandlers (node);
+   for (size_t i=0; i<njobs; i++) {
+      ret += walk (kbnode_job (node, i));
+   }
+   for (size_t i=0; i<nhandlers; i++) {
+      ret += walk (kbnode_handler (node, i));
+   }
+   return ret;
+}
+
+static size_t walk_ids (const kbnode_t *node)
+{
+   if (!node) {
+      return 0;
+   }
+   size_t ret = strlen (kbnode_getvalue_first (node, KBNODE_KEY_ID));
+   size_t njobs = kbnode_njobs (node);
+   for (size_t i=0; i<njobs; i++) {
+      ret += walk_ids (kbnode_job (node, i));
+   }
+   return ret;
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   size_t fanout = argc > 1 ? (size_t)atoi (argv[1]) : 8;
+   size_t depth = argc > 2 ? (size_t)atoi (argv[2]) : 5;
+   size_t iterations = argc > 3 ? (size_t)atoi (argv[3]) : 10;
+
+   ds_array_t *nodes = ds_array_new ();
+   kbindex_t *index = NULL;
+   kbnode_t *root = NULL;
+   kbnode_region_t *region = NULL;
+   FILE *devnull = fopen ("/dev/null", "w");
+   size_t errors = 0, warnings = 0;
+
+   if (!nodes || !devnull) {
+      fprintf (stderr, "Failed to initialise benchmark: %m\n");
+      goto cleanup;
+   }
+
+   if (!(generate (BENCH_FNAME, fanout, depth))) {
+      goto cleanup;
+   }
+
+   if (!(kbnode_read_file (nodes, BENCH_FNAME, &errors, &warnings))) {
+      fprintf (stderr, "Failed to parse [%s]: %zu errors, %zu warnings\n",
+               BENCH_FNAME, errors, warnings);
+      goto cleanup;
+   }
+
+   if (!(index = kbindex_new (nodes))) {
+      fprintf (stderr, "Failed to index benchmark nodes\n");
+      goto cleanup;
+   }
+
+   double start = now ();
+   if (!(root = kbnode_instantiate (ds_array_get (nodes, 0), index, NULL,
+                                    &errors, &warnings))) {
+      fprintf (stderr, "Failed to instantiate benchmark tree\n");
+      goto cleanup;
+   }
+   double t_instantiate = now () - start;
+
+   size_t nnodes = 0;
+   start = now ();
+   for (size_t i=0; i<iterations; i++) {
+      nnodes = walk (root);
+   }
+   double t_walk = (now () - start) / (double)iterations;
+
+   size_t idbytes = 0;
+   start = now ();
+   for (size_t i=0; i<iterations; i++) {
+      idbytes = walk_ids (root);
+   }
+   double t_walk_ids = (now () - start) / (double)iterations;
+
+   start = now ();
+   kbtree_eval (root, &errors, &warnings);
+   double t_eval = now () - start;
+
+   start = now ();
+   kbnode_dump (root, devnull, 0);
+   double t_dump = now () - start;
+
+   start = now ();
+   kbnode_del (root);
+   root = NULL;
+   double t_del = now () - start;
+
+   // Many trees in a single region, all deleted in one operation.
+   if (!(region = kbnode_region_new ())) {
+      fprintf (stderr, "Failed to create region\n");
+      goto cleanup;
+   }
+   for (size_t i=0; i<iterations; i++) {
+      if (!(kbnode_instantiate (ds_array_get (nodes, 0), index, region,
+                                &errors, &warnings))) {
+         fprintf (stderr, "Failed to instantiate benchmark tree in region\n");
+         goto cleanup;
+      }
+   }
+   start = now ();
+   kbnode_region_del (region);
+   region = NULL;
+   double t_region_del = now () - start;
+
+   printf ("fanout=%zu depth=%zu nodes=%zu (%zu source nodes, %zu id bytes)\n",
+           fanout, depth, nnodes, ds_array_length (nodes), idbytes);
+   printf ("instantiate:  %10.3f ms\n", t_instantiate * 1e3);
+   printf ("walk:         %10.3f ms (%.1f ns/node, mean of %zu)\n",
+           t_walk * 1e3, t_walk * 1e9 / (double)nnodes, iterations);
+   printf ("walk+lookup:  %10.3f ms (%.1f ns/node, mean of %zu)\n",
+           t_walk_ids * 1e3, t_walk_ids * 1e9 / (double)nnodes, iterations);
+   printf ("eval:         %10.3f ms (%zu errors, %zu warnings)\n",
+           t_eval * 1e3, errors, warnings);
+   printf ("dump:         %10.3f ms\n", t_dump * 1e3);
+   printf ("delete:       %10.3f ms\n", t_del * 1e3);
+   printf ("region del:   %10.3f ms (%zu trees, %.3f ms/tree)\n",
+           t_region_del * 1e3, iterations,
+           t_region_del * 1e3 / (double)iterations);
+
+   ret = EXIT_SUCCESS;
+cleanup:
+   kbnode_del (root);
+   kbnode_region_del (region);
+   kbindex_del (index);
+   ds_array_fptr (nodes, (void (*) (void *))kbnode_del);
+   ds_array_del (nodes);
+   if (devnull) {
+      fclose (devnull);
+   }
+   remove (BENCH_FNAME);
+
+   return ret;
+}
+
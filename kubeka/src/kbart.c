@@ -0,0 +1,345 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "ds_array.h"
+#include "ds_str.h"
+
+#include "kbutil.h"
+#include "kbnode.h"
+#include "kbhash.h"
+#include "kbcancel.h"
+#include "kbwork.h"
+#include "kbart.h"
+
+#define DEFAULT_DIR     "/tmp/kubeka-artifacts"
+#define OBJECTS_DIR     "/objects"
+#define LOCK_FILE       "/lock"
+
+// Executable files are kept apart from other files with the same contents,
+// so that nobody has to change the mode of a file that others link to.
+#define EXEC_SUFFIX     ".x"
+
+static char *g_dir = NULL;
+
+struct artifact_t {
+   char *name;
+   char object[KBHASH_HEXLEN + sizeof EXEC_SUFFIX];
+};
+
+struct kbart_t {
+   char *id;
+   // A shared flock() on the lock file of the store, held from the first
+   // use of the store by the run until the run ends. Files are only removed
+   // from the store with an exclusive lock, so never while a run uses it.
+   int lockfd;
+
+   struct artifact_t *artifacts;
+   size_t nartifacts;
+   size_t cap;
+};
+
+static const char *store_dir (void)
+{
+   return g_dir ? g_dir : DEFAULT_DIR;
+}
+
+bool kbart_set_dir (const char *dir)
+{
+   free (g_dir);
+   g_dir = NULL;
+   if (dir && !(g_dir = ds_str_dup (dir))) {
+      KBIERROR ("OOM copying artifact store name %s\n", dir);
+      return false;
+   }
+   return true;
+}
+
+bool kbart_wanted (const kbnode_t *node)
+{
+   return kbnode_getvalue_first (node, KBNODE_KEY_ARTIFACTS_IN)[0]
+       || kbnode_getvalue_first (node, KBNODE_KEY_ARTIFACTS_OUT)[0];
+}
+
+kbart_t *kbart_new (const char *id)
+{
+   kbart_t *ret = calloc (1, sizeof *ret);
+   if (!ret || !(ret->id = ds_str_dup (id))) {
+      KBIERROR ("OOM allocating artifacts of [%s]\n", id);
+      free (ret);
+      return NULL;
+   }
+   ret->lockfd = -1;
+   return ret;
+}
+
+// Remove the files in the store that no run uses and that are not linked
+// from anywhere else. Nothing is removed while another run uses the store;
+// the last one to end collects them.
+static void collect (void)
+{
+   char *lockname = ds_str_cat (store_dir (), LOCK_FILE, NULL);
+   char *objects = ds_str_cat (store_dir (), OBJECTS_DIR, NULL);
+   int fd = -1;
+   DIR *dir = NULL;
+
+   if (!lockname || !objects) {
+      KBIERROR ("OOM allocating artifact store names\n");
+      goto cleanup;
+   }
+   if ((fd = open (lockname, O_RDWR | O_CLOEXEC)) < 0
+         || (flock (fd, LOCK_EX | LOCK_NB)) != 0
+         || !(dir = opendir (objects))) {
+      goto cleanup;
+   }
+
+   struct dirent *de;
+   while ((de = readdir (dir))) {
+      struct stat sb;
+      size_t len = strlen (de->d_name);
+      if ((len != KBHASH_HEXLEN && len != KBHASH_HEXLEN + sizeof EXEC_SUFFIX - 1)
+            || (fstatat (dirfd (dir), de->d_name, &sb, AT_SYMLINK_NOFOLLOW)) != 0
+            || sb.st_nlink > 1) {
+         continue;
+      }
+      if ((unlinkat (dirfd (dir), de->d_name, 0)) != 0) {
+         KBWARN ("Failed to remove artifact [%s%s/%s]: %m\n",
+                 store_dir (), OBJECTS_DIR, de->d_name);
+      }
+   }
+
+cleanup:
+   if (dir) {
+      closedir (dir);
+   }
+   if (fd >= 0) {
+      close (fd);
+   }
+   free (objects);
+   free (lockname);
+}
+
+void kbart_del (kbart_t *arts)
+{
+   if (!arts) {
+      return;
+   }
+   if (arts->lockfd >= 0) {
+      close (arts->lockfd);
+      collect ();
+   }
+   for (size_t i=0; i<arts->nartifacts; i++) {
+      free (arts->artifacts[i].name);
+   }
+   free (arts->artifacts);
+   free (arts->id);
+   free (arts);
+}
+
+// Create the store if necessary, and hold it until the run ends.
+static bool store_open (kbart_t *arts)
+{
+   char *lockname = NULL;
+   char *objects = NULL;
+   bool error = true;
+
+   if (arts->lockfd >= 0) {
+      return true;
+   }
+   objects = ds_str_cat (store_dir (), OBJECTS_DIR, "/", NULL);
+   lockname = ds_str_cat (store_dir (), LOCK_FILE, NULL);
+   if (!objects || !lockname) {
+      KBIERROR ("OOM allocating artifact store names\n");
+      goto cleanup;
+   }
+   // Nobody else may be able to put objects in the store, or to replace it
+   // with a symbolic link.
+   if (!(kbwork_make_parents (store_dir ()))
+         || !(kbwork_private_dir (store_dir (), 0700))
+         || !(kbwork_make_parents (objects))) {
+      KBXERROR ("Failed to create artifact store [%s]: %m\n", store_dir ());
+      goto cleanup;
+   }
+   arts->lockfd = open (lockname, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+   if (arts->lockfd < 0) {
+      KBXERROR ("Failed to open [%s]: %m\n", lockname);
+      goto cleanup;
+   }
+   while ((flock (arts->lockfd, LOCK_SH)) != 0) {
+      if (errno != EINTR) {
+         KBXERROR ("Failed to lock [%s]: %m\n", lockname);
+         close (arts->lockfd);
+         arts->lockfd = -1;
+         goto cleanup;
+      }
+   }
+
+   error = false;
+cleanup:
+   free (objects);
+   free (lockname);
+   return !error;
+}
+
+static struct artifact_t *find (kbart_t *arts, const char *name)
+{
+   for (size_t i=0; i<arts->nartifacts; i++) {
+      if ((strcmp (arts->artifacts[i].name, name)) == 0) {
+         return &arts->artifacts[i];
+      }
+   }
+   return NULL;
+}
+
+static bool record (kbart_t *arts, const char *name, const char *object)
+{
+   struct artifact_t *artifact = find (arts, name);
+   if (!artifact) {
+      if (arts->nartifacts >= arts->cap) {
+         size_t newcap = arts->cap ? arts->cap * 2 : 8;
+         struct artifact_t *tmp = realloc (arts->artifacts, newcap * sizeof *tmp);
+         if (!tmp) {
+            KBIERROR ("OOM recording artifact [%s]\n", name);
+            return false;
+         }
+         arts->artifacts = tmp;
+         arts->cap = newcap;
+      }
+      artifact = &arts->artifacts[arts->nartifacts];
+      if (!(artifact->name = ds_str_dup (name))) {
+         KBIERROR ("OOM recording artifact [%s]\n", name);
+         return false;
+      }
+      arts->nartifacts++;
+   }
+   strcpy (artifact->object, object);
+   return true;
+}
+
+bool kbart_put (kbart_t *arts, const char *name, const char *path)
+{
+   bool error = true;
+   char object[KBHASH_HEXLEN + sizeof EXEC_SUFFIX];
+   char *objpath = NULL, *tmpdir = NULL, *tmpfile = NULL;
+   int fd = -1;
+   struct stat sb;
+
+   if (!(store_open (arts))) {
+      goto cleanup;
+   }
+
+   if ((fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0
+         || (fstat (fd, &sb)) != 0) {
+      KBXERROR ("Failed to read artifact [%s]: %m\n", path);
+      goto cleanup;
+   }
+   if (!S_ISREG (sb.st_mode)) {
+      KBXERROR ("Artifact [%s] is not a regular file\n", path);
+      goto cleanup;
+   }
+   if (!(kbhash_fd (fd, object))) {
+      KBXERROR ("Failed to read artifact [%s]: %m\n", path);
+      goto cleanup;
+   }
+   bool exec = sb.st_mode & S_IXUSR;
+   if (exec) {
+      strcat (object, EXEC_SUFFIX);
+   }
+
+   if (!(objpath = ds_str_cat (store_dir (), OBJECTS_DIR, "/", object, NULL))) {
+      KBIERROR ("OOM allocating artifact name\n");
+      goto cleanup;
+   }
+
+   // Only the first producer of these contents copies them into the store
+   if ((lstat (objpath, &sb)) != 0) {
+      if (!(tmpdir = ds_str_cat (store_dir (), "/tmp.XXXXXX", NULL))
+            || !(mkdtemp (tmpdir))
+            || !(tmpfile = ds_str_cat (tmpdir, "/object", NULL))) {
+         KBXERROR ("Failed to create temporary file in [%s]: %m\n", store_dir ());
+         goto cleanup;
+      }
+      if (!(kbwork_copy (path, tmpfile, (uid_t)-1, (gid_t)-1))
+            || (chmod (tmpfile, exec ? 0555 : 0444)) != 0) {
+         KBXERROR ("Failed to copy artifact [%s] to the store: %m\n", path);
+         goto cleanup;
+      }
+      // Another run may have added the same contents in the meantime
+      if ((link (tmpfile, objpath)) != 0 && errno != EEXIST) {
+         KBXERROR ("Failed to add artifact [%s] to the store: %m\n", path);
+         goto cleanup;
+      }
+   }
+
+   if (!(record (arts, name, object))) {
+      goto cleanup;
+   }
+
+   error = false;
+cleanup:
+   if (tmpfile) {
+      unlink (tmpfile);
+   }
+   if (tmpdir) {
+      rmdir (tmpdir);
+   }
+   if (fd >= 0) {
+      close (fd);
+   }
+   free (tmpfile);
+   free (tmpdir);
+   free (objpath);
+   return !error;
+}
+
+bool kbart_get (kbart_t *arts, const char *name, const char *path,
+                uid_t uid, gid_t gid)
+{
+   bool error = true;
+   char *objpath = NULL;
+   struct stat sb;
+
+   const struct artifact_t *artifact = find (arts, name);
+   if (!artifact) {
+      KBXERROR ("Artifact [%s] was not produced by any job of [%s]\n",
+                name, arts->id);
+      return false;
+   }
+   if (!(objpath = ds_str_cat (store_dir (), OBJECTS_DIR, "/", artifact->object, NULL))) {
+      KBIERROR ("OOM allocating artifact name\n");
+      goto cleanup;
+   }
+
+   if ((lstat (path, &sb)) == 0 && !(kbwork_remove (path))) {
+      KBXERROR ("Failed to remove [%s] to replace it with artifact [%s]: %m\n",
+                path, name);
+      goto cleanup;
+   }
+   if (!(kbwork_make_parents (path))) {
+      KBXERROR ("Failed to create the directory of [%s]: %m\n", path);
+      goto cleanup;
+   }
+   // The store may be on another filesystem
+   if ((link (objpath, path)) != 0
+         && !(kbwork_copy (objpath, path, uid, gid))) {
+      KBXERROR ("Failed to link artifact [%s] to [%s]: %m\n", name, path);
+      goto cleanup;
+   }
+
+   error = false;
+cleanup:
+   free (objpath);
+   return !error;
+}
+
@@ -0,0 +1,55 @@
+
+#ifndef H_KBART
+#define H_KBART
+
+// Artifacts: the files that a job passes to the jobs that run after it in the
+// same run. The files named in ARTIFACTS_OUT[] are added to a store when the
+// commands of their node succeed, and the files named in ARTIFACTS_IN[] are
+// hard links to the files in the store, made in the directory of the node
+// before its commands run.
+//
+// The store (in /tmp/kubeka-artifacts unless set) is content-addressed: each
+// file is kept once, as objects/<SHA-256 of its contents>, however many jobs
+// or runs produce it, and is only copied into the store by the first. The
+// files in the store are read-only, and consumers must replace rather than
+// modify them. A file in the store is removed when the last run that uses the
+// store ends, unless it is still linked from elsewhere (from a persistent
+// workspace, for example), so its link count is its reference count. The
+// store must be owned by this process and writable by no one else, or runs
+// that pass artifacts fail.
+
+typedef struct kbart_t kbart_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Keep the store in `dir`, or in the default directory again if `dir` is
+   // NULL. Must be called before any run starts.
+   bool kbart_set_dir (const char *dir);
+
+   // Whether the node `node` produces or consumes artifacts.
+   bool kbart_wanted (const kbnode_t *node);
+
+   // The artifacts of the run `id`. Deleting them releases the store, and
+   // collects the files in it that are no longer used.
+   kbart_t *kbart_new (const char *id);
+   void kbart_del (kbart_t *arts);
+
+   // Add the regular file `path` to the store as the artifact `name` of the
+   // run, replacing any earlier artifact of that name.
+   bool kbart_put (kbart_t *arts, const char *name, const char *path);
+
+   // Link the artifact `name` of the run to `path` (replacing what is there),
+   // or copy it, owned by `uid` and `gid`, if it cannot be linked. Returns
+   // false if no job of the run produced it.
+   bool kbart_get (kbart_t *arts, const char *name, const char *path,
+                   uid_t uid, gid_t gid);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
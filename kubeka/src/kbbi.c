@@ -13,9 +13,15 @@
 #include "ds_str.h"
 
 #include "kbnode.h"
+#include "kbcancel.h"
+#include "kbwork.h"
 #include "kbbi.h"
 #include "kbutil.h"
+#include "kbsink.h"
+#include "kbctx.h"
 #include "kbexec.h"
+#include "kbcache.h"
+#include "kbart.h"
 #include "kbperiod.h"
 
 
@@ -25,7 +31,7 @@
 
 
 #define KBBI_FUNC(x) \
-   static char *x (const char *name, const char *params, const kbnode_t *node,\
+   static char *x (const char *name, const char *params, kbnode_t *node,\
                    size_t *nerrors, const char *fname, size_t line)
 
 KBBI_FUNC(bi_setenv);
@@ -65,7 +71,125 @@ static kbnode_t *find_node (const char *node_id, const ds_array_t *nodes)
    return NULL;
 }
 
-static bool kbbi_rollback (kbnode_t *node, size_t *nerrors, size_t *nwarnings)
+// The output of each command goes to its own sink, which keeps the last
+// OUTPUT_LIMIT bytes of it for the report.
+static kbsink_t *sink_new (const kbnode_t *node, const char *id,
+                           const char *fname, size_t line)
+{
+   size_t limit = KBSINK_DEFAULT_LIMIT;
+   const char *s_limit = kbnode_getvalue_first (node, KBNODE_KEY_OUTPUT_LIMIT);
+   if (s_limit[0] && !(kbsink_parse_limit (s_limit, &limit))) {
+      KBPARSE_WARN (fname, line, "Node [%s]: ignoring invalid OUTPUT_LIMIT [%s]\n",
+               id, s_limit);
+      limit = KBSINK_DEFAULT_LIMIT;
+   }
+   return kbsink_new (id, limit);
+}
+
+// The workspace of the commands of `node`: the one of the run `run`, or a
+// persistent one that belongs to the run, if the node asks for it. Otherwise
+// a new one (possibly a clone of a persistent one) that the caller deletes,
+// with `*own` set.
+static kbwork_t *work_for (const kbnode_t *node, const char *id,
+                           const char *fname, size_t line, kbwork_t *run,
+                           bool *own)
+{
+   enum kbwork_scope_t scope = kbwork_scope_NODE;
+   const char *name = NULL;
+   const char *s_scope = kbnode_getvalue_first (node, KBNODE_KEY_WORKSPACE);
+   if (s_scope[0] && !(kbwork_scope (s_scope, &scope, &name))) {
+      KBPARSE_WARN (fname, line, "Node [%s]: ignoring invalid WORKSPACE [%s]\n",
+               id, s_scope);
+   }
+   *own = false;
+   if (scope == kbwork_scope_RUN && run) {
+      return run;
+   }
+   if (scope == kbwork_scope_PERSISTENT && run) {
+      return kbwork_persistent (run, name);
+   }
+   *own = true;
+   if ((scope == kbwork_scope_CLONE || scope == kbwork_scope_LINK) && run) {
+      return kbwork_clone (run, id, name, scope == kbwork_scope_LINK);
+   }
+   return kbwork_new (kbwork_scope_NODE, id);
+}
+
+// Add the persistent workspaces that `node` and the nodes under it use
+// (directly, or as the source of a clone) to the run `run`.
+static void find_persistent (const kbnode_t *node, kbwork_t *run)
+{
+   enum kbwork_scope_t scope = kbwork_scope_NODE;
+   const char *name = NULL;
+   const char *s_scope = kbnode_getvalue_first (node, KBNODE_KEY_WORKSPACE);
+   if (s_scope[0] && kbwork_scope (s_scope, &scope, &name) && name) {
+      kbwork_persistent (run, name);
+   }
+
+   size_t nnodes = kbnode_nhandlers (node);
+   for (size_t i=0; i<nnodes; i++) {
+      find_persistent (kbnode_handler (node, i), run);
+   }
+   nnodes = kbnode_njobs (node);
+   for (size_t i=0; i<nnodes; i++) {
+      const kbnode_t *job = kbnode_job (node, i);
+      if (job) {
+         find_persistent (job, run);
+      }
+   }
+}
+
+// All the persistent workspaces of a run are locked before its first node
+// starts, rather than as each is needed, so that two runs that share several
+// of them cannot deadlock (see kbwork_lock()).
+static bool run_lock (const kbnode_t *root, kbwork_t *run, kbcancel_t *cancel)
+{
+   if (!run) {
+      return true;
+   }
+   find_persistent (root, run);
+   return kbwork_lock (run, cancel);
+}
+
+// Whether the ROLLBACK of a tree still runs when the run was cancelled.
+static bool g_rollback_on_cancel = false;
+
+void kbbi_rollback_on_cancel (bool enable)
+{
+   g_rollback_on_cancel = enable;
+}
+
+static void print_result (const char *tag, const char *command, int rc,
+                          kbsink_t *sink)
+{
+   size_t total = sink ? kbsink_total (sink) : 0;
+   size_t len = 0;
+   const char *tail = sink ? kbsink_tail (sink, &len) : "";
+
+   // A command that was stopped at its TIMEOUT is reported as such, with the
+   // status that it was killed with.
+   if (rc > 0 && (rc & KBEXEC_TIMEOUT)) {
+      tag = "TIMEOUT";
+      rc &= ~KBEXEC_TIMEOUT;
+   }
+   if (rc > 0 && (rc & KBEXEC_CANCELLED)) {
+      tag = "CANCELLED";
+      rc &= ~KBEXEC_CANCELLED;
+   }
+   printf ("::%s:%s:%i:%zu bytes\n", tag, command, rc, total);
+   if (sink && kbsink_logfile (sink)) {
+      printf ("::LOG:%s\n", kbsink_logfile (sink));
+   }
+   printf ("-----\n");
+   if (len < total) {
+      printf ("[%zu bytes omitted]\n", total - len);
+   }
+   fwrite (tail, 1, len, stdout);
+   printf ("\n-----\n");
+}
+
+static bool kbbi_rollback (kbnode_t *node, kbwork_t *run, kbcancel_t *cancel,
+                           size_t *nerrors, size_t *nwarnings)
 {
    const char *fname = NULL;
    const char *id = NULL;
@@ -86,12 +210,12 @@ static bool kbbi_rollback (kbnode_t *node, size_t *nerrors, size_t *nwarnings)
    KBPARSE_ERROR (fname, line,
          "Attempting ROLLBACK on node [%s] (%zu rollback actions found)\n",
          id, kbutil_strarray_length (actions));
+   bool own;
+   kbwork_t *work = work_for (node, id, fname, line, run, &own);
    for (size_t i=0; actions[i]; i++) {
-      char *result = NULL;
-      size_t result_len = 0;
-      int rc = kbexec_shell (node, actions[i], &result, &result_len);
-      printf ("::ROLLBACK:%s:%i:%zu bytes\n-----\n%s\n-----\n",
-               actions[i], rc, result_len, result);
+      kbsink_t *sink = sink_new (node, id, fname, line);
+      int rc = sink ? kbexec_shell (node, actions[i], work, cancel, sink) : EXIT_FAILURE;
+      print_result ("ROLLBACK", actions[i], rc, sink);
       if (rc) {
          KBPARSE_ERROR (fname, line, "Node [%s] failed to rollback\n", id);
       } else {
@@ -99,12 +223,38 @@ static bool kbbi_rollback (kbnode_t *node, size_t *nerrors, size_t *nwarnings)
                "Successful ROLLBACK on node [%s] (%zu rollback actions found)\n",
                id, kbutil_strarray_length (actions));
       }
-      free (result);
+      kbsink_del (sink);
+   }
+   if (own) {
+      kbwork_del (work);
    }
    return true;
 }
 
-static int kbbi_run (kbnode_t *node, size_t *nerrors, size_t *nwarnings)
+// Link the ARTIFACTS_IN[] of `node` into `wdir` or, with `out` set, add its
+// ARTIFACTS_OUT[] in `wdir` to the store.
+static bool artifacts (const kbnode_t *node, const char *id,
+                       const char *fname, size_t line, kbart_t *arts,
+                       const char *wdir, uid_t uid, gid_t gid, bool out)
+{
+   const char **names = kbnode_getvalue_all (node,
+         out ? KBNODE_KEY_ARTIFACTS_OUT : KBNODE_KEY_ARTIFACTS_IN);
+   for (size_t i=0; names && names[i] && names[i][0]; i++) {
+      char *path = arts ? ds_str_cat (wdir, "/", names[i], NULL) : NULL;
+      bool ok = path && (out ? kbart_put (arts, names[i], path)
+                             : kbart_get (arts, names[i], path, uid, gid));
+      free (path);
+      if (!ok) {
+         KBPARSE_ERROR (fname, line, "Node [%s]: failed to %s artifact [%s]\n",
+                  id, out ? "store" : "fetch", names[i]);
+         return false;
+      }
+   }
+   return true;
+}
+
+static int kbbi_run (kbnode_t *node, kbwork_t *run, kbart_t *arts,
+                     kbcancel_t *cancel, size_t *nerrors, size_t *nwarnings)
 {
    int ret = EXIT_FAILURE;
    const char *s_message = kbnode_getvalue_first (node, KBNODE_KEY_MESSAGE);
@@ -123,72 +273,151 @@ static int kbbi_run (kbnode_t *node, size_t *nerrors, size_t *nwarnings)
       goto cleanup;
    }
 
+   // Nothing more is started once the run is cancelled
+   if (kbcancel_fired (cancel)) {
+      KBPARSE_ERROR (fname, line, "Node [%s] not started, run was cancelled\n", id);
+      ret = KBEXEC_CANCELLED;
+      goto cleanup;
+   }
+
    printf ("::STARTING:%s:%s\n", id, s_message);
 
 
    // Execute all the handlers (should this be first?)
-   ds_array_t *handler_nodes = kbnode_filter_handlers (kbnode_handlers (node),
-                                                       signals);
-   size_t nnodes = ds_array_length (handler_nodes);
-   if (!handler_nodes) {
-      KBIERROR ("OOM allocating handlers list\n");
-      INCPTR (*nerrors);
-      goto cleanup;
-   } else {
-      ret = 0;
-   }
+   size_t nnodes = kbnode_nhandlers (node);
+   ret = 0;
 
    for (size_t i=0; i < nnodes; i++) {
-      kbnode_t *handler_node = ds_array_get (handler_nodes, i);
-      ret += kbbi_run (handler_node, nerrors, nwarnings);
+      kbnode_t *handler_node = kbnode_handler (node, i);
+      if (!(kbnode_handles (handler_node, signals))) {
+         continue;
+      }
+      ret += kbbi_run (handler_node, run, arts, cancel, nerrors, nwarnings);
       done = true;
    }
-   ds_array_del (handler_nodes);
    if (done) {
       goto cleanup;
    }
 
 
-   // Execute all the EXEC statements
-   for (size_t i=0; s_exec && s_exec[i] && s_exec[i][0]; i++) {
-      char *result = NULL;
-      size_t result_len = 0;
-      ret |= kbexec_shell (node, s_exec[i], &result, &result_len);
-      printf ("::COMMAND:%s:%i:%zu bytes\n-----\n%s\n-----\n",
-               s_exec[i], ret, result_len, result);
-      free (result);
+   // Execute all the EXEC statements, in the same workspace, unless their
+   // result can be restored from the cache
+   bool own = false;
+   kbwork_t *work = s_exec && s_exec[0] && s_exec[0][0]
+                  ? work_for (node, id, fname, line, run, &own) : NULL;
+   kbcache_t *cache = NULL;
+   bool cached = false;
+   bool ready = true;
+   char *wdir = NULL;
+   uid_t uid = (uid_t)-1;
+   gid_t gid = (gid_t)-1;
+   if (work && (kbcache_wanted (node) || kbart_wanted (node))
+         && !(wdir = kbexec_workdir (node, work, &uid, &gid))) {
+      ready = false;
+   }
+   // The artifacts of earlier jobs are linked in first, as they may be
+   // inputs of the cache
+   if (wdir && !(artifacts (node, id, fname, line, arts, wdir, uid, gid, false))) {
+      ready = false;
+   }
+   if (!ready) {
+      ret = EXIT_FAILURE;
       done = true;
    }
+   if (ready && wdir && kbcache_wanted (node)) {
+      cache = kbcache_new (node, wdir, uid, gid);
+   }
+   if (cache && kbcache_restore (cache)) {
+      for (size_t i=0; s_exec[i] && s_exec[i][0]; i++) {
+         size_t len = 0;
+         const char *output = kbcache_output (cache, i, &len);
+         kbsink_t *sink = sink_new (node, id, fname, line);
+         if (sink) {
+            kbsink_write (sink, output, len);
+         }
+         print_result ("CACHED", s_exec[i], 0, sink);
+         kbsink_del (sink);
+      }
+      cached = done = true;
+   }
+   for (size_t i=0; ready && !cached && s_exec && s_exec[i] && s_exec[i][0]; i++) {
+      if (kbcancel_fired (cancel)) {
+         break;
+      }
+      kbsink_t *sink = sink_new (node, id, fname, line);
+      int rc = sink ? kbexec_shell (node, s_exec[i], work, cancel, sink) : EXIT_FAILURE;
+      print_result ("COMMAND", s_exec[i], rc, sink);
+      if (cache && !rc) {
+         size_t len = 0;
+         const char *output = kbsink_tail (sink, &len);
+         kbcache_add_output (cache, output, len);
+      }
+      ret |= rc;
+      kbsink_del (sink);
+      done = true;
+   }
+   // Only the result of commands that all succeeded is stored
+   if (cache && !cached && !ret && !(kbcancel_fired (cancel))) {
+      kbcache_store (cache);
+   }
+   kbcache_del (cache);
+   if (done && !ret && wdir && !(kbcancel_fired (cancel))
+         && !(artifacts (node, id, fname, line, arts, wdir, uid, gid, true))) {
+      ret = EXIT_FAILURE;
+   }
+   free (wdir);
+   if (own) {
+      kbwork_del (work);
+   }
    if (done) {
       goto cleanup;
    }
 
 
    // Execute all the jobs
-   const ds_array_t *jobs = kbnode_jobs (node);
-   nnodes = ds_array_length (jobs);
+   nnodes = kbnode_njobs (node);
 
    for (size_t i=0; i < nnodes; i++) {
-      kbnode_t *job = ds_array_get (jobs, i);
-      if ((ret = kbbi_run (job, nerrors, nwarnings)) != EXIT_SUCCESS) {
+      kbnode_t *job = kbnode_job (node, i);
+      if (!job) {
+         // Detached from the tree
+         continue;
+      }
+      if ((ret = kbbi_run (job, run, arts, cancel, nerrors, nwarnings)) != EXIT_SUCCESS) {
          const char *fname = NULL, *id = NULL;
          size_t line = 0;
          kbnode_get_srcdef (job, &id, &fname, &line);
-         KBPARSE_ERROR (fname, line, "Error executing job[%s]:\n", id);
-         kbnode_dump (job, stderr, 0);
+         if (kbcancel_fired (cancel)) {
+            if (!g_rollback_on_cancel) {
+               KBPARSE_ERROR (fname, line,
+                        "Job [%s] cancelled, remaining jobs skipped\n", id);
+               goto cleanup;
+            }
+            // The rollback must not be cancelled by the same token
+            KBPARSE_ERROR (fname, line,
+                     "Job [%s] cancelled, rolling back\n", id);
+            cancel = NULL;
+         } else {
+            KBPARSE_ERROR (fname, line, "Error executing job[%s]:\n", id);
+            kbnode_dump (job, stderr, 0);
+         }
          INCPTR (*nwarnings);
          for (size_t j=i; j>0; j--) {
-            kbnode_t *rbnode = ds_array_get (jobs, j);
-            if (!(kbbi_rollback (rbnode, nerrors, nwarnings))) {
+            kbnode_t *rbnode = kbnode_job (node, j);
+            if (!rbnode) {
+               continue;
+            }
+            if (!(kbbi_rollback (rbnode, run, cancel, nerrors, nwarnings))) {
                INCPTR (*nerrors);
                KBPARSE_ERROR (fname, line, "Rollback failure in child:\n");
                kbnode_dump (rbnode, stderr, 1);
             }
          }
-         if (!(kbbi_rollback (ds_array_get (jobs, 0), nerrors, nwarnings))) {
+         if (kbnode_job (node, 0) &&
+               !(kbbi_rollback (kbnode_job (node, 0), run, cancel, nerrors, nwarnings))) {
             INCPTR (*nerrors);
             KBPARSE_ERROR (fname, line, "Rollback failure in child:\n");
-            kbnode_dump (ds_array_get (jobs, 0), stderr, 1);
+            kbnode_dump (kbnode_job (node, 0), stderr, 1);
          }
          goto cleanup;
       }
@@ -202,7 +431,7 @@ static int kbbi_run (kbnode_t *node, size_t *nerrors, size_t *nwarnings)
             "Failed to find one of JOBS[], EXEC or EMITS in node [%s]\n", id);
 
 cleanup:
-   if (ret != EXIT_SUCCESS) {
+   if (ret != EXIT_SUCCESS && !(ret & KBEXEC_CANCELLED)) {
       KBPARSE_ERROR (fname, line,
                "Failed to run node [%s]. Full node follows:\n", id);
       kbnode_dump (node, stderr, 0);
@@ -211,7 +440,7 @@ cleanup:
    return ret;
 }
 
-int kbbi_launch (const char *node_id, ds_array_t *nodes,
+int kbbi_launch (const char *node_id, ds_array_t *nodes, kbcancel_t *cancel,
                  size_t *nerrors, size_t *nwarnings)
 {
    kbnode_t *target = find_node (node_id, nodes);
@@ -221,22 +450,35 @@ int kbbi_launch (const char *node_id, ds_array_t *nodes,
       return EXIT_FAILURE;
    }
 
-   return kbbi_run (target, nerrors, nwarnings);
+   // Nodes with WORKSPACE = run share this workspace
+   kbwork_t *run = kbwork_new (kbwork_scope_RUN, node_id);
+   if (!(run_lock (target, run, cancel))) {
+      KBXERROR ("Node [%s] not started, its persistent workspaces could not "
+                "be locked\n", node_id);
+      INCPTR (*nerrors);
+      kbwork_del (run);
+      return kbcancel_fired (cancel) ? KBEXEC_CANCELLED : EXIT_FAILURE;
+   }
+   // The artifacts that the jobs pass to each other
+   kbart_t *arts = kbart_new (node_id);
+   int ret = kbbi_run (target, run, arts, cancel, nerrors, nwarnings);
+   kbwork_del (run);
+   kbart_del (arts);
+   return ret;
 }
 
 
 #define KBBI_DEFINITION(x) \
-   static char *x (const char *name, const char *params, const kbnode_t *node,\
+   static char *x (const char *name, const char *params, kbnode_t *node,\
                    size_t *nerrors, const char *fname, size_t line)
 
 KBBI_FUNC(bi_setenv)
 {
    (void)name;
-   (void)node;
 
-   // Some very platform-specific code goes here, due to how hard it is
-   // (some would say impossible) to set environments without leaking
-   // memory.
+   // The variable is set for the commands of the node and its subtree only;
+   // the environment of the daemon is shared by every tree, and is never
+   // changed.
    errno = 0;
 
    char **p = kbutil_strsplit (params, '=');
@@ -255,8 +497,7 @@ KBBI_FUNC(bi_setenv)
       return NULL;
    }
 
-   int rc = setenv (p[0], p[1], 1);
-   if (rc != 0) {
+   if (!(kbnode_setenv (node, p[0], p[1]))) {
       KBPARSE_ERROR (fname, line, "Failed to set env [%s] = [%s]\n",
                p[0], p[1]);
       INCPTR (*nerrors);
@@ -269,12 +510,11 @@ KBBI_FUNC(bi_setenv)
 KBBI_FUNC(bi_getenv)
 {
    (void)name;
-   (void)node;
    (void)nerrors;
    (void)fname;
    (void)line;
 
-   char *value = getenv (params);
+   const char *value = kbnode_getenv (node, params);
    if (!value) {
       value = "";
    }
@@ -321,13 +561,15 @@ void *th_periodic (void *params)
 
    size_t nerrors = 0, nwarnings = 0;
    int ret = EXIT_FAILURE;
-   while (*p->endflag == 0) {
+   while (!(kbcancel_fired (p->cancel))) {
 
       if (counter == 0) {
          break;
       }
 
-      sleep (1);
+      if (kbcancel_wait (p->cancel, 1000)) {
+         break;
+      }
 
       if ((kbperiod_remaining (period)) != 0) {
          continue;
@@ -349,7 +591,14 @@ void *th_periodic (void *params)
          }
       }
 
-      if ((ret = kbbi_run (p->root, &nerrors, &nwarnings)) != EXIT_SUCCESS) {
+      kbwork_t *run = kbwork_new (kbwork_scope_RUN, id);
+      kbart_t *arts = kbart_new (id);
+      ret = run_lock (p->root, run, p->cancel)
+          ? kbbi_run (p->root, run, arts, p->cancel, &nerrors, &nwarnings)
+          : EXIT_FAILURE;
+      kbwork_del (run);
+      kbart_del (arts);
+      if (ret != EXIT_SUCCESS) {
          KBPARSE_ERROR (fname, line, "Node [%s] failed to run [error %zu]\n",
                   id, nerrors);
          nerrors++;
@@ -362,7 +611,6 @@ void *th_periodic (void *params)
    }
 
    KBWARN ("Shutting down node %s with return code: %i\n", id, ret);
-   p->completed = true;
    p->retcode = ret;
    kbperiod_del (period);
    return NULL;
@@ -371,26 +619,13 @@ void *th_periodic (void *params)
 
 bool kbbi_thread_launch (struct kbbi_thread_t *th)
 {
-   bool error = true;
+   int rc = -1;
    th->retcode = EXIT_FAILURE;
-   th->completed = false;
-   th->tid = (pthread_t)-1;
-
-   pthread_attr_t attr;
-   int rc = pthread_attr_init (&attr);
-   if (rc != 0) {
-      KBIERROR ("Failed to initialise thread attribute\n");
-      goto cleanup;
-   }
-   if ((pthread_attr_setdetachstate (&attr, 1)) != 0) {
-      KBIERROR ("Failed to set thread to detached state\n");
-      goto cleanup;
-   }
-
 
+   // The thread is joinable, so that kbbi_thread_join() can wait for it
    switch (kbnode_type (th->root)) {
       case kbnode_type_PERIODIC:
-         rc = pthread_create ((pthread_t *)&th->tid, &attr, th_periodic, th);
+         rc = pthread_create (&th->tid, NULL, th_periodic, th);
          break;
 
       case kbnode_type_JOB:
@@ -402,17 +637,19 @@ bool kbbi_thread_launch (struct kbbi_thread_t *th)
    }
    if (rc != 0) {
       KBIERROR ("Failed to start thread\n");
-      goto cleanup;
+      return false;
    }
-
-   error = false;
-cleanup:
-   pthread_attr_destroy (&attr);
-   return !error;
+   return true;
 }
 
 void kbbi_thread_cancel (struct kbbi_thread_t *th)
 {
-   pthread_cancel (th->tid);
+   kbcancel_fire (th->cancel);
+}
+
+int kbbi_thread_join (struct kbbi_thread_t *th)
+{
+   pthread_join (th->tid, NULL);
+   return th->retcode;
 }
 
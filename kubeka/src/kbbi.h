@@ -3,15 +3,14 @@
 #define H_KBBI
 
 typedef char *(kbbi_fptr_t) (const char *name, const char *params,
-                             const kbnode_t *node,
+                             kbnode_t *node,
                              size_t *nerrors, const char *fname, size_t line);
 
 struct kbbi_thread_t {
-   volatile sig_atomic_t *endflag; // TODO: Use cmpxchange calls
-   volatile pthread_t tid; // TODO: Use cmpxchange calls
+   kbcancel_t *cancel;
+   pthread_t tid;
    kbnode_t *root;
    int retcode;
-   volatile bool completed; // TODO: Use cmpxchange calls
 };
 
 #ifdef __cplusplus
@@ -20,12 +19,24 @@ extern "C" {
 
    kbbi_fptr_t *kbbi_fptr (const char *name);
 
-   int kbbi_launch (const char *name, ds_array_t *nodes,
+   // Run the node `name`. Once `cancel` fires the commands that are running
+   // are stopped, nothing more is started, and the ROLLBACK of the failed
+   // job is skipped unless kbbi_rollback_on_cancel() enabled it.
+   int kbbi_launch (const char *name, ds_array_t *nodes, kbcancel_t *cancel,
                     size_t *nerrors, size_t *nwarnings);
 
+   void kbbi_rollback_on_cancel (bool enable);
+
+   // Start a thread that runs the tree `th->root` until `th->cancel` fires.
+   // Every thread that was launched must be joined with kbbi_thread_join().
    bool kbbi_thread_launch (struct kbbi_thread_t *th);
+
+   // Fires the token of the thread, which stops every thread sharing it.
    void kbbi_thread_cancel (struct kbbi_thread_t *th);
 
+   // Waits for the thread to end, and returns its return code.
+   int kbbi_thread_join (struct kbbi_thread_t *th);
+
 
 #ifdef __cplusplus
 };
@@ -0,0 +1,708 @@
+
+// For environ
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <pthread.h>
+
+#include "ds_array.h"
+#include "ds_str.h"
+
+#include "kbutil.h"
+#include "kbnode.h"
+#include "kbhash.h"
+#include "kbcancel.h"
+#include "kbwork.h"
+#include "kbcache.h"
+
+#define DEFAULT_DIR     "/tmp/kubeka-cache"
+#define STAT_DIR        "/stat"
+#define FILES_DIR       "/files"
+
+// Changed whenever what goes into a key changes, so that old results are
+// never used.
+#define KEY_VERSION     "kubeka-cache-1"
+
+static char *g_dir = NULL;
+static uint64_t g_size = KBCACHE_DEFAULT_SIZE;
+
+// Results are only removed with the write lock held, so that none is removed
+// while it is being restored.
+static pthread_rwlock_t g_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+struct kbcache_t {
+   const kbnode_t *node;
+   char *wdir;
+   uid_t uid;
+   gid_t gid;
+   char key[KBHASH_HEXLEN + 1];
+   char *entry;
+
+   char **outputs;
+   size_t *lens;
+   size_t noutputs;
+   size_t ncommands;
+};
+
+static const char *cache_dir (void)
+{
+   return g_dir ? g_dir : DEFAULT_DIR;
+}
+
+// Results are only looked up in a directory that nobody else can have put
+// them in (see kbwork_private_dir()).
+static bool cache_open (void)
+{
+   if (!(kbwork_make_parents (cache_dir ()))) {
+      KBXERROR ("Failed to create cache directory [%s]: %m\n", cache_dir ());
+      return false;
+   }
+   return kbwork_private_dir (cache_dir (), 0700);
+}
+
+bool kbcache_set_dir (const char *dir, uint64_t size)
+{
+   free (g_dir);
+   g_dir = NULL;
+   g_size = size;
+   if (dir && !(g_dir = ds_str_dup (dir))) {
+      KBIERROR ("OOM copying cache directory name %s\n", dir);
+      return false;
+   }
+   return true;
+}
+
+bool kbcache_wanted (const kbnode_t *node)
+{
+   return kbnode_getvalue_first (node, KBNODE_KEY_CACHE_INPUTS)[0]
+       || kbnode_getvalue_first (node, KBNODE_KEY_CACHE_OUTPUTS)[0];
+}
+
+static char *chomp (char *line)
+{
+   line[strcspn (line, "\n")] = 0;
+   return line;
+}
+
+static char *join (const char *dir, const char *path)
+{
+   return path[0] == '/' ? ds_str_dup (path) : ds_str_cat (dir, "/", path, NULL);
+}
+
+
+/* ********************************************************************
+ * Keys
+ */
+
+// The digest of the contents of the regular file `path`, taken from the stat
+// index if the file did not change since it was last read.
+static bool hash_file (const char *path, const struct stat *sb, char *hex)
+{
+   bool error = true;
+   kbhash_t hash;
+   char name[KBHASH_HEXLEN + 1];
+   char *index = NULL, *tmp = NULL;
+   FILE *inf = NULL;
+   int fd = -1, tfd = -1;
+   char line[256];
+
+   kbhash_init (&hash);
+   kbhash_string (&hash, path);
+   kbhash_final (&hash, name);
+
+   snprintf (line, sizeof line, "%ju %ju %jd %jd %ld %jd %ld",
+             (uintmax_t)sb->st_dev, (uintmax_t)sb->st_ino,
+             (intmax_t)sb->st_size,
+             (intmax_t)sb->st_mtim.tv_sec, sb->st_mtim.tv_nsec,
+             (intmax_t)sb->st_ctim.tv_sec, sb->st_ctim.tv_nsec);
+
+   if (!(index = ds_str_cat (cache_dir (), STAT_DIR, "/", name, NULL))) {
+      KBIERROR ("OOM allocating stat index name\n");
+      goto cleanup;
+   }
+
+   if ((inf = fopen (index, "re"))) {
+      char stored[sizeof line];
+      char digest[KBHASH_HEXLEN + 2];
+      if ((fgets (stored, sizeof stored, inf))
+            && (fgets (digest, sizeof digest, inf))
+            && (strcmp (chomp (stored), line)) == 0
+            && (strlen (chomp (digest))) == KBHASH_HEXLEN) {
+         strcpy (hex, digest);
+         error = false;
+         goto cleanup;
+      }
+   }
+
+   if ((fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0
+         || !(kbhash_fd (fd, hex))) {
+      KBWARN ("Failed to read cache input [%s]: %m\n", path);
+      goto cleanup;
+   }
+   error = false;
+
+   // Failing to update the index only means that the file is read again
+   // next time.
+   if (!(tmp = ds_str_cat (index, ".XXXXXX", NULL))
+         || !(kbwork_make_parents (tmp))
+         || (tfd = mkostemp (tmp, O_CLOEXEC)) < 0) {
+      goto cleanup;
+   }
+   dprintf (tfd, "%s\n%s\n", line, hex);
+   if ((rename (tmp, index)) != 0) {
+      unlink (tmp);
+   }
+
+cleanup:
+   if (inf) {
+      fclose (inf);
+   }
+   if (fd >= 0) {
+      close (fd);
+   }
+   if (tfd >= 0) {
+      close (tfd);
+   }
+   free (tmp);
+   free (index);
+   return !error;
+}
+
+static int name_cmp (const struct dirent **lhs, const struct dirent **rhs)
+{
+   return strcmp ((*lhs)->d_name, (*rhs)->d_name);
+}
+
+// Add the input `path` to the key: the contents of a file, the target of a
+// symbolic link, or (in order) the names and contents of everything in a
+// directory. An input that does not exist is part of the key too.
+static bool hash_input (kbhash_t *hash, const char *path)
+{
+   struct stat sb;
+   char hex[KBHASH_HEXLEN + 1];
+
+   if ((lstat (path, &sb)) != 0) {
+      if (errno != ENOENT) {
+         KBWARN ("Failed to stat cache input [%s]: %m\n", path);
+         return false;
+      }
+      kbhash_string (hash, "missing");
+      return true;
+   }
+
+   if (S_ISREG (sb.st_mode)) {
+      if (!(hash_file (path, &sb, hex))) {
+         return false;
+      }
+      kbhash_string (hash, (sb.st_mode & S_IXUSR) ? "exec" : "file");
+      kbhash_string (hash, hex);
+      return true;
+   }
+
+   if (S_ISLNK (sb.st_mode)) {
+      char target[4096];
+      ssize_t nbytes = readlink (path, target, sizeof target - 1);
+      if (nbytes < 0) {
+         KBWARN ("Failed to read cache input [%s]: %m\n", path);
+         return false;
+      }
+      target[nbytes] = 0;
+      kbhash_string (hash, "link");
+      kbhash_string (hash, target);
+      return true;
+   }
+
+   if (!S_ISDIR (sb.st_mode)) {
+      kbhash_string (hash, "other");
+      return true;
+   }
+
+   struct dirent **names = NULL;
+   int nnames = scandir (path, &names, NULL, name_cmp);
+   if (nnames < 0) {
+      KBWARN ("Failed to read cache input [%s]: %m\n", path);
+      return false;
+   }
+   bool error = false;
+   kbhash_string (hash, "dir");
+   for (int i=0; i<nnames; i++) {
+      const char *name = names[i]->d_name;
+      if (!error && (strcmp (name, ".")) != 0 && (strcmp (name, "..")) != 0) {
+         char *child = ds_str_cat (path, "/", name, NULL);
+         kbhash_string (hash, name);
+         error = !child || !(hash_input (hash, child));
+         free (child);
+      }
+      free (names[i]);
+   }
+   free (names);
+   kbhash_string (hash, "end");
+   return !error;
+}
+
+static int env_cmp (const void *lhs, const void *rhs)
+{
+   return strcmp (*(const char **)lhs, *(const char **)rhs);
+}
+
+// The environment that the commands of `node` run in.
+static bool hash_environment (kbhash_t *hash, const kbnode_t *node)
+{
+   char **envp = NULL;
+   if (!(kbnode_environ (node, &envp))) {
+      return false;
+   }
+   char *const *env = envp ? envp : environ;
+
+   size_t nvars = 0;
+   while (env && env[nvars]) {
+      nvars++;
+   }
+   const char **vars = malloc ((nvars + 1) * sizeof *vars);
+   if (!vars) {
+      KBIERROR ("OOM copying environment\n");
+      kbutil_strarray_del (envp);
+      return false;
+   }
+   memcpy (vars, env, nvars * sizeof *vars);
+   qsort (vars, nvars, sizeof *vars, env_cmp);
+   for (size_t i=0; i<nvars; i++) {
+      kbhash_string (hash, "env");
+      kbhash_string (hash, vars[i]);
+   }
+   free (vars);
+   kbutil_strarray_del (envp);
+   return true;
+}
+
+static bool make_key (kbcache_t *cache)
+{
+   static const char *keys[] = {
+      KBNODE_KEY_SHELL,
+      KBNODE_KEY_WUSER,
+      KBNODE_KEY_WGROUP,
+      KBNODE_KEY_WDIR,
+      KBNODE_KEY_WORKSPACE,
+      KBNODE_KEY_STDIN,
+   };
+   kbhash_t hash;
+   const char **values;
+
+   kbhash_init (&hash);
+   kbhash_string (&hash, KEY_VERSION);
+
+   values = kbnode_getvalue_all (cache->node, KBNODE_KEY_EXEC);
+   for (size_t i=0; values && values[i] && values[i][0]; i++) {
+      kbhash_string (&hash, KBNODE_KEY_EXEC);
+      kbhash_string (&hash, values[i]);
+      cache->ncommands++;
+   }
+   for (size_t i=0; i<sizeof keys / sizeof keys[0]; i++) {
+      kbhash_string (&hash, keys[i]);
+      kbhash_string (&hash, kbnode_getvalue_first (cache->node, keys[i]));
+   }
+   values = kbnode_getvalue_all (cache->node, KBNODE_KEY_CACHE_OUTPUTS);
+   for (size_t i=0; values && values[i] && values[i][0]; i++) {
+      kbhash_string (&hash, KBNODE_KEY_CACHE_OUTPUTS);
+      kbhash_string (&hash, values[i]);
+   }
+
+   if (!(hash_environment (&hash, cache->node))) {
+      return false;
+   }
+
+   values = kbnode_getvalue_all (cache->node, KBNODE_KEY_CACHE_INPUTS);
+   for (size_t i=0; values && values[i] && values[i][0]; i++) {
+      char *path = join (cache->wdir, values[i]);
+      kbhash_string (&hash, KBNODE_KEY_CACHE_INPUTS);
+      kbhash_string (&hash, values[i]);
+      bool ok = path && hash_input (&hash, path);
+      free (path);
+      if (!ok) {
+         return false;
+      }
+   }
+
+   kbhash_final (&hash, cache->key);
+   return true;
+}
+
+kbcache_t *kbcache_new (const kbnode_t *node, const char *wdir,
+                        uid_t uid, gid_t gid)
+{
+   kbcache_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      KBIERROR ("OOM allocating cache entry\n");
+      return NULL;
+   }
+   ret->node = node;
+   ret->uid = uid;
+   ret->gid = gid;
+   if (!(cache_open ())) {
+      KBWARN ("Running node without the cache\n");
+      goto errorexit;
+   }
+   if (!(ret->wdir = ds_str_dup (wdir))) {
+      KBIERROR ("OOM copying directory name %s\n", wdir);
+      goto errorexit;
+   }
+   if (!(make_key (ret))) {
+      goto errorexit;
+   }
+   if (!(ret->entry = ds_str_cat (cache_dir (), "/", ret->key, NULL))) {
+      KBIERROR ("OOM allocating cache entry name\n");
+      goto errorexit;
+   }
+   return ret;
+
+errorexit:
+   kbcache_del (ret);
+   return NULL;
+}
+
+void kbcache_del (kbcache_t *cache)
+{
+   if (!cache) {
+      return;
+   }
+   for (size_t i=0; i<cache->noutputs; i++) {
+      free (cache->outputs[i]);
+   }
+   free (cache->outputs);
+   free (cache->lens);
+   free (cache->entry);
+   free (cache->wdir);
+   free (cache);
+}
+
+
+/* ********************************************************************
+ * Results
+ */
+
+// Read the whole of `path` into a nul-terminated string.
+static char *read_file (const char *path, size_t *len)
+{
+   char *ret = NULL;
+   struct stat sb;
+   int fd = open (path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0) {
+      return NULL;
+   }
+   if ((fstat (fd, &sb)) == 0 && (ret = malloc ((size_t)sb.st_size + 1))) {
+      ssize_t nbytes = read (fd, ret, (size_t)sb.st_size);
+      if (nbytes != sb.st_size) {
+         free (ret);
+         ret = NULL;
+      } else {
+         ret[nbytes] = 0;
+         *len = (size_t)nbytes;
+      }
+   }
+   close (fd);
+   return ret;
+}
+
+bool kbcache_add_output (kbcache_t *cache, const char *output, size_t len)
+{
+   char **outputs = realloc (cache->outputs, (cache->noutputs + 1) * sizeof *outputs);
+   if (outputs) {
+      cache->outputs = outputs;
+   }
+   size_t *lens = realloc (cache->lens, (cache->noutputs + 1) * sizeof *lens);
+   if (lens) {
+      cache->lens = lens;
+   }
+   char *copy = malloc (len + 1);
+   if (!outputs || !lens || !copy) {
+      KBIERROR ("OOM recording command output\n");
+      free (copy);
+      return false;
+   }
+   memcpy (copy, output, len);
+   copy[len] = 0;
+   cache->outputs[cache->noutputs] = copy;
+   cache->lens[cache->noutputs] = len;
+   cache->noutputs++;
+   return true;
+}
+
+const char *kbcache_output (const kbcache_t *cache, size_t index, size_t *len)
+{
+   if (index >= cache->noutputs) {
+      *len = 0;
+      return "";
+   }
+   *len = cache->lens[index];
+   return cache->outputs[index];
+}
+
+bool kbcache_restore (kbcache_t *cache)
+{
+   bool error = true;
+   const char **paths = kbnode_getvalue_all (cache->node, KBNODE_KEY_CACHE_OUTPUTS);
+   char *src = NULL, *dst = NULL;
+   struct stat sb;
+
+   pthread_rwlock_rdlock (&g_lock);
+
+   if ((stat (cache->entry, &sb)) != 0) {
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<cache->ncommands; i++) {
+      char name[32];
+      size_t len = 0;
+      snprintf (name, sizeof name, "/out.%zu", i);
+      free (src);
+      if (!(src = ds_str_cat (cache->entry, name, NULL))) {
+         KBIERROR ("OOM allocating cache entry name\n");
+         goto cleanup;
+      }
+      char *output = read_file (src, &len);
+      if (!output) {
+         goto cleanup;
+      }
+      bool ok = kbcache_add_output (cache, output, len);
+      free (output);
+      if (!ok) {
+         goto cleanup;
+      }
+   }
+
+   // Outputs left by a previous run are replaced
+   for (size_t i=0; paths && paths[i] && paths[i][0]; i++) {
+      free (src);
+      free (dst);
+      src = ds_str_cat (cache->entry, FILES_DIR, "/", paths[i], NULL);
+      dst = ds_str_cat (cache->wdir, "/", paths[i], NULL);
+      if (!src || !dst) {
+         KBIERROR ("OOM allocating cache output names\n");
+         goto cleanup;
+      }
+      if ((lstat (dst, &sb)) == 0 && !(kbwork_remove (dst))) {
+         KBWARN ("Failed to remove [%s] to restore it from the cache: %m\n", dst);
+         goto cleanup;
+      }
+      if (!(kbwork_make_parents (dst)) || !(kbwork_copy (src, dst, cache->uid, cache->gid))) {
+         KBWARN ("Failed to restore [%s] from the cache: %m\n", dst);
+         goto cleanup;
+      }
+   }
+
+   // The time of last use of a result is the modification time of its
+   // directory.
+   utimensat (AT_FDCWD, cache->entry, NULL, 0);
+
+   error = false;
+cleanup:
+   pthread_rwlock_unlock (&g_lock);
+   free (src);
+   free (dst);
+   return !error;
+}
+
+struct lru_t {
+   char *name;
+   struct timespec used;
+   uint64_t size;
+};
+
+static int lru_cmp (const void *lhs, const void *rhs)
+{
+   const struct lru_t *l = lhs, *r = rhs;
+   if (l->used.tv_sec != r->used.tv_sec) {
+      return l->used.tv_sec < r->used.tv_sec ? -1 : 1;
+   }
+   if (l->used.tv_nsec != r->used.tv_nsec) {
+      return l->used.tv_nsec < r->used.tv_nsec ? -1 : 1;
+   }
+   return 0;
+}
+
+// Remove the least recently used results, other than `keep`, until they take
+// no more than the size limit.
+static void evict (const char *keep)
+{
+   DIR *dir = NULL;
+   struct lru_t *lru = NULL;
+   size_t nlru = 0, cap = 0;
+   uint64_t total = 0;
+
+   if (!g_size) {
+      return;
+   }
+
+   pthread_rwlock_wrlock (&g_lock);
+
+   if (!(dir = opendir (cache_dir ()))) {
+      goto cleanup;
+   }
+
+   struct dirent *de;
+   while ((de = readdir (dir))) {
+      struct stat sb;
+      if ((strlen (de->d_name)) != KBHASH_HEXLEN
+            || (fstatat (dirfd (dir), de->d_name, &sb, AT_SYMLINK_NOFOLLOW)) != 0
+            || !S_ISDIR (sb.st_mode)) {
+         continue;
+      }
+      if (nlru >= cap) {
+         size_t newcap = cap ? cap * 2 : 16;
+         struct lru_t *tmp = realloc (lru, newcap * sizeof *tmp);
+         if (!tmp) {
+            KBIERROR ("OOM listing cached results\n");
+            goto cleanup;
+         }
+         lru = tmp;
+         cap = newcap;
+      }
+      if (!(lru[nlru].name = ds_str_dup (de->d_name))) {
+         KBIERROR ("OOM listing cached results\n");
+         goto cleanup;
+      }
+      lru[nlru].used = sb.st_mtim;
+      lru[nlru].size = 0;
+      nlru++;
+   }
+
+   for (size_t i=0; i<nlru; i++) {
+      char *path = ds_str_cat (cache_dir (), "/", lru[i].name, NULL);
+      lru[i].size = path ? kbwork_usage (path) : 0;
+      total += lru[i].size;
+      free (path);
+   }
+
+   qsort (lru, nlru, sizeof *lru, lru_cmp);
+
+   for (size_t i=0; i<nlru && total > g_size; i++) {
+      if ((strcmp (lru[i].name, keep)) == 0) {
+         continue;
+      }
+      char *path = ds_str_cat (cache_dir (), "/", lru[i].name, NULL);
+      if (path && !(kbwork_remove (path))) {
+         KBWARN ("Failed to remove cached result [%s]: %m\n", path);
+      }
+      free (path);
+      total -= lru[i].size;
+   }
+
+cleanup:
+   for (size_t i=0; i<nlru; i++) {
+      free (lru[i].name);
+   }
+   free (lru);
+   if (dir) {
+      closedir (dir);
+   }
+   pthread_rwlock_unlock (&g_lock);
+}
+
+bool kbcache_store (kbcache_t *cache)
+{
+   bool error = true;
+   const char **paths = kbnode_getvalue_all (cache->node, KBNODE_KEY_CACHE_OUTPUTS);
+   char *tmp = NULL, *src = NULL, *dst = NULL;
+   struct stat sb;
+
+   if (cache->noutputs != cache->ncommands) {
+      return false;
+   }
+
+   // A result without all of its outputs is not a result
+   for (size_t i=0; paths && paths[i] && paths[i][0]; i++) {
+      free (src);
+      if (!(src = ds_str_cat (cache->wdir, "/", paths[i], NULL))) {
+         KBIERROR ("OOM allocating cache output name\n");
+         goto cleanup;
+      }
+      if ((lstat (src, &sb)) != 0) {
+         KBWARN ("Not caching result, output [%s] was not created\n", src);
+         goto cleanup;
+      }
+   }
+
+   // The result is written to a temporary directory, and only appears under
+   // its key once it is complete.
+   if (!(tmp = ds_str_cat (cache_dir (), "/tmp.XXXXXX", NULL))) {
+      KBIERROR ("OOM allocating cache entry name\n");
+      goto cleanup;
+   }
+   if (!(kbwork_make_parents (tmp)) || !(mkdtemp (tmp))) {
+      KBWARN ("Failed to create cache entry in [%s]: %m\n", cache_dir ());
+      free (tmp);
+      tmp = NULL;
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<cache->noutputs; i++) {
+      char name[32];
+      snprintf (name, sizeof name, "/out.%zu", i);
+      free (dst);
+      if (!(dst = ds_str_cat (tmp, name, NULL))) {
+         KBIERROR ("OOM allocating cache entry name\n");
+         goto cleanup;
+      }
+      int fd = open (dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+      if (fd < 0 || (write (fd, cache->outputs[i], cache->lens[i])) != (ssize_t)cache->lens[i]) {
+         KBWARN ("Failed to write cache entry [%s]: %m\n", dst);
+         if (fd >= 0) {
+            close (fd);
+         }
+         goto cleanup;
+      }
+      close (fd);
+   }
+
+   for (size_t i=0; paths && paths[i] && paths[i][0]; i++) {
+      free (src);
+      free (dst);
+      src = ds_str_cat (cache->wdir, "/", paths[i], NULL);
+      dst = ds_str_cat (tmp, FILES_DIR, "/", paths[i], NULL);
+      if (!src || !dst) {
+         KBIERROR ("OOM allocating cache output names\n");
+         goto cleanup;
+      }
+      if (!(kbwork_make_parents (dst)) || !(kbwork_copy (src, dst, (uid_t)-1, (gid_t)-1))) {
+         KBWARN ("Failed to copy [%s] to the cache: %m\n", src);
+         goto cleanup;
+      }
+   }
+
+   // Another run may have stored the same result in the meantime
+   if ((rename (tmp, cache->entry)) != 0 && errno != EEXIST && errno != ENOTEMPTY) {
+      KBWARN ("Failed to store cache entry [%s]: %m\n", cache->entry);
+      goto cleanup;
+   }
+
+   error = false;
+cleanup:
+   if (tmp) {
+      // Still there if it was not renamed
+      if ((lstat (tmp, &sb)) == 0) {
+         kbwork_remove (tmp);
+      }
+   }
+   free (tmp);
+   free (src);
+   free (dst);
+   if (!error) {
+      evict (cache->key);
+   }
+   return !error;
+}
+
@@ -0,0 +1,69 @@
+
+#ifndef H_KBCACHE
+#define H_KBCACHE
+
+// The result cache: the EXEC commands of a node that sets CACHE_INPUTS[] or
+// CACHE_OUTPUTS[] are not run again when nothing that they depend on changed
+// since they last succeeded. Instead, the files and directories in
+// CACHE_OUTPUTS[] are restored from the cache into the directory that the
+// commands run in, and the output of the commands is reported again.
+//
+// The key of a result is the SHA-256 of the commands, of the keys of the node
+// that affect how they run, of the environment, and of the contents of the
+// files in CACHE_INPUTS[]. So that unchanged inputs are not read every time,
+// the digest of each input file is kept with its device, inode, size, mtime
+// and ctime, and is used for as long as these do not change.
+//
+// Results are kept in a directory on local disk (/tmp/kubeka-cache unless
+// set), as <dir>/<key>/ (with the output of each command and a copy of the
+// outputs) and digests of input files are kept in <dir>/stat. When the
+// results take more than the size limit, the least recently used are removed.
+// The directory must be owned by this process and writable by no one else;
+// nodes run without the cache when it is not.
+
+// The size limit used unless one is set.
+#define KBCACHE_DEFAULT_SIZE     (1024 * 1024 * 1024)
+
+typedef struct kbcache_t kbcache_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Keep the cache in `dir` (or in the default directory again if `dir` is
+   // NULL), limited to `size` bytes (no limit if 0). Must be called before
+   // any result is looked up.
+   bool kbcache_set_dir (const char *dir, uint64_t size);
+
+   // Whether the node `node` asks for its results to be cached.
+   bool kbcache_wanted (const kbnode_t *node);
+
+   // Compute the key of the result of the commands of `node`, run in `wdir`
+   // as `uid` and `gid`. Returns NULL if the key could not be computed or the
+   // cache directory cannot be used, in which case the commands are run
+   // without the cache.
+   kbcache_t *kbcache_new (const kbnode_t *node, const char *wdir,
+                           uid_t uid, gid_t gid);
+   void kbcache_del (kbcache_t *cache);
+
+   // Restore the result from the cache. Returns false if there is none (or if
+   // it could not be restored), in which case the commands must be run.
+   bool kbcache_restore (kbcache_t *cache);
+
+   // The output of the command `index` of a restored result, as a
+   // nul-terminated string owned by `cache`.
+   const char *kbcache_output (const kbcache_t *cache, size_t index,
+                               size_t *len);
+
+   // Record the output of the next command that was run, and store the
+   // result once they all succeeded.
+   bool kbcache_add_output (kbcache_t *cache, const char *output, size_t len);
+   bool kbcache_store (kbcache_t *cache);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,186 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <pthread.h>
+
+#include "kbutil.h"
+#include "kbcancel.h"
+
+struct kbcancel_t {
+   // Written by kbcancel_fire(), possibly from a signal handler, and read by
+   // every thread, so only with the (lock-free) atomic builtins. The eventfd
+   // is never read, so that it stays readable once fired.
+   int fired;
+   int fd;
+
+   pthread_mutex_t lock;
+   pthread_cond_t left;
+   pid_t *pgids;
+   size_t npgids;
+   size_t cap;
+};
+
+kbcancel_t *kbcancel_new (void)
+{
+   kbcancel_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      KBIERROR ("OOM allocating cancellation token\n");
+      return NULL;
+   }
+   if ((ret->fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+      KBXERROR ("Failed to create cancellation token: %m\n");
+      free (ret);
+      return NULL;
+   }
+
+   pthread_condattr_t attr;
+   pthread_condattr_init (&attr);
+   pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+   pthread_cond_init (&ret->left, &attr);
+   pthread_condattr_destroy (&attr);
+   pthread_mutex_init (&ret->lock, NULL);
+   return ret;
+}
+
+void kbcancel_del (kbcancel_t *cancel)
+{
+   if (!cancel) {
+      return;
+   }
+   close (cancel->fd);
+   pthread_cond_destroy (&cancel->left);
+   pthread_mutex_destroy (&cancel->lock);
+   free (cancel->pgids);
+   free (cancel);
+}
+
+void kbcancel_fire (kbcancel_t *cancel)
+{
+   if (!cancel) {
+      return;
+   }
+   int saved = errno;
+   uint64_t one = 1;
+   __atomic_store_n (&cancel->fired, 1, __ATOMIC_RELEASE);
+   if ((write (cancel->fd, &one, sizeof one)) < 0) {
+      // Only fails if the counter would overflow, by which time it is
+      // readable anyway.
+   }
+   errno = saved;
+}
+
+bool kbcancel_fired (const kbcancel_t *cancel)
+{
+   return cancel && __atomic_load_n (&cancel->fired, __ATOMIC_ACQUIRE);
+}
+
+bool kbcancel_wait (const kbcancel_t *cancel, int ms)
+{
+   if (!cancel) {
+      if (ms > 0) {
+         struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+         nanosleep (&ts, NULL);
+      }
+      return false;
+   }
+
+   struct pollfd pfd = { cancel->fd, POLLIN, 0 };
+   while (!(kbcancel_fired (cancel)) && (poll (&pfd, 1, ms)) < 0 && errno == EINTR)
+      ;
+   return kbcancel_fired (cancel);
+}
+
+bool kbcancel_enter (kbcancel_t *cancel, pid_t pgid)
+{
+   bool ret = true;
+
+   if (!cancel) {
+      return true;
+   }
+
+   pthread_mutex_lock (&cancel->lock);
+   if (cancel->npgids >= cancel->cap) {
+      size_t newcap = cancel->cap ? cancel->cap * 2 : 16;
+      pid_t *tmp = realloc (cancel->pgids, newcap * sizeof *tmp);
+      if (tmp) {
+         cancel->pgids = tmp;
+         cancel->cap = newcap;
+      }
+   }
+   if (cancel->npgids < cancel->cap) {
+      cancel->pgids[cancel->npgids++] = pgid;
+   } else {
+      KBIERROR ("OOM registering process group %i\n", (int)pgid);
+   }
+   // Checked under the lock, so that a group is either seen by
+   // kbcancel_terminate() or killed here.
+   if (kbcancel_fired (cancel)) {
+      kill (-pgid, SIGKILL);
+      ret = false;
+   }
+   pthread_mutex_unlock (&cancel->lock);
+   return ret;
+}
+
+void kbcancel_leave (kbcancel_t *cancel, pid_t pgid)
+{
+   if (!cancel) {
+      return;
+   }
+
+   pthread_mutex_lock (&cancel->lock);
+   for (size_t i=0; i<cancel->npgids; i++) {
+      if (cancel->pgids[i] == pgid) {
+         cancel->pgids[i] = cancel->pgids[--cancel->npgids];
+         break;
+      }
+   }
+   pthread_cond_broadcast (&cancel->left);
+   pthread_mutex_unlock (&cancel->lock);
+}
+
+void kbcancel_terminate (kbcancel_t *cancel, unsigned grace)
+{
+   struct timespec deadline;
+
+   if (!cancel) {
+      return;
+   }
+   kbcancel_fire (cancel);
+
+   clock_gettime (CLOCK_MONOTONIC, &deadline);
+   deadline.tv_sec += grace / 1000;
+   deadline.tv_nsec += (long)(grace % 1000) * 1000000L;
+   if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+   }
+
+   pthread_mutex_lock (&cancel->lock);
+   for (size_t i=0; i<cancel->npgids; i++) {
+      kill (-cancel->pgids[i], SIGTERM);
+   }
+   while (cancel->npgids) {
+      if ((pthread_cond_timedwait (&cancel->left, &cancel->lock, &deadline)) == ETIMEDOUT) {
+         break;
+      }
+   }
+   for (size_t i=0; i<cancel->npgids; i++) {
+      KBWARN ("Process group %i did not stop, killing it\n", (int)cancel->pgids[i]);
+      kill (-cancel->pgids[i], SIGKILL);
+   }
+   pthread_mutex_unlock (&cancel->lock);
+}
+
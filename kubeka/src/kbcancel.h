@@ -0,0 +1,46 @@
+
+#ifndef H_KBCANCEL
+#define H_KBCANCEL
+
+// A cancellation token, passed down to everything that runs a command on
+// behalf of a tree. Each command registers its process group with the token
+// for as long as it runs, so that when the token fires (on shutdown) the
+// commands that are running can be stopped, rather than left behind when the
+// threads that started them go away.
+//
+// All the functions accept a NULL token, which is never fired.
+
+typedef struct kbcancel_t kbcancel_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   kbcancel_t *kbcancel_new (void);
+   void kbcancel_del (kbcancel_t *cancel);
+
+   // Fire the token. This is async-signal-safe, so that it can be done from
+   // a signal handler; a fired token stays fired.
+   void kbcancel_fire (kbcancel_t *cancel);
+   bool kbcancel_fired (const kbcancel_t *cancel);
+
+   // Wait for up to `ms` milliseconds (forever if negative) for the token to
+   // fire. Returns true if it has.
+   bool kbcancel_wait (const kbcancel_t *cancel, int ms);
+
+   // Register the process group `pgid` for as long as it runs. If the token
+   // has already fired the group is killed, and false is returned.
+   bool kbcancel_enter (kbcancel_t *cancel, pid_t pgid);
+   void kbcancel_leave (kbcancel_t *cancel, pid_t pgid);
+
+   // Send SIGTERM to every registered process group, wait up to `grace`
+   // milliseconds for them to leave, then send SIGKILL to those that remain.
+   void kbcancel_terminate (kbcancel_t *cancel, unsigned grace);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,273 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include "ds_hmap.h"
+#include "ds_str.h"
+
+#include "kbutil.h"
+#include "kbcmd.h"
+
+// Characters that mean something to the shell outside of quotes. Some of
+// these are only special at the start of a word, but a command using them
+// is rare enough that it is simply left to the shell.
+static const char *special = "|&;<>()$`*?[#~{}!\n\r";
+
+// The first words that only the shell can run: reserved words, special
+// builtins, builtins that change the state of the shell, and builtins that
+// behave differently from the program of the same name (echo in dash
+// interprets backslashes, /bin/echo does not).
+static const char *builtins[] = {
+   "!", "{", "}", "case", "do", "done", "elif", "else", "esac", "fi", "for",
+   "if", "in", "then", "until", "while",
+   ".", ":", "break", "continue", "eval", "exec", "exit", "export",
+   "readonly", "return", "set", "shift", "times", "trap", "unset",
+   "alias", "bg", "cd", "command", "echo", "fc", "fg", "getopts", "hash",
+   "jobs", "read", "type", "ulimit", "umask", "unalias", "wait",
+   "declare", "let", "local", "source", "typeset",
+};
+
+// Program name to full path, for the PATH that the entries were found in.
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static ds_hmap_t *g_cache = NULL;   // { char *: char * }
+static char *g_cache_path = NULL;
+
+bool kbcmd_mode (const char *value, enum kbcmd_mode_t *mode)
+{
+   static const struct {
+      const char *name;
+      enum kbcmd_mode_t mode;
+   } modes[] = {
+      { "none",   kbcmd_mode_NONE },
+      { "sh",     kbcmd_mode_SH },
+      { "bash",   kbcmd_mode_BASH },
+   };
+
+   for (size_t i=0; value && i<sizeof modes / sizeof modes[0]; i++) {
+      if ((strcmp (value, modes[i].name)) == 0) {
+         *mode = modes[i].mode;
+         return true;
+      }
+   }
+   return false;
+}
+
+static bool is_builtin (const char *word)
+{
+   for (size_t i=0; i<sizeof builtins / sizeof builtins[0]; i++) {
+      if ((strcmp (word, builtins[i])) == 0) {
+         return true;
+      }
+   }
+   return false;
+}
+
+char **kbcmd_split (const char *command, bool *needs_shell)
+{
+   char **ret = NULL;
+   char *word = NULL;
+   size_t len = 0;
+   bool inword = false;
+
+   *needs_shell = true;
+   if (!command || !(word = malloc (strlen (command) + 1))) {
+      *needs_shell = !!command;
+      return NULL;
+   }
+
+   for (const char *src = command; ; src++) {
+      if (*src == 0 || *src == ' ' || *src == '\t') {
+         if (inword) {
+            word[len] = 0;
+            char *tmp = ds_str_dup (word);
+            if (!tmp || !(kbutil_strarray_append (&ret, tmp))) {
+               free (tmp);
+               *needs_shell = false;
+               goto error;
+            }
+            len = 0;
+            inword = false;
+         }
+         if (*src == 0) {
+            break;
+         }
+         continue;
+      }
+
+      // An assignment before the program, as in `VAR=value program`.
+      if (*src == '=' && !ret) {
+         goto error;
+      }
+      if ((strchr (special, *src))) {
+         goto error;
+      }
+
+      inword = true;
+      switch (*src) {
+         case '\'':
+            while (*++src != '\'') {
+               if (*src == 0) {
+                  goto error;
+               }
+               word[len++] = *src;
+            }
+            break;
+
+         case '"':
+            while (*++src != '"') {
+               if (*src == 0 || *src == '$' || *src == '`') {
+                  goto error;
+               }
+               if (*src == '\\' && src[1] && (strchr ("\"\\", src[1]))) {
+                  src++;
+               } else if (*src == '\\' && src[1] == '\n') {
+                  goto error;
+               }
+               word[len++] = *src;
+            }
+            break;
+
+         case '\\':
+            if (src[1] == 0 || src[1] == '\n') {
+               goto error;
+            }
+            word[len++] = *++src;
+            break;
+
+         default:
+            word[len++] = *src;
+            break;
+      }
+   }
+
+   if (!ret || is_builtin (ret[0])) {
+      goto error;
+   }
+
+   free (word);
+   *needs_shell = false;
+   return ret;
+
+error:
+   free (word);
+   kbutil_strarray_del (ret);
+   return NULL;
+}
+
+static void cache_clear (void)
+{
+   char **keys = NULL;
+   size_t nkeys = g_cache ? ds_hmap_keys (g_cache, (void ***)&keys, NULL) : 0;
+
+   for (size_t i=0; i<nkeys && keys && keys[i]; i++) {
+      char *path = NULL;
+      if ((ds_hmap_get_str_ptr (g_cache, keys[i], (void **)&path, NULL))) {
+         free (path);
+      }
+   }
+   free (keys);
+   ds_hmap_del (g_cache);
+   g_cache = NULL;
+   free (g_cache_path);
+   g_cache_path = NULL;
+}
+
+// Searches the absolute directories in `path`. Relative ones depend on the
+// working directory of the command, so those are left to the shell.
+static char *search (const char *path, const char *name)
+{
+   char **dirs = kbutil_strsplit (path, ':');
+   char *ret = NULL;
+
+   for (size_t i=0; dirs && dirs[i] && !ret; i++) {
+      struct stat sb;
+      if (dirs[i][0] != '/') {
+         continue;
+      }
+      char *candidate = ds_str_cat (dirs[i], "/", name, NULL);
+      if (candidate && (stat (candidate, &sb)) == 0 && S_ISREG (sb.st_mode)
+            && (access (candidate, X_OK)) == 0) {
+         ret = candidate;
+         candidate = NULL;
+      }
+      free (candidate);
+   }
+   kbutil_strarray_del (dirs);
+   return ret;
+}
+
+char *kbcmd_which (const char *name)
+{
+   char *ret = NULL;
+
+   if (!name || !name[0]) {
+      return NULL;
+   }
+   if ((strchr (name, '/'))) {
+      return ds_str_dup (name);
+   }
+
+   const char *path = getenv ("PATH");
+   if (!path) {
+      path = "/usr/local/bin:/usr/bin:/bin";
+   }
+
+   pthread_mutex_lock (&g_cache_lock);
+   if (g_cache_path && (strcmp (g_cache_path, path)) != 0) {
+      cache_clear ();
+   }
+   if (!g_cache) {
+      if (!(g_cache = ds_hmap_new (64)) || !(g_cache_path = ds_str_dup (path))) {
+         KBIERROR ("OOM creating PATH cache\n");
+         cache_clear ();
+         goto cleanup;
+      }
+   }
+
+   char *found = NULL;
+   if (!(ds_hmap_get_str_ptr (g_cache, name, (void **)&found, NULL))) {
+      // Only programs that were found are remembered, so that a program
+      // installed later is still found.
+      if ((found = search (path, name))
+            && !(ds_hmap_set_str_ptr (g_cache, name, found, 0))) {
+         KBIERROR ("OOM caching path of [%s]\n", name);
+         ret = found;
+         goto cleanup;
+      }
+   }
+   ret = found ? ds_str_dup (found) : NULL;
+
+cleanup:
+   pthread_mutex_unlock (&g_cache_lock);
+   return ret;
+}
+
+void kbcmd_forget (const char *name)
+{
+   char *path = NULL;
+
+   pthread_mutex_lock (&g_cache_lock);
+   if (g_cache && name
+         && (ds_hmap_get_str_ptr (g_cache, name, (void **)&path, NULL))) {
+      ds_hmap_remove_str (g_cache, name);
+      free (path);
+   }
+   pthread_mutex_unlock (&g_cache_lock);
+}
+
+void kbcmd_cache_clear (void)
+{
+   pthread_mutex_lock (&g_cache_lock);
+   cache_clear ();
+   pthread_mutex_unlock (&g_cache_lock);
+}
+
@@ -0,0 +1,46 @@
+
+#ifndef H_KBCMD
+#define H_KBCMD
+
+// Commands that use no feature of the shell (no quoting other than plain
+// quotes, no expansions, redirections, pipes, lists or builtins) are
+// executed directly, without starting /bin/sh. This module decides which
+// commands those are, splits them into words as the shell would, and finds
+// the program in PATH.
+
+// The value of the SHELL key of a node.
+enum kbcmd_mode_t {
+   kbcmd_mode_AUTO = 0,    // Key not set: directly when possible, else /bin/sh
+   kbcmd_mode_NONE,        // Always directly; a command needing a shell fails
+   kbcmd_mode_SH,          // Always /bin/sh -c
+   kbcmd_mode_BASH,        // Always bash -c, with bash found in PATH
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Parse a value of the SHELL key. Returns false if it is not one of
+   // `none`, `sh` or `bash`.
+   bool kbcmd_mode (const char *value, enum kbcmd_mode_t *mode);
+
+   // Split `command` into an argv array that the caller must free with
+   // kbutil_strarray_del(). Returns NULL if the command needs a shell (with
+   // `*needs_shell` set to true) or if memory ran out (with it set to false).
+   char **kbcmd_split (const char *command, bool *needs_shell);
+
+   // Return the full path of the program `name`, or NULL if it is not in PATH.
+   // A name containing a slash is returned as is. Lookups are cached for the
+   // life of the process (or until PATH changes); kbcmd_forget() drops a
+   // stale entry. The caller must free the returned string.
+   char *kbcmd_which (const char *name);
+   void kbcmd_forget (const char *name);
+   void kbcmd_cache_clear (void);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,254 @@
+
+// For getgrouplist()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
+
+#include "ds_str.h"
+
+#include "kbutil.h"
+#include "kbctx.h"
+
+// The buffer for the strings of a record. Groups with many members need a
+// larger one, which is retried up to LOOKUP_BUFMAX.
+#define LOOKUP_BUFSIZE     (16 * 1024)
+#define LOOKUP_BUFMAX      (4 * 1024 * 1024)
+
+// A resolved pair of names, or the error that resolving them failed with.
+struct entry_t {
+   char *user;
+   char *group;
+   time_t expires;
+   int error;
+   kbctx_t ctx;
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct entry_t *g_entries = NULL;
+static size_t g_nentries = 0;
+
+static time_t now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec;
+}
+
+// The lookups return 0 or an errno; ENOENT if the name does not exist.
+static int lookup_user (const char *name, uid_t *uid, gid_t *gid)
+{
+   for (size_t size=LOOKUP_BUFSIZE; ; size *= 2) {
+      struct passwd pw, *result = NULL;
+      char *buf = malloc (size);
+      if (!buf) {
+         return ENOMEM;
+      }
+      int ret = getpwnam_r (name, &pw, buf, size, &result);
+      if (ret == 0 && result) {
+         *uid = pw.pw_uid;
+         *gid = pw.pw_gid;
+      } else if (ret == 0) {
+         ret = ENOENT;
+      }
+      free (buf);
+      if (ret != ERANGE || size >= LOOKUP_BUFMAX) {
+         return ret;
+      }
+   }
+}
+
+static int lookup_group (const char *name, gid_t *gid)
+{
+   for (size_t size=LOOKUP_BUFSIZE; ; size *= 2) {
+      struct group gr, *result = NULL;
+      char *buf = malloc (size);
+      if (!buf) {
+         return ENOMEM;
+      }
+      int ret = getgrnam_r (name, &gr, buf, size, &result);
+      if (ret == 0 && result) {
+         *gid = gr.gr_gid;
+      } else if (ret == 0) {
+         ret = ENOENT;
+      }
+      free (buf);
+      if (ret != ERANGE || size >= LOOKUP_BUFMAX) {
+         return ret;
+      }
+   }
+}
+
+static int lookup_groups (const char *user, gid_t gid, kbctx_t *ctx)
+{
+   int ngroups = 32;
+   while (true) {
+      gid_t *tmp = realloc (ctx->groups, (size_t)ngroups * sizeof *tmp);
+      if (!tmp) {
+         return ENOMEM;
+      }
+      ctx->groups = tmp;
+      int n = ngroups;
+      if ((getgrouplist (user, gid, ctx->groups, &n)) >= 0) {
+         ctx->ngroups = (size_t)n;
+         return 0;
+      }
+      // `n` is now the number of groups of the user
+      if (n <= ngroups) {
+         return EIO;
+      }
+      ngroups = n;
+   }
+}
+
+static int lookup (const char *user, const char *group, kbctx_t *ctx)
+{
+   gid_t gid = (gid_t)-1;
+   int ret = 0;
+
+   if (user[0] && (ret = lookup_user (user, &ctx->uid, &gid)) != 0) {
+      return ret;
+   }
+   if (group[0] && (ret = lookup_group (group, &gid)) != 0) {
+      return ret;
+   }
+   ctx->gid = gid;
+   if (user[0]) {
+      ret = lookup_groups (user, gid, ctx);
+   }
+   return ret;
+}
+
+static bool copy (kbctx_t *dst, const kbctx_t *src)
+{
+   *dst = *src;
+   dst->groups = NULL;
+   if (src->ngroups) {
+      if (!(dst->groups = malloc (src->ngroups * sizeof *dst->groups))) {
+         return false;
+      }
+      memcpy (dst->groups, src->groups, src->ngroups * sizeof *dst->groups);
+   }
+   return true;
+}
+
+static struct entry_t *find (const char *user, const char *group)
+{
+   for (size_t i=0; i<g_nentries; i++) {
+      if ((strcmp (g_entries[i].user, user)) == 0
+            && (strcmp (g_entries[i].group, group)) == 0) {
+         return &g_entries[i];
+      }
+   }
+   return NULL;
+}
+
+// Keep the result of a lookup, replacing an expired one. Failing to keep it
+// only means that it is looked up again next time. Only a success or a user
+// or group that does not exist is kept: any other error (EIO, EAGAIN or
+// ETIMEDOUT from an unreachable directory service, say) may be gone by the
+// next lookup.
+static void remember (const char *user, const char *group, int error,
+                      const kbctx_t *ctx)
+{
+   pthread_mutex_lock (&g_lock);
+   struct entry_t *entry = find (user, group);
+   if (!entry) {
+      struct entry_t *tmp = realloc (g_entries, (g_nentries + 1) * sizeof *tmp);
+      if (!tmp) {
+         goto cleanup;
+      }
+      g_entries = tmp;
+      entry = &g_entries[g_nentries];
+      memset (entry, 0, sizeof *entry);
+      entry->user = ds_str_dup (user);
+      entry->group = ds_str_dup (group);
+      if (!entry->user || !entry->group) {
+         free (entry->user);
+         free (entry->group);
+         goto cleanup;
+      }
+      g_nentries++;
+   }
+   kbctx_clear (&entry->ctx);
+   entry->error = error;
+   entry->expires = now () + KBCTX_TTL;
+   if (!error && !(copy (&entry->ctx, ctx))) {
+      entry->expires = 0;
+   }
+
+cleanup:
+   pthread_mutex_unlock (&g_lock);
+}
+
+bool kbctx_resolve (const char *user, const char *group, kbctx_t *ctx)
+{
+   kbctx_t init = KBCTX_INIT;
+   int error = 0;
+
+   *ctx = init;
+   if (!user[0] && !group[0]) {
+      return true;
+   }
+
+   pthread_mutex_lock (&g_lock);
+   const struct entry_t *entry = find (user, group);
+   bool found = entry && entry->expires > now ();
+   if (found && !(error = entry->error) && !(copy (ctx, &entry->ctx))) {
+      error = ENOMEM;
+   }
+   pthread_mutex_unlock (&g_lock);
+
+   // The lookup is made without the lock, as it may take a while
+   if (!found) {
+      error = lookup (user, group, ctx);
+      if (!error || error == ENOENT) {
+         remember (user, group, error, ctx);
+      }
+   }
+
+   if (error) {
+      kbctx_clear (ctx);
+      errno = error;
+      return false;
+   }
+   return true;
+}
+
+void kbctx_clear (kbctx_t *ctx)
+{
+   kbctx_t init = KBCTX_INIT;
+   free (ctx->groups);
+   *ctx = init;
+}
+
+bool kbctx_self (const kbctx_t *ctx)
+{
+   return !ctx || (ctx->uid == (uid_t)-1 && ctx->gid == (gid_t)-1);
+}
+
+void kbctx_flush (void)
+{
+   pthread_mutex_lock (&g_lock);
+   for (size_t i=0; i<g_nentries; i++) {
+      free (g_entries[i].user);
+      free (g_entries[i].group);
+      kbctx_clear (&g_entries[i].ctx);
+   }
+   free (g_entries);
+   g_entries = NULL;
+   g_nentries = 0;
+   pthread_mutex_unlock (&g_lock);
+}
+
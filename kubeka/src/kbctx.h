@@ -0,0 +1,53 @@
+
+#ifndef H_KBCTX
+#define H_KBCTX
+
+// Execution contexts: the credentials that the commands of a node run with,
+// resolved from its RUNAS_USER and RUNAS_GROUP. Users and groups may be looked
+// up over the network (with LDAP-backed NSS, for example), so the lookups use
+// the reentrant getpwnam_r(), getgrnam_r() and getgrouplist(), and their
+// results (including users and groups that do not exist, but not transient
+// errors, which are retried) are kept for KBCTX_TTL seconds. The nodes of
+// every tree are resolved when the tree is linted (see kblint.h), so that
+// spawning their commands needs no lookup at all.
+
+// The seconds for which a resolved context is used before it is looked up
+// again.
+#define KBCTX_TTL       (300)
+
+typedef struct kbctx_t {
+   uid_t uid;        // (uid_t)-1 to keep the user of this process
+   gid_t gid;        // (gid_t)-1 to keep the group of this process
+   // When `uid` is set, the supplementary groups of the user replace those
+   // of this process.
+   gid_t *groups;
+   size_t ngroups;
+} kbctx_t;
+
+#define KBCTX_INIT      { (uid_t)-1, (gid_t)-1, NULL, 0 }
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Resolve the user `user` and the group `group` (either may be empty, to
+   // keep that of this process) into `ctx`. Without a group, the commands run
+   // with the primary group of the user. Returns false with errno set if
+   // either could not be resolved, to ENOENT if it does not exist. The caller
+   // must release `ctx` with kbctx_clear().
+   bool kbctx_resolve (const char *user, const char *group, kbctx_t *ctx);
+   void kbctx_clear (kbctx_t *ctx);
+
+   // Whether the commands run with the credentials of this process.
+   bool kbctx_self (const kbctx_t *ctx);
+
+   // Forget all the resolved contexts.
+   void kbctx_flush (void);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -1,3 +1,6 @@
+// For posix_spawn_file_actions_addchdir_np(), pipe2() and memfd_create()
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -5,88 +8,389 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
 #include <unistd.h>
-#include <pwd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+
+#include <pthread.h>
 
 #include "ds_array.h"
 #include "ds_str.h"
 
 #include "kbnode.h"
+#include "kbperiod.h"
+#include "kbcancel.h"
+#include "kbwork.h"
+#include "kbsink.h"
+#include "kbmux.h"
+#include "kbctx.h"
 #include "kbexec.h"
 #include "kbutil.h"
+#include "kbcmd.h"
+#include "kbshell.h"
+#include "kbzygote.h"
+
+extern char **environ;
+
+// posix_spawn() can set up everything for the child except a change of user,
+// so that case (and a libc without posix_spawn_file_actions_addchdir_np())
+// falls back to vfork().
+#if defined (__GLIBC__) && defined (__GLIBC_PREREQ)
+#if __GLIBC_PREREQ (2, 29)
+#define HAVE_SPAWN_CHDIR
+#endif
+#endif
+
+static const char *shell_path = "/bin/sh";
+
+// Whether a failure to start `path` with error `error` means that it could
+// not be executed at all, rather than that setting up the child failed.
+static bool exec_failed (const char *path, int error)
+{
+   return error == ENOEXEC || (error == ENOENT && (access (path, F_OK)) != 0);
+}
 
-bool resize_buffer (char **dst, size_t *len, size_t index)
+static pid_t spawn_posix (const char *path, char *const *argv,
+                          char *const *envp, int infd, int outfd, int closefd,
+                          const char *wdir, bool *noexec)
 {
-   index += 2;
-   if (index < *len) {
-      return true;
+   pid_t ret = -1;
+   posix_spawn_file_actions_t actions;
+   posix_spawnattr_t attr;
+   sigset_t none, all;
+   int rc = 0;
+
+   sigemptyset (&none);
+   sigfillset (&all);
+
+   if ((rc = posix_spawn_file_actions_init (&actions)) != 0) {
+      errno = rc;
+      return -1;
+   }
+   if ((rc = posix_spawnattr_init (&attr)) != 0) {
+      posix_spawn_file_actions_destroy (&actions);
+      errno = rc;
+      return -1;
    }
 
-   size_t newsize = index * 2;
-   char *tmp = realloc (*dst, newsize + 2);
-   if (!tmp) {
-      return false;
+   // The child gets the write end of the pipe as stdout, and starts with
+   // default signal handling, as it would after popen(), in a new process
+   // group so that a timeout stops everything it started.
+   if ((infd >= 0
+            && (rc = posix_spawn_file_actions_adddup2 (&actions, infd, STDIN_FILENO)) != 0)
+         || (rc = posix_spawn_file_actions_addclose (&actions, closefd)) != 0
+         || (rc = posix_spawn_file_actions_adddup2 (&actions, outfd, STDOUT_FILENO)) != 0
+         || (rc = posix_spawn_file_actions_addclose (&actions, outfd)) != 0
+#ifdef HAVE_SPAWN_CHDIR
+         || (rc = posix_spawn_file_actions_addchdir_np (&actions, wdir)) != 0
+#endif
+         || (rc = posix_spawnattr_setsigmask (&attr, &none)) != 0
+         || (rc = posix_spawnattr_setsigdefault (&attr, &all)) != 0
+         || (rc = posix_spawnattr_setpgroup (&attr, 0)) != 0
+         || (rc = posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK
+                                                 | POSIX_SPAWN_SETSIGDEF
+                                                 | POSIX_SPAWN_SETPGROUP)) != 0) {
+      goto cleanup;
    }
 
-   *dst = tmp;
-   *len = newsize; // exclude +2; better to reallocate earlier than necessary
-   return true;
+   // posix_spawn() reports a failed chdir() and a failed execve() alike
+   if ((rc = posix_spawn (&ret, path, &actions, &attr, argv,
+                          envp ? envp : environ)) != 0) {
+      *noexec = exec_failed (path, rc);
+   }
+
+cleanup:
+   posix_spawnattr_destroy (&attr);
+   posix_spawn_file_actions_destroy (&actions);
+   if (rc != 0) {
+      errno = rc;
+      ret = -1;
+   }
+   return ret;
 }
 
-static bool spawn_child (int *fds,
-                         const char *id, const char *fname, size_t line,
-                         const char *wdir, uid_t uid,
-                         const char *command)
+// The vfork() child shares the memory of the daemon until it calls execve(),
+// so it only makes system calls. In particular, setuid() in a multi-threaded
+// libc changes the credentials of every thread in the process, hence the raw
+// system calls. The groups are changed first, while the child still may.
+static pid_t spawn_vfork (const char *path, char *const *argv,
+                          char *const *envp, int infd, int outfd, int closefd,
+                          const char *wdir, const kbctx_t *ctx, bool *noexec)
 {
-   FILE *inf = NULL;
-   int rc = 0;
+   volatile int child_errno = 0;
+   volatile bool child_noexec = false;
+   // Only what the child needs is computed here, as vfork() may clobber the
+   // arguments themselves.
+   char *const *volatile env = envp ? envp : environ;
+   sigset_t all, saved;
+
+   // No signal handler may run in the child while it shares our memory.
+   sigfillset (&all);
+   pthread_sigmask (SIG_SETMASK, &all, &saved);
+
+   pid_t ret = vfork ();
+   if (ret == 0) {
+      struct sigaction sa;
+      memset (&sa, 0, sizeof sa);
+      sa.sa_handler = SIG_DFL;
+      for (int i=1; i<NSIG; i++) {
+         sigaction (i, &sa, NULL);
+      }
+      sigprocmask (SIG_SETMASK, &saved, NULL);
+
+      if ((setpgid (0, 0)) != 0
+            || (infd >= 0 && (dup2 (infd, STDIN_FILENO)) < 0)
+            || (close (closefd)) != 0
+            || (dup2 (outfd, STDOUT_FILENO)) < 0
+            || (close (outfd)) != 0
+            || (chdir (wdir)) != 0) {
+         child_errno = errno;
+         _exit (127);
+      }
+#ifdef SYS_setuid32
+      if ((ctx->uid != (uid_t)-1
+               && (syscall (SYS_setgroups32, ctx->ngroups, ctx->groups)) != 0)
+            || (ctx->gid != (gid_t)-1 && (syscall (SYS_setgid32, ctx->gid)) != 0)
+            || (ctx->uid != (uid_t)-1 && (syscall (SYS_setuid32, ctx->uid)) != 0)) {
+#else
+      if ((ctx->uid != (uid_t)-1
+               && (syscall (SYS_setgroups, ctx->ngroups, ctx->groups)) != 0)
+            || (ctx->gid != (gid_t)-1 && (syscall (SYS_setgid, ctx->gid)) != 0)
+            || (ctx->uid != (uid_t)-1 && (syscall (SYS_setuid, ctx->uid)) != 0)) {
+#endif
+         child_errno = errno;
+         _exit (127);
+      }
+      execve (path, argv, env);
+      child_errno = errno;
+      child_noexec = child_errno == ENOENT || child_errno == ENOEXEC;
+      _exit (127);
+   }
 
-   close (fds[0]);
+   int saved_errno = errno;
+   pthread_sigmask (SIG_SETMASK, &saved, NULL);
 
-   // Drop privileges
-   if (uid != (uid_t)-1) {
-      // Drop privileges
-      if ((setuid (uid)) != 0) {
-         KBPARSE_ERROR (fname, line, "Node [%si]: failed userswitch [%i]: %m\n",
-                  id, (int)uid);
-         return false;
-      }
+   if (ret > 0 && child_errno) {
+      // The child is a zombie by now, having failed before execve().
+      while ((waitpid (ret, NULL, 0)) < 0 && errno == EINTR)
+         ;
+      saved_errno = child_errno;
+      *noexec = child_noexec;
+      ret = -1;
    }
+   errno = saved_errno;
+   return ret;
+}
 
-   // Switch directory
-   if ((chdir (wdir)) != 0) {
-      KBPARSE_ERROR (fname, line, "Node [%s]: failed to switch to [%s]: %m\n",
-               id, wdir);
-      return false;
+// Start the program at `path`, with its stdout on `outfd`, its stdin on
+// `infd` (that of this process if -1) and the environment `envp` (that of this
+// process if NULL). The other end of the pipe, `closefd`, is closed in the
+// child. `*noexec` is set if it failed because `path` could not be executed
+// (ENOENT or ENOEXEC from execve()).
+static pid_t spawn_program (const char *path, char *const *argv,
+                            char *const *envp, int infd, int outfd, int closefd,
+                            const char *wdir, const kbctx_t *ctx, bool *noexec)
+{
+   const kbctx_t self = KBCTX_INIT;
+   if (!ctx) {
+      ctx = &self;
    }
+#ifdef HAVE_SPAWN_CHDIR
+   if (kbctx_self (ctx)) {
+      return spawn_posix (path, argv, envp, infd, outfd, closefd, wdir, noexec);
+   }
+#endif
+   return spawn_vfork (path, argv, envp, infd, outfd, closefd, wdir, ctx, noexec);
+}
 
-   // Spawn the command
-   errno = 0;
-   if ((inf = popen (command, "r")) == NULL) {
-      KBPARSE_ERROR (fname, line, "Node [%s]: failed to execute command [%s]: %m\n",
-               id, command);
+// Moves everything from `fd` to `sink` until EOF.
+static void read_output (int fd, const char *command, kbsink_t *sink)
+{
+   if (!(kbsink_drain (sink, fd))) {
+      KBXERROR ("Failed to read output of [%s]: %m\n", command);
+   }
+}
+
+static uint64_t now_ms (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// As read_output(), for when the event loop cannot supervise the child: the
+// process group of the child is sent SIGTERM after `timeout` seconds, and
+// SIGKILL `grace` seconds later. Returns true if the child timed out.
+static bool read_output_until (int fd, pid_t pid, const char *command,
+                               kbsink_t *sink, uint64_t timeout, uint64_t grace)
+{
+   uint64_t deadline = now_ms () + timeout * 1000;
+   bool timedout = false;
+
+   int flags = fcntl (fd, F_GETFL);
+   if (flags < 0 || (fcntl (fd, F_SETFL, flags | O_NONBLOCK)) != 0) {
+      KBXERROR ("Failed to read output of [%s]: %m\n", command);
       return false;
    }
 
-   // Read output from process, write to fd
-   while (!feof (inf) && !ferror (inf)) {
-      uint8_t buf[32];
-      size_t nbytes = fread (buf, 1, sizeof buf, inf);
-      write (fds[1], buf, nbytes);
+   ssize_t nbytes;
+   while ((nbytes = kbsink_pump (sink, fd)) != 0) {
+      if (nbytes > 0 || errno == EINTR) {
+         continue;
+      }
+      if (errno != EAGAIN) {
+         KBXERROR ("Failed to read output of [%s]: %m\n", command);
+         break;
+      }
+
+      int wait = -1;
+      if (deadline) {
+         uint64_t now = now_ms ();
+         if (now >= deadline) {
+            int sig = timedout ? SIGKILL : SIGTERM;
+            if ((kill (-pid, sig)) != 0) {
+               kill (pid, sig);
+            }
+            deadline = timedout ? 0 : now + grace * 1000;
+            timedout = true;
+            continue;
+         }
+         wait = deadline - now > INT_MAX ? INT_MAX : (int)(deadline - now);
+      }
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      poll (&pfd, 1, wait);
+   }
+   return timedout;
+}
+
+// Runs the program at `path`; `command` is only used in messages. Returns
+// the wait status, with KBEXEC_TIMEOUT set if it was killed for running
+// past `timeout` seconds. If `noexec` is not NULL and the program could not
+// be executed at all, `*noexec` is set and the failure is left to the caller
+// to report.
+static int run (const char *path, char *const *argv, const char *command,
+                const char *wdir, const kbctx_t *ctx, char *const *envp,
+                int infd, uint64_t timeout, uint64_t grace,
+                kbcancel_t *cancel, kbsink_t *sink, bool *noexec)
+{
+   int fds[2] = { -1, -1 };
+   int status = 0;
+   bool timedout = false;
+   bool failed_exec = false;
+
+   // Create pipe. Other threads spawn children at the same time, and any of
+   // them that inherited the write end would hold off EOF until it exited.
+   if ((pipe2 (fds, O_CLOEXEC)) != 0) {
+      KBXERROR ("Failed to create pipe: %m\n");
+      return -1;
+   }
+
+   pid_t pid = spawn_program (path, argv, envp, infd, fds[1], fds[0], wdir, ctx,
+                              &failed_exec);
+   if (pid < 0) {
+      if (noexec && failed_exec) {
+         *noexec = true;
+      } else {
+         KBXERROR ("Failed to spawn [%s] in [%s]: %m\n", command, wdir);
+      }
+      close (fds[0]);
+      close (fds[1]);
+      return -1;
+   }
+   close (fds[1]);
+   kbcancel_enter (cancel, pid);
+
+   // The event loop reads and reaps the child when pidfds are available
+   if ((status = kbmux_wait (pid, fds[0], sink, timeout, grace, &timedout)) < 0) {
+      if (timeout) {
+         timedout = read_output_until (fds[0], pid, command, sink, timeout, grace);
+      } else {
+         read_output (fds[0], command, sink);
+      }
+
+      // Closing the read end first means the child cannot block on a full pipe
+      close (fds[0]);
+      fds[0] = -1;
+      while ((waitpid (pid, &status, 0)) < 0) {
+         if (errno != EINTR) {
+            KBXERROR ("Failed to reap [%s]: %m\n", command);
+            status = -1;
+            break;
+         }
+      }
    }
 
-   if (inf) {
-      rc = pclose (inf);
+   if (fds[0] >= 0) {
+      close (fds[0]);
    }
-   static const uint8_t delim = 0;
-   write (fds[1], &delim, 1);
-   write (fds[1], &rc, sizeof rc);
+   kbcancel_leave (cancel, pid);
+   return status >= 0 && timedout ? status | KBEXEC_TIMEOUT : status;
+}
+
+int kbexec_command (const char *command, const char *wdir, const kbctx_t *ctx,
+                    char *const *envp, int infd, uint64_t timeout, uint64_t grace,
+                    kbcancel_t *cancel, kbsink_t *sink)
+{
+   char *argv[] = { (char *)"sh", (char *)"-c", (char *)command, NULL };
+   return run (shell_path, argv, command, wdir, ctx, envp, infd, timeout, grace,
+               cancel, sink, NULL);
+}
+
+int kbexec_program (const char *path, char *const *argv,
+                    const char *wdir, const kbctx_t *ctx, char *const *envp,
+                    int infd, uint64_t timeout, uint64_t grace,
+                    kbcancel_t *cancel, kbsink_t *sink)
+{
+   return run (path, argv, argv[0], wdir, ctx, envp, infd, timeout, grace,
+               cancel, sink, NULL);
+}
 
+int kbexec_zygote (const char *command, const char *wdir, const kbctx_t *ctx,
+                   char *const *envp, int infd, kbcancel_t *cancel,
+                   kbsink_t *sink)
+{
+   int fds[2] = { -1, -1 };
+
+   if ((pipe2 (fds, O_CLOEXEC)) != 0) {
+      KBXERROR ("Failed to create pipe: %m\n");
+      return -1;
+   }
+
+   int reply = kbzygote_spawn (command, wdir, ctx, envp, infd, fds[1]);
    close (fds[1]);
+   if (reply < 0) {
+      close (fds[0]);
+      KBWARN ("Zygote failed to spawn [%s] (%m), spawning it directly\n", command);
+      return kbexec_command (command, wdir, ctx, envp, infd, 0, 0, cancel, sink);
+   }
 
-   exit (rc);
+   pid_t pid = kbzygote_started (reply);
+   if (pid < 0) {
+      KBXERROR ("Failed to spawn [%s] in [%s]: %m\n", command, wdir);
+      close (fds[0]);
+      kbzygote_wait (reply);
+      return -1;
+   }
+   kbcancel_enter (cancel, pid);
+
+   read_output (fds[0], command, sink);
+   close (fds[0]);
+
+   int status = kbzygote_wait (reply);
+   kbcancel_leave (cancel, pid);
+   if (status < 0) {
+      KBXERROR ("Failed to reap [%s]: %m\n", command);
+   }
+   return status;
 }
 
 #if 0
@@ -101,31 +405,196 @@ void dumphex (const void *data, size_t len)
 }
 #endif
 
-int kbexec_shell (const kbnode_t *node, const char *command,
-                  char **dst, size_t *dstlen)
+// Whether the PATH in `envp` is the PATH of this process, which is where
+// kbcmd_which() looks for programs.
+static bool same_path (char *const *envp)
+{
+   const char *path = getenv ("PATH");
+   for (size_t i=0; envp && envp[i]; i++) {
+      if ((strncmp (envp[i], "PATH=", 5)) == 0) {
+         return path && (strcmp (&envp[i][5], path)) == 0;
+      }
+   }
+   return true;
+}
+
+// Runs `command` directly if `mode` allows it and it needs no shell, and
+// otherwise with a pooled shell, the zygote or a new shell, in that order.
+// The pooled shells and the children of the zygote are not ours to kill, so
+// a command with a timeout is always spawned by this process.
+// Returns the wait status, or -1 if the command could not be run.
+static int exec_mode (enum kbcmd_mode_t mode, const char *command,
+                      const char *wdir, const kbctx_t *ctx, char *const *envp,
+                      int infd, uint64_t timeout, uint64_t grace, kbcancel_t *cancel,
+                      kbsink_t *sink)
+{
+   char **argv = NULL;
+   char *path = NULL;
+   bool needs_shell = true;
+   int ret = -1;
+
+   if (mode == kbcmd_mode_NONE || mode == kbcmd_mode_AUTO) {
+      if (!(argv = kbcmd_split (command, &needs_shell)) && !needs_shell) {
+         KBIERROR ("OOM splitting [%s]\n", command);
+         return -1;
+      }
+   }
+
+   switch (mode) {
+      case kbcmd_mode_NONE:
+         if (!argv) {
+            KBXERROR ("SHELL = none, but [%s] needs a shell\n", command);
+         } else if (!(path = kbcmd_which (argv[0]))) {
+            KBXERROR ("Program [%s] not found in PATH\n", argv[0]);
+         } else {
+            ret = kbexec_program (path, argv, wdir, ctx, envp, infd, timeout, grace, cancel, sink);
+         }
+         goto cleanup;
+
+      case kbcmd_mode_BASH:
+         if (!(path = kbcmd_which ("bash"))) {
+            KBXERROR ("SHELL = bash, but bash was not found in PATH\n");
+         } else {
+            char *bash[] = { (char *)"bash", (char *)"-c", (char *)command, NULL };
+            ret = kbexec_program (path, bash, wdir, ctx, envp, infd, timeout, grace, cancel, sink);
+         }
+         goto cleanup;
+
+      case kbcmd_mode_AUTO:
+      case kbcmd_mode_SH:
+         break;
+   }
+
+   // The pooled shells run as the daemon user, in the environment of the
+   // daemon and with its stdin, so only commands without a RUNAS_USER,
+   // RUNAS_GROUP, STDIN or variables of their own can be given to them. They
+   // are cheaper than even a direct spawn, so they are preferred when they
+   // were asked for.
+   if (kbctx_self (ctx) && !envp && infd < 0 && !timeout && kbshell_pool_running ()) {
+      ret = kbshell_command (command, wdir, cancel, sink);
+   }
+
+   // A program that has gone away since it was cached is left to the shell,
+   // as are all programs when the node has a PATH of its own. Any other
+   // failure (of the directory, the user, or the program once it ran) would
+   // fail the same way in the shell, so it is returned as is.
+   bool noexec = false;
+   if (ret < 0 && argv && same_path (envp) && (path = kbcmd_which (argv[0]))) {
+      ret = run (path, argv, argv[0], wdir, ctx, envp, infd, timeout, grace,
+                 cancel, sink, &noexec);
+      if (!noexec) {
+         goto cleanup;
+      }
+      kbcmd_forget (argv[0]);
+   }
+
+   if (ret < 0) {
+      ret = kbzygote_running () && !timeout
+          ? kbexec_zygote (command, wdir, ctx, envp, infd, cancel, sink)
+          : kbexec_command (command, wdir, ctx, envp, infd, timeout, grace, cancel, sink);
+   }
+
+cleanup:
+   free (path);
+   kbutil_strarray_del (argv);
+   return ret;
+}
+
+// Find the credentials that the commands of `node` run with (see kbctx.h),
+// and the directory that they run in: the DIRECTORY of the node, or the
+// workspace `work`, created owned by that user and group. The caller frees
+// the directory, and clears `ctx`.
+static char *prepare (const kbnode_t *node, const char *id,
+                      const char *fname, size_t line, kbwork_t *work,
+                      kbctx_t *ctx)
+{
+   const char *wdir = kbnode_getvalue_first (node, KBNODE_KEY_WDIR);
+   const char *wuser = kbnode_getvalue_first (node, KBNODE_KEY_WUSER);
+   const char *wgroup = kbnode_getvalue_first (node, KBNODE_KEY_WGROUP);
+   char *ret = NULL;
+
+   if (!(kbctx_resolve (wuser, wgroup, ctx))) {
+      int error = errno;
+      KBPARSE_ERROR (fname, line, "Node [%s]: failed to lookup user [%s] or group [%s]: %s\n",
+               id, wuser, wgroup, error == ENOENT ? "not found" : strerror (error));
+      return NULL;
+   }
+
+   if (!wdir[0]) {
+      if (!(wdir = kbwork_path (work, ctx->uid, ctx->gid))) {
+         KBPARSE_ERROR (fname, line, "Node [%s]: failed to create workspace\n", id);
+         return NULL;
+      }
+   }
+   if (!(ret = ds_str_dup (wdir))) {
+      KBPARSE_ERROR (fname, line, "OOM copying directory name %s\n", wdir);
+   }
+   return ret;
+}
+
+char *kbexec_workdir (const kbnode_t *node, kbwork_t *work,
+                      uid_t *uid, gid_t *gid)
+{
+   const char *id = "Not set", *fname = "Not set";
+   size_t line = 0;
+
+   kbctx_t ctx;
+   kbnode_get_srcdef (node, &id, &fname, &line);
+   char *ret = prepare (node, id, fname, line, work, &ctx);
+   *uid = ctx.uid;
+   *gid = ctx.gid;
+   kbctx_clear (&ctx);
+   return ret;
+}
+
+// A file that holds `payload`, for the stdin of a command: a sealed memfd, or
+// an unlinked temporary file where memfds are not available. The payload is
+// never part of the command line, so it may be larger than ARG_MAX.
+static int stdin_file (const char *payload)
+{
+   int fd = memfd_create ("kubeka-stdin", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   if (fd < 0) {
+      fd = open ("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+   }
+   if (fd < 0) {
+      return -1;
+   }
+
+   size_t len = strlen (payload);
+   while (len) {
+      ssize_t nbytes = write (fd, payload, len);
+      if (nbytes < 0 && errno == EINTR) {
+         continue;
+      }
+      if (nbytes < 0) {
+         int saved = errno;
+         close (fd);
+         errno = saved;
+         return -1;
+      }
+      payload += nbytes;
+      len -= (size_t)nbytes;
+   }
+   // Only a memfd can be sealed; a command that was given it cannot change
+   // what it holds.
+   fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+   lseek (fd, 0, SEEK_SET);
+   return fd;
+}
+
+int kbexec_shell (const kbnode_t *node, const char *command, kbwork_t *work,
+                  kbcancel_t *cancel, kbsink_t *sink)
 {
    /* ************************************************************************
-    * Highly inefficient to perform a double spawn, but it allows the process
-    * to be isolated correctly.
-    *
     * 1. The node's relevant information is retrieved (command,
     *    working directory, target user to execute as, etc).
-    * 2. The working directory is created, and ownership of the directory
-    *    is transferred to the target user.
-    * 3. The pipe is created, to feed data back to parent.
-    * 4. A fork() is performed:
-    *       -  Child sets the current working directory and drops privileges to
-    *          the target user.
-    *       -  Parent reads and stores data from pipe until EOF
-    * 5. Child performs a `popen`, writing all data from the process to the pipe,
-    *    until EOF.
-    * 6. Child writes the exit code as an int to the pipe before closing it
-    *    with a nul byte preceding the exit code.
-    * 7. Child `exits()` with the return code of the spawned process.
-    * 8. Parent gets EOF on pipe, stops reading.
-    * 9. Parent parent finds the terminating nul in the string, and reads the
-    *    int exit code after it.
-    * 10. Parent returns the exit code (buffer is owned by caller, so nothing to
+    * 2. Without a DIRECTORY, the command runs in the workspace `work` (see
+    *    kbwork.h), which is created owned by the target user if this is its
+    *    first command.
+    * 3. The command is executed in the working directory by the target user,
+    *    directly if it needs no shell (see kbcmd.h), and otherwise by a
+    *    pooled shell, the zygote or a new shell (see kbexec_command()).
+    * 4. The exit status is returned (buffer is owned by caller, so nothing to
     *    return there).
     */
 
@@ -135,13 +604,13 @@ int kbexec_shell (const kbnode_t *node, const char *command,
    size_t line = 0;
 
    char *wdir = NULL;
-   char *wuser = NULL;
-   char *wgroup = NULL;
-   uid_t pw_uid = (uid_t)-1;
-   gid_t pw_gid = (gid_t)-1;
-
-   int fds[2] = { -1, -1 };
-   int rc = -1;
+   kbwork_t *ownwork = NULL;
+   char **envp = NULL;
+   int infd = -1;
+   kbctx_t ctx = KBCTX_INIT;
+   enum kbcmd_mode_t mode = kbcmd_mode_AUTO;
+   uint64_t timeout = 0;
+   uint64_t grace = KBEXEC_DEFAULT_GRACE;
 
    /* ********************************************************************
     * Get the node information
@@ -152,119 +621,74 @@ int kbexec_shell (const kbnode_t *node, const char *command,
       return EXIT_FAILURE;
    }
 
-   wdir = ds_str_dup (kbnode_getvalue_first (node, KBNODE_KEY_WDIR));
-   wuser = ds_str_dup (kbnode_getvalue_first (node, KBNODE_KEY_WUSER));
+   if (kbcancel_fired (cancel)) {
+      return KBEXEC_CANCELLED;
+   }
 
+   const char *shell = kbnode_getvalue_first (node, KBNODE_KEY_SHELL);
+   if (shell[0] && !(kbcmd_mode (shell, &mode))) {
+      KBPARSE_ERROR (fname, line, "Node [%s]: invalid value for SHELL [%s]\n",
+               id, shell);
+      return EXIT_FAILURE;
+   }
+
+   const char *s_timeout = kbnode_getvalue_first (node, KBNODE_KEY_TIMEOUT);
+   const char *s_grace = kbnode_getvalue_first (node, KBNODE_KEY_KILL_GRACE);
+   if ((s_timeout[0] && !(kbperiod_seconds (s_timeout, &timeout)))
+         || (s_grace[0] && !(kbperiod_seconds (s_grace, &grace)))) {
+      KBPARSE_ERROR (fname, line, "Node [%s]: invalid TIMEOUT [%s] or KILL_GRACE [%s]\n",
+               id, s_timeout, s_grace);
+      return EXIT_FAILURE;
+   }
 
    /* ********************************************************************
-    * Create the working environment.
+    * Create the working environment. Without a DIRECTORY, use the workspace
+    * (or one for this command alone if the caller has none).
     */
 
-   if (wuser && wuser[0]) {
-      // Get target user information
-      struct passwd *pwrec = getpwnam (wuser);
-      if (!pwrec) {
-         KBPARSE_ERROR (fname, line, "Failed to lookup user [%s]: %m\n", wuser);
-         goto cleanup;
-      }
-      pw_uid = pwrec->pw_gid;
-      pw_gid = pwrec->pw_gid;
+   if (!work && !(work = ownwork = kbwork_new (kbwork_scope_NODE, id))) {
+      goto cleanup;
    }
-
-   if (!wdir || !wdir[0]) {
-      free (wdir);
-      // No directory specified, make a temporary directory
-      if (!(wdir = ds_str_cat ("/tmp/node-", id, "XXXXXX", NULL))) {
-         KBPARSE_ERROR (fname, line, "OOM creating name node-%s-XXXXXX\n", id);
-         goto cleanup;
-      }
-      if (!(mkdtemp (wdir))) {
-         KBPARSE_ERROR (fname, line, "Failure creating dir %s: %m\n", wdir);
-         goto cleanup;
-      }
-      // Change user/group ownership. The manpage specifies that user
-      // ownership remains unchanged if specified as (uid_t)-1 and
-      // group ownership remains unchanged if specified as (gid_t)-1.
-      if ((chown (wdir, pw_uid, pw_gid)) != 0) {
-         KBPARSE_ERROR (fname, line,
-                  "Failed to change ownership of [%s] to [%s]: %m\n", wdir, wuser);
-         goto cleanup;
-      }
+   if (!(wdir = prepare (node, id, fname, line, work, &ctx))) {
+      goto cleanup;
    }
 
-   // Create pipe
-   if ((pipe (fds)) != 0) {
-      KBPARSE_ERROR (fname, line, "Failed to create pipe: %m\n");
+   if (!(kbnode_environ (node, &envp))) {
       goto cleanup;
    }
 
-   rc = fork ();
-   if (rc < 0) {
-      KBPARSE_ERROR (fname, line, "Failed to create new process: %m\n");
+   // Each command reads the STDIN of the node from the start
+   const char *payload = kbnode_getvalue_first (node, KBNODE_KEY_STDIN);
+   if (payload[0] && (infd = stdin_file (payload)) < 0) {
+      KBPARSE_ERROR (fname, line, "Node [%s]: failed to create STDIN of command [%s]: %m\n",
+               id, command);
       goto cleanup;
    }
 
-   size_t index = 0;
-   if (rc != 0) { // Parent
-      close(fds[1]);
-      fds[1] = -1;
-      *dstlen = 0;
-      if (!(resize_buffer (dst, dstlen, index))) {
-         KBIERROR ("Failed to resize array");
-         goto cleanup;
-      }
-      (*dst)[0] = 0;
-
-      uint8_t buf[32];
-      ssize_t nbytes = 0;
-      while ((nbytes = read (fds[0], buf, sizeof buf)) > 0) {
-         if (!(resize_buffer (dst, dstlen, index + nbytes + 1))) {
-            KBIERROR ("Failed to resize array");
-            goto cleanup;
-         }
-         memcpy (&(*dst)[index], buf, nbytes);
-         index += nbytes;
-         (*dst)[index] = 0;
-      }
-      close (fds[0]);
-      fds[0] = -1;
-      index -= sizeof ret;
-      memcpy (&ret, &(*dst)[index], sizeof ret);
-      *dstlen = index - 1;
-   } else { // Child
-      if (!(spawn_child (fds, id, fname, line, wdir, pw_uid, command))) {
-         KBPARSE_ERROR (fname, line, "Failed to spawn isolation process: %m\n");
-         goto cleanup;
-      }
-      ret = EXIT_SUCCESS;
+   ret = exec_mode (mode, command, wdir, &ctx, envp, infd, timeout, grace, cancel, sink);
+   if (ret < 0) {
+      KBPARSE_ERROR (fname, line, "Node [%s]: failed to execute command [%s]\n",
+               id, command);
+      ret = EXIT_FAILURE;
+   } else if (kbcancel_fired (cancel)) {
+      KBPARSE_ERROR (fname, line, "Node [%s]: command [%s] was cancelled\n",
+               id, command);
+      ret = (ret & ~KBEXEC_TIMEOUT) | KBEXEC_CANCELLED;
+   } else if (ret & KBEXEC_TIMEOUT) {
+      KBPARSE_ERROR (fname, line, "Node [%s]: command [%s] timed out after %s\n",
+               id, command, s_timeout);
    }
 
 cleanup:
-   if (wdir) {
-      // TODO: Perform rm -rf on the directory. Maybe just use the damn shell.
-      char *tmp = ds_str_cat ("rm -rf ", wdir, NULL);
-      if (!tmp) {
-         KBPARSE_ERROR (fname, line, "Node [%s]: failed to remove tempdir %s\n",
-                  id, wdir);
-         KBPARSE_ERROR (fname, line, "Remove dir %s manually\n", wdir);
-      } else {
-         errno = 0;
-         if ((system (tmp)) != 0) {
-            KBPARSE_ERROR (fname, line, "Failed to execute [%s]: %m\n", tmp);
-         }
-      }
-      free (tmp);
-   }
+   // A DIRECTORY is never removed, and a shared workspace is removed by its
+   // owner once its last command has run.
+   kbwork_del (ownwork);
 
    free (wdir);
-   free (wuser);
-   free (wgroup);
-
-   if (fds[0] > 0) {
-      close (fds[0]);
-   }
-   if (fds[1] > 0) {
-      close (fds[1]);
+   kbutil_strarray_del (envp);
+   kbctx_clear (&ctx);
+   if (infd >= 0) {
+      close (infd);
    }
 
    return ret;
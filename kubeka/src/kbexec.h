@@ -2,15 +2,64 @@
 #ifndef H_KBEXEC
 #define H_KBEXEC
 
+// Set in the status of a command that was killed for running past its
+// TIMEOUT. No wait status has this bit set, so a timeout is never mistaken
+// for a command that failed, or was killed by something else.
+#define KBEXEC_TIMEOUT           0x10000
+
+// Set in the status of a command that was stopped, or never started, because
+// the cancellation token it was run with fired (see kbcancel.h).
+#define KBEXEC_CANCELLED         0x20000
+
+// The seconds between SIGTERM and SIGKILL for nodes without a KILL_GRACE.
+#define KBEXEC_DEFAULT_GRACE     10
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-   // Note that dst and dstlen are used unchanged, so if dst was already allocated
-   // with length of dstlen bytes, it will be reused until the output of the command
-   // exceeds dstlen, at which point it will be reallocated.
-   int kbexec_shell (const kbnode_t *node, const char *command,
-                     char **dst, size_t *dstlen);
+   // The output of the command is written to `sink` (see kbsink.h). The
+   // command is stopped once it runs for longer than the TIMEOUT of the node,
+   // or when `cancel` fires. Unless the node sets a DIRECTORY the command runs
+   // in the workspace `work`, or in a workspace of its own if that is NULL.
+   int kbexec_shell (const kbnode_t *node, const char *command, kbwork_t *work,
+                     kbcancel_t *cancel, kbsink_t *sink);
+
+   // The directory that the commands of `node` run in: its DIRECTORY, or the
+   // workspace `work`, which is created if it does not exist yet. `*uid` and
+   // `*gid` are set to the user that the commands run as (-1 if they run as
+   // this process). The caller must free the returned string. Returns NULL if
+   // the directory could not be created.
+   char *kbexec_workdir (const kbnode_t *node, kbwork_t *work,
+                        uid_t *uid, gid_t *gid);
+
+   // Run `command` with /bin/sh in `wdir`, with the credentials `ctx` (those
+   // of this process if it is NULL, see kbctx.h), the environment `envp`
+   // (that of this process if it is NULL, see kbnode_environ()) and `infd` as
+   // its stdin (that of this process if it is -1), and write its output to
+   // `sink` as above. The shell is started with a single posix_spawn() or
+   // vfork(), never a fork() of the caller, in its own process group. If
+   // `timeout` is not 0 that group is sent SIGTERM after `timeout` seconds
+   // and SIGKILL `grace` seconds later. The group is registered with `cancel`
+   // (which may be NULL) while it runs. Returns the wait status of the shell
+   // (with KBEXEC_TIMEOUT set if it timed out), or -1 if it could not be run.
+   int kbexec_command (const char *command, const char *wdir, const kbctx_t *ctx,
+                       char *const *envp, int infd, uint64_t timeout,
+                       uint64_t grace, kbcancel_t *cancel, kbsink_t *sink);
+
+   // As kbexec_command(), but the program at `path` is started directly with
+   // `argv`, without a shell.
+   int kbexec_program (const char *path, char *const *argv,
+                       const char *wdir, const kbctx_t *ctx, char *const *envp,
+                       int infd, uint64_t timeout, uint64_t grace,
+                       kbcancel_t *cancel, kbsink_t *sink);
+
+   // As kbexec_command(), but the shell is spawned by the zygote (see
+   // kbzygote.h). If the zygote cannot take the request the shell is spawned
+   // directly instead.
+   int kbexec_zygote (const char *command, const char *wdir, const kbctx_t *ctx,
+                      char *const *envp, int infd, kbcancel_t *cancel,
+                      kbsink_t *sink);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,148 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "kbhash.h"
+
+static const uint32_t K[64] = {
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+   0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+   0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+   0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+   0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+   0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+   0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+   0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+   0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x,n)     (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void transform (kbhash_t *hash, const unsigned char *block)
+{
+   uint32_t w[64];
+   for (size_t i=0; i<16; i++) {
+      w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+           | (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+   }
+   for (size_t i=16; i<64; i++) {
+      uint32_t s0 = ROR (w[i - 15], 7) ^ ROR (w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = ROR (w[i - 2], 17) ^ ROR (w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+   }
+
+   uint32_t a = hash->state[0], b = hash->state[1], c = hash->state[2],
+            d = hash->state[3], e = hash->state[4], f = hash->state[5],
+            g = hash->state[6], h = hash->state[7];
+   for (size_t i=0; i<64; i++) {
+      uint32_t s1 = ROR (e, 6) ^ ROR (e, 11) ^ ROR (e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + K[i] + w[i];
+      uint32_t s0 = ROR (a, 2) ^ ROR (a, 13) ^ ROR (a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+   }
+   hash->state[0] += a;
+   hash->state[1] += b;
+   hash->state[2] += c;
+   hash->state[3] += d;
+   hash->state[4] += e;
+   hash->state[5] += f;
+   hash->state[6] += g;
+   hash->state[7] += h;
+}
+
+void kbhash_init (kbhash_t *hash)
+{
+   static const uint32_t initial[8] = {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+   };
+   memcpy (hash->state, initial, sizeof initial);
+   hash->length = 0;
+   hash->used = 0;
+}
+
+void kbhash_update (kbhash_t *hash, const void *data, size_t len)
+{
+   const unsigned char *p = data;
+   hash->length += len;
+   while (len) {
+      size_t n = sizeof hash->block - hash->used;
+      if (n > len) {
+         n = len;
+      }
+      memcpy (&hash->block[hash->used], p, n);
+      hash->used += n;
+      p += n;
+      len -= n;
+      if (hash->used == sizeof hash->block) {
+         transform (hash, hash->block);
+         hash->used = 0;
+      }
+   }
+}
+
+void kbhash_string (kbhash_t *hash, const char *s)
+{
+   kbhash_update (hash, s, strlen (s) + 1);
+}
+
+void kbhash_final (kbhash_t *hash, char *hex)
+{
+   uint64_t bits = hash->length * 8;
+   unsigned char pad = 0x80;
+   kbhash_update (hash, &pad, 1);
+   pad = 0;
+   while (hash->used != 56) {
+      kbhash_update (hash, &pad, 1);
+   }
+   unsigned char len[8];
+   for (size_t i=0; i<8; i++) {
+      len[i] = (unsigned char)(bits >> (56 - i * 8));
+   }
+   kbhash_update (hash, len, sizeof len);
+
+   for (size_t i=0; i<8; i++) {
+      snprintf (&hex[i * 8], 9, "%08x", (unsigned)hash->state[i]);
+   }
+}
+
+bool kbhash_fd (int fd, char *hex)
+{
+   kbhash_t hash;
+   char buf[64 * 1024];
+
+   kbhash_init (&hash);
+   while (true) {
+      ssize_t nbytes = read (fd, buf, sizeof buf);
+      if (nbytes < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return false;
+      }
+      if (nbytes == 0) {
+         break;
+      }
+      kbhash_update (&hash, buf, (size_t)nbytes);
+   }
+   kbhash_final (&hash, hex);
+   return true;
+}
@@ -0,0 +1,42 @@
+
+#ifndef H_KBHASH
+#define H_KBHASH
+
+// SHA-256, for the content addresses of the result cache and the artifact
+// store. Digests are passed around as lowercase hex strings.
+
+#define KBHASH_HEXLEN      (64)
+
+typedef struct kbhash_t {
+   uint32_t state[8];
+   uint64_t length;
+   unsigned char block[64];
+   size_t used;
+} kbhash_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void kbhash_init (kbhash_t *hash);
+   void kbhash_update (kbhash_t *hash, const void *data, size_t len);
+
+   // Add a string and its terminating nul, so that the boundaries between
+   // consecutive strings are part of the digest.
+   void kbhash_string (kbhash_t *hash, const char *s);
+
+   // Write the digest of everything added to `hex`, which must have room for
+   // KBHASH_HEXLEN + 1 bytes.
+   void kbhash_final (kbhash_t *hash, char *hex);
+
+   // The digest of the contents of the file open on `fd`. Returns false with
+   // errno set if it could not be read.
+   bool kbhash_fd (int fd, char *hex);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,393 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "ds_array.h"
+#include "ds_hmap.h"
+
+#include "kbnode.h"
+#include "kbutil.h"
+#include "kbindex.h"
+
+#define NTYPES       (kbnode_type_ENTRYPOINT + 1)
+
+// A list of positions in the indexed collection, in ascending order.
+struct list_t {
+   size_t *pos;
+   size_t len;
+   size_t cap;
+};
+
+struct kbindex_t {
+   const ds_array_t *nodes;
+   struct list_t types[NTYPES];
+   ds_hmap_t *keys;     // { char *: struct list_t * }
+   ds_hmap_t *ids;      // { char *: struct list_t * }
+   ds_hmap_t *handles;  // { char *: struct list_t * }
+};
+
+static bool list_append (struct list_t *list, size_t pos)
+{
+   if (list->len >= list->cap) {
+      size_t newcap = list->cap ? list->cap * 2 : 8;
+      size_t *tmp = realloc (list->pos, newcap * sizeof *tmp);
+      if (!tmp) {
+         KBIERROR ("OOM growing index list to %zu entries\n", newcap);
+         return false;
+      }
+      list->pos = tmp;
+      list->cap = newcap;
+   }
+   list->pos[list->len++] = pos;
+   return true;
+}
+
+// Appends `pos` to the list stored under `name` in `table`, creating the list
+// if necessary.
+static bool table_append (ds_hmap_t *table, const char *name, size_t pos)
+{
+   struct list_t *list = NULL;
+   if (!(ds_hmap_get_str_ptr (table, name, (void **)&list, NULL))) {
+      if (!(list = calloc (1, sizeof *list))) {
+         KBIERROR ("OOM allocating index list for [%s]\n", name);
+         return false;
+      }
+      if (!(ds_hmap_set_str_ptr (table, name, list, 0))) {
+         KBIERROR ("OOM storing index list for [%s]\n", name);
+         free (list);
+         return false;
+      }
+   }
+   return list_append (list, pos);
+}
+
+static void table_del (ds_hmap_t *table)
+{
+   if (!table)
+      return;
+
+   char **keys = NULL;
+   size_t nkeys = ds_hmap_keys (table, (void ***)&keys, NULL);
+   for (size_t i=0; i<nkeys && keys && keys[i]; i++) {
+      struct list_t *list = NULL;
+      if ((ds_hmap_get_str_ptr (table, keys[i], (void **)&list, NULL))) {
+         free (list->pos);
+         free (list);
+      }
+   }
+   free (keys);
+   ds_hmap_del (table);
+}
+
+static const struct list_t *table_find (ds_hmap_t *table, const char *name)
+{
+   struct list_t *ret = NULL;
+   if (!name || !(ds_hmap_get_str_ptr (table, name, (void **)&ret, NULL))) {
+      return NULL;
+   }
+   return ret;
+}
+
+static const struct list_t *find_type (const kbindex_t *index, const char *name)
+{
+   enum kbnode_type_t type = kbnode_type_parse (name);
+   return type == kbnode_type_UNKNOWN ? NULL : &index->types[type];
+}
+
+static const struct list_t *find_key (const kbindex_t *index, const char *key)
+{
+   return table_find (index->keys, key);
+}
+
+// Merge the (ascending) lists into a single array of nodes, skipping positions
+// that occur in more than one list, so that the result is in collection order.
+static ds_array_t *merge (const kbindex_t *index,
+                          const struct list_t **lists, size_t nlists)
+{
+   ds_array_t *ret = ds_array_new ();
+   size_t *cursors = calloc (nlists + 1, sizeof *cursors);
+   size_t last = (size_t)-1;
+
+   if (!ret || !cursors) {
+      KBIERROR ("OOM merging %zu index lists\n", nlists);
+      ds_array_del (ret);
+      free (cursors);
+      return NULL;
+   }
+
+   while (true) {
+      size_t min = (size_t)-1;
+      size_t which = 0;
+      for (size_t i=0; i<nlists; i++) {
+         if (lists[i] && cursors[i] < lists[i]->len
+               && lists[i]->pos[cursors[i]] < min) {
+            min = lists[i]->pos[cursors[i]];
+            which = i;
+         }
+      }
+      if (min == (size_t)-1) {
+         break;
+      }
+      cursors[which]++;
+      if (min == last) {
+         continue;
+      }
+      last = min;
+      if (!(ds_array_ins_tail (ret, ds_array_get (index->nodes, min)))) {
+         KBIERROR ("OOM appending to query result\n");
+         ds_array_del (ret);
+         ret = NULL;
+         break;
+      }
+   }
+
+   free (cursors);
+   return ret;
+}
+
+// Collects the lists for all the terms in `a1, ...` and merges them.
+static ds_array_t *query (const kbindex_t *index,
+                          const struct list_t *(*find) (const kbindex_t *,
+                                                        const char *),
+                          const char *a1, va_list ap)
+{
+   va_list ap2;
+   va_copy (ap2, ap);
+
+   size_t nlists = 0;
+   for (const char *tmp = a1; tmp; tmp = va_arg (ap2, const char *)) {
+      nlists++;
+   }
+   va_end (ap2);
+
+   const struct list_t **lists = calloc (nlists + 1, sizeof *lists);
+   if (!lists) {
+      KBIERROR ("OOM error allocating array of %zu entries\n", nlists + 1);
+      return NULL;
+   }
+
+   size_t i = 0;
+   for (const char *tmp = a1; tmp; tmp = va_arg (ap, const char *)) {
+      lists[i++] = find (index, tmp);
+   }
+
+   ds_array_t *ret = merge (index, lists, nlists);
+   free (lists);
+   return ret;
+}
+
+
+kbindex_t *kbindex_new (const ds_array_t *nodes)
+{
+   bool error = true;
+   kbindex_t *ret = NULL;
+   const char **keys = NULL;
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      KBIERROR ("OOM allocating node index\n");
+      goto cleanup;
+   }
+
+   ret->nodes = nodes;
+   if (!(ret->keys = ds_hmap_new (128))
+         || !(ret->ids = ds_hmap_new (128))
+         || !(ret->handles = ds_hmap_new (128))) {
+      KBIERROR ("OOM allocating node index tables\n");
+      goto cleanup;
+   }
+
+   size_t nnodes = ds_array_length (nodes);
+   for (size_t i=0; i<nnodes; i++) {
+      const kbnode_t *node = ds_array_get (nodes, i);
+      enum kbnode_type_t type = kbnode_type (node);
+      if ((size_t)type >= NTYPES) {
+         type = kbnode_type_UNKNOWN;
+      }
+      if (!(list_append (&ret->types[type], i))) {
+         goto cleanup;
+      }
+
+      free (keys);
+      keys = kbnode_keys (node);
+      for (size_t j=0; keys && keys[j]; j++) {
+         if (!(table_append (ret->keys, keys[j], i))) {
+            goto cleanup;
+         }
+      }
+
+      const char *id = kbnode_getvalue_first (node, KBNODE_KEY_ID);
+      if (id && !(table_append (ret->ids, id, i))) {
+         goto cleanup;
+      }
+
+      const char **handles = kbnode_getvalue_all (node, KBNODE_KEY_HANDLES);
+      for (size_t j=0; handles && handles[j]; j++) {
+         if (!(table_append (ret->handles, handles[j], i))) {
+            goto cleanup;
+         }
+      }
+   }
+
+   error = false;
+cleanup:
+   free (keys);
+   if (error) {
+      kbindex_del (ret);
+      ret = NULL;
+   }
+   return ret;
+}
+
+void kbindex_del (kbindex_t *index)
+{
+   if (!index)
+      return;
+
+   for (size_t i=0; i<NTYPES; i++) {
+      free (index->types[i].pos);
+   }
+
+   table_del (index->keys);
+   table_del (index->ids);
+   table_del (index->handles);
+
+   free (index);
+}
+
+size_t kbindex_count_type (const kbindex_t *index, enum kbnode_type_t type)
+{
+   if (!index || (size_t)type >= NTYPES) {
+      return 0;
+   }
+   return index->types[type].len;
+}
+
+size_t kbindex_count_key (const kbindex_t *index, const char *key)
+{
+   const struct list_t *list = index ? find_key (index, key) : NULL;
+   return list ? list->len : 0;
+}
+
+ds_array_t *kbindex_filter_types (const kbindex_t *index, const char *type, ...)
+{
+   va_list ap;
+   va_start (ap, type);
+   ds_array_t *ret = query (index, find_type, type, ap);
+   va_end (ap);
+   return ret;
+}
+
+ds_array_t *kbindex_filter_keyname (const kbindex_t *index, const char *keyname, ...)
+{
+   va_list ap;
+   va_start (ap, keyname);
+   ds_array_t *ret = query (index, find_key, keyname, ap);
+   va_end (ap);
+   return ret;
+}
+
+kbnode_t *kbindex_find (const kbindex_t *index, const char *id)
+{
+   const struct list_t *list = table_find (index->ids, id);
+   return list && list->len ? ds_array_get (index->nodes, list->pos[0]) : NULL;
+}
+
+ds_array_t *kbindex_filter_handlers (const kbindex_t *index, const char **signals)
+{
+   size_t nlists = kbutil_strarray_length (signals);
+   const struct list_t **lists = calloc (nlists + 1, sizeof *lists);
+   if (!lists) {
+      KBIERROR ("OOM error allocating array of %zu entries\n", nlists + 1);
+      return NULL;
+   }
+
+   for (size_t i=0; i<nlists; i++) {
+      lists[i] = table_find (index->handles, signals[i]);
+   }
+
+   ds_array_t *ret = merge (index, lists, nlists);
+   free (lists);
+   return ret;
+}
+
+// Marks every node in `list` that is not already marked, and pushes it onto
+// the stack.
+static void push_unmarked (const struct list_t *list, bool *marked,
+                           size_t *stack, size_t *top)
+{
+   for (size_t i=0; list && i<list->len; i++) {
+      if (!marked[list->pos[i]]) {
+         marked[list->pos[i]] = true;
+         stack[(*top)++] = list->pos[i];
+      }
+   }
+}
+
+ds_array_t *kbindex_reachable (const kbindex_t *index, ds_array_t **unreachable)
+{
+   bool error = true;
+   ds_array_t *ret = NULL;
+   size_t nnodes = ds_array_length (index->nodes);
+   bool *marked = calloc (nnodes + 1, sizeof *marked);
+   size_t *stack = calloc (nnodes + 1, sizeof *stack);
+   size_t top = 0;
+
+   if (unreachable) {
+      *unreachable = NULL;
+   }
+
+   if (!marked || !stack) {
+      KBIERROR ("OOM allocating reachability state for %zu nodes\n", nnodes);
+      goto cleanup;
+   }
+
+   // Each node is pushed at most once, when it is first marked, so the stack
+   // never holds more than `nnodes` entries.
+   push_unmarked (&index->types[kbnode_type_PERIODIC], marked, stack, &top);
+   push_unmarked (&index->types[kbnode_type_ENTRYPOINT], marked, stack, &top);
+   while (top) {
+      const kbnode_t *node = ds_array_get (index->nodes, stack[--top]);
+
+      const char **jobs = kbnode_getvalue_all (node, KBNODE_KEY_JOBS);
+      for (size_t i=0; jobs && jobs[i]; i++) {
+         push_unmarked (table_find (index->ids, jobs[i]), marked, stack, &top);
+      }
+
+      const char **signals = kbnode_getvalue_all (node, KBNODE_KEY_EMITS);
+      for (size_t i=0; signals && signals[i]; i++) {
+         push_unmarked (table_find (index->handles, signals[i]), marked, stack, &top);
+      }
+   }
+
+   if (!(ret = ds_array_new ()) || (unreachable && !(*unreachable = ds_array_new ()))) {
+      KBIERROR ("OOM allocating reachability results\n");
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<nnodes; i++) {
+      ds_array_t *dst = marked[i] ? ret : unreachable ? *unreachable : NULL;
+      if (dst && !(ds_array_ins_tail (dst, ds_array_get (index->nodes, i)))) {
+         KBIERROR ("OOM storing reachability results\n");
+         goto cleanup;
+      }
+   }
+
+   error = false;
+cleanup:
+   free (marked);
+   free (stack);
+   if (error) {
+      ds_array_del (ret);
+      ret = NULL;
+      if (unreachable) {
+         ds_array_del (*unreachable);
+         *unreachable = NULL;
+      }
+   }
+   return ret;
+}
+
@@ -0,0 +1,57 @@
+
+#ifndef H_KBINDEX
+#define H_KBINDEX
+
+// An index over a collection of nodes, built once after the nodes are loaded.
+// Nodes are listed per type, per key for every key that appears in any node,
+// per ID and per handled signal, so queries by type or by key presence cost
+// O(result) instead of a scan of every node. Results are returned in the same
+// order as the nodes in the indexed collection.
+//
+// The index does not own the nodes, and must be rebuilt if the collection
+// changes.
+
+typedef struct kbindex_t kbindex_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   kbindex_t *kbindex_new (const ds_array_t *nodes);
+   void kbindex_del (kbindex_t *index);
+
+   // Return the number of nodes of the specified type, and the number of nodes
+   // that have the specified key.
+   size_t kbindex_count_type (const kbindex_t *index, enum kbnode_type_t type);
+   size_t kbindex_count_key (const kbindex_t *index, const char *key);
+
+   // Return an array of nodes that match any of the types specified in `type, ...`.
+   // Note that the final parameter must be NULL. Equivalent to
+   // kbnode_filter_types() on the indexed collection.
+   ds_array_t *kbindex_filter_types (const kbindex_t *index, const char *type, ...);
+
+   // Return an array of nodes that have any of the keys specified in `keyname, ...`.
+   // Note that the final parameter must be NULL. Equivalent to
+   // kbnode_filter_keyname() on the indexed collection.
+   ds_array_t *kbindex_filter_keyname (const kbindex_t *index, const char *keyname, ...);
+
+   // Return the first node whose ID is `id`, or NULL if there is none.
+   kbnode_t *kbindex_find (const kbindex_t *index, const char *id);
+
+   // Return an array of the nodes that handle any of the signals in `signals`,
+   // whose final element must be NULL. Equivalent to kbnode_filter_handlers()
+   // on the indexed collection.
+   ds_array_t *kbindex_filter_handlers (const kbindex_t *index, const char **signals);
+
+   // Return the nodes that can be reached from any [periodic] or [entrypoint]
+   // node by following JOBS[] references and the handlers of EMITS[] signals.
+   // If `unreachable` is not NULL it is set to an array of all the other nodes.
+   // The caller must delete both arrays, but not the nodes in them.
+   ds_array_t *kbindex_reachable (const kbindex_t *index, ds_array_t **unreachable);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
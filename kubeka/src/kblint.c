@@ -0,0 +1,330 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "ds_array.h"
+
+#include "kbnode.h"
+#include "kbindex.h"
+#include "kbtree.h"
+#include "kbutil.h"
+#include "kbctx.h"
+#include "kblint.h"
+
+// The diagnostics of one step of a task. If the buffer could not be created
+// the diagnostics go straight to stderr, unordered, rather than being lost.
+struct diag_t {
+   char *text;
+   size_t len;
+   FILE *outf;
+};
+
+// A check task only has a single step, and uses the first slot.
+enum step_t {
+   step_CHECK = 0,
+   step_INSTANTIATE = 0,
+   step_EVAL,
+   step_COUNT,
+};
+
+struct task_t {
+   struct diag_t diag[step_COUNT];
+   size_t errors[step_COUNT];
+   size_t warnings[step_COUNT];
+   kbnode_t *tree;
+};
+
+struct worker_t {
+   kblint_t *lint;
+   size_t id;
+   pthread_t tid;
+};
+
+// The first `nnodes` tasks check a node each, the rest each instantiate and
+// evaluate one entrypoint.
+struct kblint_t {
+   const ds_array_t *nodes;
+   const ds_array_t *entrypoints;
+   ds_array_t *reachable;
+   kbindex_t *index;
+   size_t nnodes;
+   size_t ntasks;
+   struct task_t *tasks;
+
+   size_t njobs;
+   kbnode_region_t **regions;
+
+   pthread_mutex_t lock;
+   size_t next;
+};
+
+static FILE *diag_begin (struct diag_t *diag)
+{
+   diag->outf = open_memstream (&diag->text, &diag->len);
+   return kbutil_diag_redirect (diag->outf);
+}
+
+static void diag_end (struct diag_t *diag, FILE *prev)
+{
+   kbutil_diag_redirect (prev);
+   if (diag->outf) {
+      fclose (diag->outf);
+      diag->outf = NULL;
+   }
+}
+
+static void diag_flush (struct diag_t *diag)
+{
+   if (diag->text) {
+      fwrite (diag->text, 1, diag->len, stderr);
+      fflush (stderr);
+   }
+}
+
+// Resolve the users and groups that the nodes of an evaluated tree run as, so
+// that they are known before the first command runs.
+static void check_credentials (const kbnode_t *node, size_t *nwarnings)
+{
+   const char *user = kbnode_getvalue_first (node, KBNODE_KEY_WUSER);
+   const char *group = kbnode_getvalue_first (node, KBNODE_KEY_WGROUP);
+   kbctx_t ctx;
+
+   if (!(kbctx_resolve (user, group, &ctx))) {
+      const char *id = "Not set", *fname = "Not set";
+      size_t line = 0;
+      int error = errno;
+      kbnode_get_srcdef (node, &id, &fname, &line);
+      KBPARSE_WARN (fname, line, "Node [%s]: failed to lookup user [%s] or group [%s]: %s\n",
+               id, user, group, error == ENOENT ? "not found" : strerror (error));
+      (*nwarnings)++;
+   }
+   kbctx_clear (&ctx);
+
+   size_t nnodes = kbnode_nhandlers (node);
+   for (size_t i=0; i<nnodes; i++) {
+      const kbnode_t *child = kbnode_handler (node, i);
+      if (child) {
+         check_credentials (child, nwarnings);
+      }
+   }
+   nnodes = kbnode_njobs (node);
+   for (size_t i=0; i<nnodes; i++) {
+      const kbnode_t *child = kbnode_job (node, i);
+      if (child) {
+         check_credentials (child, nwarnings);
+      }
+   }
+}
+
+static void run_task (kblint_t *lint, size_t worker, size_t index)
+{
+   struct task_t *task = &lint->tasks[index];
+   FILE *prev = NULL;
+
+   if (index < lint->nnodes) {
+      prev = diag_begin (&task->diag[step_CHECK]);
+      kbnode_check (ds_array_get (lint->nodes, index),
+                    &task->errors[step_CHECK], &task->warnings[step_CHECK]);
+      diag_end (&task->diag[step_CHECK], prev);
+      return;
+   }
+
+   const kbnode_t *ep = ds_array_get (lint->entrypoints, index - lint->nnodes);
+   prev = diag_begin (&task->diag[step_INSTANTIATE]);
+   task->tree = kbnode_instantiate (ep, lint->index, lint->regions[worker],
+                                    &task->errors[step_INSTANTIATE],
+                                    &task->warnings[step_INSTANTIATE]);
+   diag_end (&task->diag[step_INSTANTIATE], prev);
+
+   if (task->tree) {
+      prev = diag_begin (&task->diag[step_EVAL]);
+      kbtree_eval (task->tree, &task->errors[step_EVAL], &task->warnings[step_EVAL]);
+      if (!task->errors[step_EVAL]) {
+         check_credentials (task->tree, &task->warnings[step_EVAL]);
+      }
+      diag_end (&task->diag[step_EVAL], prev);
+   }
+}
+
+static void *worker_main (void *arg)
+{
+   struct worker_t *worker = arg;
+   kblint_t *lint = worker->lint;
+
+   while (true) {
+      pthread_mutex_lock (&lint->lock);
+      size_t index = lint->next++;
+      pthread_mutex_unlock (&lint->lock);
+      if (index >= lint->ntasks) {
+         break;
+      }
+      run_task (lint, worker->id, index);
+   }
+   return NULL;
+}
+
+
+kblint_t *kblint_new (const ds_array_t *nodes, const ds_array_t *entrypoints,
+                      ds_array_t *reachable, size_t njobs)
+{
+   bool error = true;
+   kblint_t *ret = NULL;
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      KBIERROR ("OOM allocating linter\n");
+      goto cleanup;
+   }
+
+   ret->nodes = nodes;
+   ret->entrypoints = entrypoints;
+   ret->reachable = reachable;
+   // Shared by all the workers, which only read it
+   if (!(ret->index = kbindex_new (reachable))) {
+      goto cleanup;
+   }
+   ret->nnodes = ds_array_length (nodes);
+   ret->ntasks = ret->nnodes + ds_array_length (entrypoints);
+
+   // No point in having more workers than there are tasks
+   ret->njobs = njobs < ret->ntasks ? njobs : ret->ntasks;
+   if (!ret->njobs) {
+      ret->njobs = 1;
+   }
+
+   if (!(ret->tasks = calloc (ret->ntasks + 1, sizeof *ret->tasks))
+         || !(ret->regions = calloc (ret->njobs, sizeof *ret->regions))) {
+      KBIERROR ("OOM allocating %zu lint tasks\n", ret->ntasks);
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<ret->njobs; i++) {
+      if (!(ret->regions[i] = kbnode_region_new ())) {
+         KBIERROR ("OOM creating region for worker %zu\n", i);
+         goto cleanup;
+      }
+   }
+
+   pthread_mutex_init (&ret->lock, NULL);
+
+   error = false;
+cleanup:
+   if (error && ret) {
+      for (size_t i=0; ret->regions && i<ret->njobs; i++) {
+         kbnode_region_del (ret->regions[i]);
+      }
+      kbindex_del (ret->index);
+      free (ret->regions);
+      free (ret->tasks);
+      free (ret);
+      ret = NULL;
+   }
+   return ret;
+}
+
+void kblint_del (kblint_t *lint)
+{
+   if (!lint)
+      return;
+
+   for (size_t i=0; i<lint->ntasks; i++) {
+      for (size_t j=0; j<step_COUNT; j++) {
+         free (lint->tasks[i].diag[j].text);
+      }
+   }
+   for (size_t i=0; i<lint->njobs; i++) {
+      kbnode_region_del (lint->regions[i]);
+   }
+   pthread_mutex_destroy (&lint->lock);
+   kbindex_del (lint->index);
+   free (lint->regions);
+   free (lint->tasks);
+   free (lint);
+}
+
+bool kblint_run (kblint_t *lint, ds_array_t *trees,
+                 size_t *nerrors, size_t *nwarnings)
+{
+   struct worker_t *workers = calloc (lint->njobs, sizeof *workers);
+   if (!workers) {
+      KBIERROR ("OOM allocating %zu workers\n", lint->njobs);
+      return false;
+   }
+
+   // The calling thread is worker 0. If a thread cannot be started, the
+   // remaining workers simply pick up its share of the tasks.
+   size_t nstarted = 1;
+   workers[0].lint = lint;
+   for (size_t i=1; i<lint->njobs; i++) {
+      workers[i].lint = lint;
+      workers[i].id = i;
+      if ((pthread_create (&workers[i].tid, NULL, worker_main, &workers[i])) != 0) {
+         KBWARN ("Failed to start lint worker %zu, continuing with %zu\n",
+                 i, nstarted);
+         break;
+      }
+      nstarted++;
+   }
+   worker_main (&workers[0]);
+   for (size_t i=1; i<nstarted; i++) {
+      pthread_join (workers[i].tid, NULL);
+   }
+   free (workers);
+
+   // Everything is printed in the order in which it would have been printed
+   // by a single thread: the checks, then the instantiations, then the
+   // evaluations.
+   bool error = false;
+   for (size_t i=0; i<lint->nnodes; i++) {
+      struct task_t *task = &lint->tasks[i];
+      diag_flush (&task->diag[step_CHECK]);
+      *nerrors += task->errors[step_CHECK];
+      *nwarnings += task->warnings[step_CHECK];
+   }
+
+   for (size_t i=lint->nnodes; i<lint->ntasks; i++) {
+      struct task_t *task = &lint->tasks[i];
+      diag_flush (&task->diag[step_INSTANTIATE]);
+      *nerrors += task->errors[step_INSTANTIATE];
+      *nwarnings += task->warnings[step_INSTANTIATE];
+      if (!task->tree) {
+         KBXERROR ("Node instantiation failure\n");
+         continue;
+      }
+      if (!(ds_array_ins_tail (trees, task->tree))) {
+         KBIERROR ("OOM storing new root node\n");
+         error = true;
+      }
+   }
+
+   for (size_t i=lint->nnodes; i<lint->ntasks; i++) {
+      struct task_t *task = &lint->tasks[i];
+      if (!task->tree) {
+         continue;
+      }
+      diag_flush (&task->diag[step_EVAL]);
+      printf ("Node [%s]: %zu errors, %zu warnings\n",
+               kbnode_getvalue_first (task->tree, KBNODE_KEY_ID),
+               task->errors[step_EVAL], task->warnings[step_EVAL]);
+      *nerrors += task->errors[step_EVAL];
+      *nwarnings += task->warnings[step_EVAL];
+   }
+
+   return !error;
+}
+
+size_t kblint_nregions (const kblint_t *lint)
+{
+   return lint ? lint->njobs : 0;
+}
+
+kbnode_region_t *kblint_region (const kblint_t *lint, size_t i)
+{
+   return lint && i < lint->njobs ? lint->regions[i] : NULL;
+}
+
@@ -0,0 +1,44 @@
+
+#ifndef H_KBLINT
+#define H_KBLINT
+
+// The lint pipeline: every node is checked, and every entrypoint is
+// instantiated and evaluated, with the users and groups that its nodes run
+// as resolved (see kbctx.h). These tasks are independent of each other, so
+// they are spread over a number of worker threads. The diagnostics of each
+// task are collected in a buffer of their own and printed, once all the tasks
+// are done, in the same order in which a single thread would have printed
+// them.
+
+typedef struct kblint_t kblint_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Prepare to lint the `nodes`, and to instantiate each node in
+   // `entrypoints` using the nodes in `reachable`. The arrays must remain
+   // valid until kblint_run() returns. Each of the `njobs` workers
+   // instantiates its trees into a region of its own.
+   kblint_t *kblint_new (const ds_array_t *nodes, const ds_array_t *entrypoints,
+                         ds_array_t *reachable, size_t njobs);
+   void kblint_del (kblint_t *lint);
+
+   // Run all the tasks, print their diagnostics, and add their counts to
+   // `nerrors` and `nwarnings`. Each tree that was successfully instantiated
+   // is appended to `trees`, in the order of the entrypoints.
+   bool kblint_run (kblint_t *lint, ds_array_t *trees,
+                    size_t *nerrors, size_t *nwarnings);
+
+   // Return the number of regions (one per worker) and the region of a single
+   // worker. The regions, and the trees in them, are deleted with the linter.
+   size_t kblint_nregions (const kblint_t *lint);
+   kbnode_region_t *kblint_region (const kblint_t *lint, size_t i);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,816 @@
+
+// For syscall()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <linux/io_uring.h>
+
+#include <pthread.h>
+
+#include "kbutil.h"
+#include "kbsink.h"
+#include "kburing.h"
+#include "kbmux.h"
+
+struct child_t;
+
+enum event_t {
+   event_OUTPUT,
+   event_EXIT,
+   event_TIMER,
+};
+
+// The epoll data of each of the two descriptors of a child, and of the timer.
+struct watch_t {
+   struct child_t *child;
+   enum event_t event;
+};
+
+struct child_t {
+   // Links in the queue, then in the list of watched children.
+   struct child_t *prev;
+   struct child_t *next;
+
+   pid_t pid;
+   int pidfd;
+   int fd;
+   kbsink_t *sink;
+   kbmux_done_t *done;
+   void *arg;
+
+   bool eof;
+   bool exited;
+   int status;
+
+   // Monotonic milliseconds at which the child is sent SIGTERM, or SIGKILL
+   // once it has timed out; 0 for none.
+   uint64_t deadline;
+   uint64_t grace;
+   bool timedout;
+
+   // The io_uring loop reads into one of the shared buffers (`buf`), or into
+   // a buffer of its own when all of those are taken.
+   int buf;
+   char *heapbuf;
+   bool splicing;
+   // The poll for its exit or the read of its output that could not be
+   // queued yet (see uring_retry()).
+   bool pending_exit;
+   bool pending_read;
+
+   struct watch_t output;
+   struct watch_t exit;
+};
+
+// Only the loop thread touches the epoll set and the children in it. Other
+// threads hand new children over on the queue, and wake the loop with the
+// eventfd.
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct child_t *g_queue = NULL;
+static bool g_stopping = false;
+static bool g_unsupported = false;
+static int g_epfd = -1;
+static int g_wakefd = -1;
+static pthread_t g_thread;
+
+// Every watched child, and the timer that is armed for the earliest of
+// their deadlines.
+static struct child_t *g_children = NULL;
+static int g_timerfd = -1;
+static uint64_t g_armed = 0;
+static struct watch_t g_timer = { NULL, event_TIMER };
+
+// The io_uring loop. Children that read into memory share NBUFS buffers,
+// registered with the ring when the memlock limit allows.
+#define BUFSIZE      (64 * 1024)
+#define NBUFS        16
+static bool g_use_uring = false;
+static kburing_t *g_ring = NULL;
+static char *g_bufs = NULL;
+static bool g_fixed = false;
+static int g_freebufs[NBUFS];
+static size_t g_nfreebufs = 0;
+// The completions of the polls that only gate a splice are ignored.
+static struct watch_t g_ignore;
+// What could not be queued because the submission queue was full (or no
+// buffer could be allocated) is queued again after the next completions,
+// and at least every RETRY_MS, rather than waited for on the loop thread.
+#define RETRY_MS     10
+static size_t g_npending = 0;
+static bool g_wake_pending = false;
+static bool g_timer_pending = false;
+
+static int pidfd_open (pid_t pid)
+{
+#ifdef SYS_pidfd_open
+   return (int)syscall (SYS_pidfd_open, pid, 0);
+#else
+   (void)pid;
+   errno = ENOSYS;
+   return -1;
+#endif
+}
+
+static void child_reap (struct child_t *child, int flags)
+{
+   int status = 0;
+   pid_t rc;
+   while ((rc = waitpid (child->pid, &status, flags)) < 0 && errno == EINTR)
+      ;
+   if (rc == 0) {
+      // The pidfd became readable before the child could be waited for.
+      return;
+   }
+   if (rc < 0) {
+      KBXERROR ("Failed to reap process %i: %m\n", (int)child->pid);
+      status = EXIT_FAILURE << 8;
+   }
+   child->status = status;
+   child->exited = true;
+}
+
+static uint64_t now_ms (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Each child leads its own process group, so that whatever it started is
+// stopped with it.
+static void child_kill (struct child_t *child, uint64_t now)
+{
+   int sig = child->timedout ? SIGKILL : SIGTERM;
+   if ((kill (-child->pid, sig)) != 0 && !child->exited) {
+      kill (child->pid, sig);
+   }
+   child->deadline = child->timedout ? 0 : now + child->grace;
+   child->timedout = true;
+}
+
+// Signals every child that is past its deadline, and arms the timer for the
+// next one.
+static void timer_check (void)
+{
+   uint64_t now = now_ms ();
+   uint64_t next = 0;
+
+   for (struct child_t *child = g_children; child; child = child->next) {
+      if (child->deadline && child->deadline <= now) {
+         child_kill (child, now);
+      }
+      if (child->deadline && (!next || child->deadline < next)) {
+         next = child->deadline;
+      }
+   }
+   if (g_npending && (!next || now + RETRY_MS < next)) {
+      next = now + RETRY_MS;
+   }
+
+   if (next != g_armed) {
+      struct itimerspec its;
+      memset (&its, 0, sizeof its);
+      its.it_value.tv_sec = (time_t)(next / 1000);
+      its.it_value.tv_nsec = (long)(next % 1000) * 1000000;
+      if ((timerfd_settime (g_timerfd, TFD_TIMER_ABSTIME, &its, NULL)) != 0) {
+         KBXERROR ("Failed to arm child timer: %m\n");
+      }
+      g_armed = next;
+   }
+}
+
+static void timer_fired (void)
+{
+   uint64_t counter;
+   if ((read (g_timerfd, &counter, sizeof counter)) < 0) {
+      // A stale wakeup, the timer was rearmed since.
+   }
+   g_armed = 0;
+   timer_check ();
+}
+
+static void child_finish (struct child_t *child)
+{
+   if (child->prev) {
+      child->prev->next = child->next;
+   } else {
+      g_children = child->next;
+   }
+   if (child->next) {
+      child->next->prev = child->prev;
+   }
+
+   if (child->buf >= 0) {
+      g_freebufs[g_nfreebufs++] = child->buf;
+   }
+   free (child->heapbuf);
+   close (child->pidfd);
+   child->done (child->status, child->timedout, child->arg);
+   free (child);
+}
+
+static void child_output (struct child_t *child)
+{
+   // One read per event, so that a noisy child cannot starve the others.
+   ssize_t nbytes = kbsink_pump (child->sink, child->fd);
+   if (nbytes > 0 || (nbytes < 0 && (errno == EAGAIN || errno == EINTR))) {
+      return;
+   }
+   if (nbytes < 0) {
+      KBXERROR ("Failed to read output of process %i: %m\n", (int)child->pid);
+   }
+   epoll_ctl (g_epfd, EPOLL_CTL_DEL, child->fd, NULL);
+   child->eof = true;
+}
+
+static void child_exited (struct child_t *child)
+{
+   child_reap (child, WNOHANG);
+   if (child->exited) {
+      epoll_ctl (g_epfd, EPOLL_CTL_DEL, child->pidfd, NULL);
+   }
+}
+
+static void watch (struct child_t *child)
+{
+   struct epoll_event output = { EPOLLIN, { .ptr = &child->output } };
+   struct epoll_event exit = { EPOLLIN, { .ptr = &child->exit } };
+
+   int flags = fcntl (child->fd, F_GETFL);
+   if (flags >= 0
+         && (fcntl (child->fd, F_SETFL, flags | O_NONBLOCK)) == 0
+         && (epoll_ctl (g_epfd, EPOLL_CTL_ADD, child->fd, &output)) == 0) {
+      if ((epoll_ctl (g_epfd, EPOLL_CTL_ADD, child->pidfd, &exit)) == 0) {
+         return;
+      }
+      epoll_ctl (g_epfd, EPOLL_CTL_DEL, child->fd, NULL);
+   }
+
+   // Out of epoll watches: the child is handed back untouched, for the caller
+   // to read and reap, as the other children cannot wait for it.
+   KBWARN ("Cannot watch process %i (%m), handing it back\n", (int)child->pid);
+   if (flags >= 0) {
+      fcntl (child->fd, F_SETFL, flags);
+   }
+   child->status = -1;
+   child_finish (child);
+}
+
+// Watch the children handed over by other threads. Returns true if the loop
+// must stop.
+static bool take_queue (void (*watchfn) (struct child_t *))
+{
+   uint64_t counter;
+   if ((read (g_wakefd, &counter, sizeof counter)) < 0) {
+      // Nothing to do, the eventfd is only a doorbell
+   }
+   pthread_mutex_lock (&g_lock);
+   struct child_t *queue = g_queue;
+   bool stopping = g_stopping;
+   g_queue = NULL;
+   pthread_mutex_unlock (&g_lock);
+   while (queue) {
+      struct child_t *next = queue->next;
+      queue->prev = NULL;
+      queue->next = g_children;
+      if (g_children) {
+         g_children->prev = queue;
+      }
+      g_children = queue;
+      watchfn (queue);
+      queue = next;
+   }
+   timer_check ();
+   return stopping;
+}
+
+static void *loop (void *arg)
+{
+   struct epoll_event events[64];
+   (void)arg;
+
+   while (true) {
+      int nevents = epoll_wait (g_epfd, events, sizeof events / sizeof events[0], -1);
+      if (nevents < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         KBXERROR ("Failed to wait for children: %m\n");
+         break;
+      }
+
+      for (int i=0; i<nevents; i++) {
+         struct watch_t *w = events[i].data.ptr;
+         if (!w) {
+            if (take_queue (watch)) {
+               return NULL;
+            }
+            continue;
+         }
+
+         struct child_t *child = w->child;
+         switch (w->event) {
+            case event_TIMER:
+               timer_fired ();
+               continue;
+            case event_EXIT:
+               child_exited (child);
+               break;
+            case event_OUTPUT:
+               child_output (child);
+               break;
+         }
+         if (child->eof && child->exited) {
+            child_finish (child);
+         }
+      }
+   }
+   return NULL;
+}
+
+static bool uring_poll (int fd, struct watch_t *w)
+{
+   struct io_uring_sqe *sqe = kburing_sqe (g_ring);
+   if (!sqe) {
+      return false;
+   }
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = fd;
+   sqe->poll_events = POLLIN;
+   sqe->user_data = (uintptr_t)w;
+   return true;
+}
+
+static void uring_pend (bool *pending)
+{
+   if (!*pending) {
+      *pending = true;
+      g_npending++;
+   }
+}
+
+static void uring_wait_exit (struct child_t *child)
+{
+   if (!(uring_poll (child->pidfd, &child->exit))) {
+      uring_pend (&child->pending_exit);
+   }
+}
+
+static char *uring_buf (struct child_t *child)
+{
+   if (child->buf >= 0) {
+      return &g_bufs[child->buf * BUFSIZE];
+   }
+   if (!child->heapbuf && g_nfreebufs) {
+      child->buf = g_freebufs[--g_nfreebufs];
+      return &g_bufs[child->buf * BUFSIZE];
+   }
+   if (!child->heapbuf) {
+      child->heapbuf = malloc (BUFSIZE);
+   }
+   return child->heapbuf;
+}
+
+static void uring_read (struct child_t *child)
+{
+   struct io_uring_sqe *sqe = NULL;
+   int logfd = kbsink_splicefd (child->sink);
+
+   if (logfd >= 0) {
+      // A splice is always done by a kernel worker, so it only starts once a
+      // poll on the pipe (linked to it) says that there is something to move.
+      struct io_uring_sqe *poll = kburing_sqe (g_ring);
+      if (poll && (sqe = kburing_sqe (g_ring))) {
+         poll->opcode = IORING_OP_POLL_ADD;
+         poll->fd = child->fd;
+         poll->poll_events = POLLIN;
+         poll->flags = IOSQE_IO_LINK;
+         poll->user_data = (uintptr_t)&g_ignore;
+
+         sqe->opcode = IORING_OP_SPLICE;
+         sqe->fd = logfd;
+         sqe->off = (uint64_t)-1;
+         sqe->splice_off_in = (uint64_t)-1;
+         sqe->splice_fd_in = child->fd;
+         sqe->len = 1024 * 1024;
+         sqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK;
+         sqe->user_data = (uintptr_t)&child->output;
+         child->splicing = true;
+         return;
+      }
+      if (poll) {
+         // Left as a no-op
+         poll->user_data = (uintptr_t)&g_ignore;
+      }
+      uring_pend (&child->pending_read);
+      return;
+   }
+
+   char *buf = uring_buf (child);
+   if (!buf || !(sqe = kburing_sqe (g_ring))) {
+      uring_pend (&child->pending_read);
+      return;
+   }
+   sqe->opcode = IORING_OP_READ;
+   if (g_fixed && child->buf >= 0) {
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->buf_index = (uint16_t)child->buf;
+   }
+   sqe->fd = child->fd;
+   sqe->addr = (uintptr_t)buf;
+   sqe->len = BUFSIZE;
+   sqe->off = (uint64_t)-1;
+   sqe->user_data = (uintptr_t)&child->output;
+   child->splicing = false;
+}
+
+static void uring_output (struct child_t *child, int res)
+{
+   if (res == -EINTR || res == -EAGAIN) {
+      uring_read (child);
+      return;
+   }
+   if (res == -EINVAL && child->splicing) {
+      // The log file (or the kernel) does not support splicing
+      kbsink_nosplice (child->sink);
+      uring_read (child);
+      return;
+   }
+   if (res > 0) {
+      if (child->splicing) {
+         kbsink_spliced (child->sink, (size_t)res);
+      } else if (!(kbsink_write (child->sink, uring_buf (child), (size_t)res))) {
+         KBXERROR ("Failed to write output of process %i: %m\n", (int)child->pid);
+         res = 0;
+      }
+      if (res > 0) {
+         uring_read (child);
+         return;
+      }
+   }
+   if (res < 0) {
+      errno = -res;
+      KBXERROR ("Failed to read output of process %i: %m\n", (int)child->pid);
+   }
+   child->eof = true;
+}
+
+static void uring_exited (struct child_t *child)
+{
+   child_reap (child, WNOHANG);
+   if (!child->exited) {
+      uring_wait_exit (child);
+   }
+}
+
+static void uring_watch (struct child_t *child)
+{
+   uring_wait_exit (child);
+   uring_read (child);
+   if (child->eof && child->exited) {
+      child_finish (child);
+   }
+}
+
+// Queue again what could not be queued before.
+static void uring_retry (void)
+{
+   if (g_wake_pending && uring_poll (g_wakefd, NULL)) {
+      g_wake_pending = false;
+      g_npending--;
+   }
+   if (g_timer_pending && uring_poll (g_timerfd, &g_timer)) {
+      g_timer_pending = false;
+      g_npending--;
+   }
+   for (struct child_t *child = g_children; child && g_npending; child = child->next) {
+      if (child->pending_exit) {
+         child->pending_exit = false;
+         g_npending--;
+         uring_wait_exit (child);
+      }
+      if (child->pending_read) {
+         child->pending_read = false;
+         g_npending--;
+         uring_read (child);
+      }
+   }
+}
+
+// Everything queued while the completions are processed is submitted with
+// the next wait, in a single system call.
+static void *loop_uring (void *arg)
+{
+   (void)arg;
+
+   if (!(uring_poll (g_wakefd, NULL)) || !(uring_poll (g_timerfd, &g_timer))) {
+      KBXERROR ("Failed to wait for children: %m\n");
+      return NULL;
+   }
+
+   while (true) {
+      // EBUSY means the completion queue is full, which processing the
+      // completions fixes.
+      if (!(kburing_submit (g_ring, 1)) && errno != EBUSY && errno != EAGAIN) {
+         KBXERROR ("Failed to wait for children: %m\n");
+         break;
+      }
+
+      struct io_uring_cqe *cqe;
+      while ((cqe = kburing_cqe (g_ring))) {
+         struct watch_t *w = (struct watch_t *)(uintptr_t)cqe->user_data;
+         int res = cqe->res;
+         kburing_seen (g_ring);
+
+         if (w == &g_ignore) {
+            continue;
+         }
+         if (!w) {
+            if (take_queue (uring_watch)) {
+               return NULL;
+            }
+            if (!(uring_poll (g_wakefd, NULL))) {
+               uring_pend (&g_wake_pending);
+            }
+            continue;
+         }
+
+         struct child_t *child = w->child;
+         switch (w->event) {
+            case event_TIMER:
+               timer_fired ();
+               if (!(uring_poll (g_timerfd, &g_timer))) {
+                  uring_pend (&g_timer_pending);
+               }
+               continue;
+            case event_EXIT:
+               uring_exited (child);
+               break;
+            case event_OUTPUT:
+               uring_output (child, res);
+               break;
+         }
+         if (child->eof && child->exited) {
+            child_finish (child);
+         }
+      }
+
+      if (g_npending) {
+         uring_retry ();
+         timer_check ();
+      }
+   }
+   return NULL;
+}
+
+static bool uring_start (void)
+{
+   struct iovec iov[NBUFS];
+
+   if (!(g_ring = kburing_new (256))) {
+      return false;
+   }
+   if (!(g_bufs = malloc (NBUFS * BUFSIZE))) {
+      kburing_del (g_ring);
+      g_ring = NULL;
+      errno = ENOMEM;
+      return false;
+   }
+   for (int i=0; i<NBUFS; i++) {
+      iov[i].iov_base = &g_bufs[i * BUFSIZE];
+      iov[i].iov_len = BUFSIZE;
+      g_freebufs[i] = i;
+   }
+   g_nfreebufs = NBUFS;
+   // The buffers are pinned, which the memlock limit may not allow; the
+   // plain reads are used then.
+   g_fixed = kburing_register_buffers (g_ring, iov, NBUFS);
+   return true;
+}
+
+static void uring_stop (void)
+{
+   kburing_del (g_ring);
+   free (g_bufs);
+   g_ring = NULL;
+   g_bufs = NULL;
+   g_fixed = false;
+   g_nfreebufs = 0;
+}
+
+// Called with g_lock held.
+static bool start (void)
+{
+   struct epoll_event wake = { EPOLLIN, { .ptr = NULL } };
+   struct epoll_event timer = { EPOLLIN, { .ptr = &g_timer } };
+   sigset_t all, saved;
+
+   if (g_wakefd >= 0) {
+      return true;
+   }
+
+   if ((g_wakefd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0
+         || (g_timerfd = timerfd_create (CLOCK_MONOTONIC,
+                                         TFD_CLOEXEC | TFD_NONBLOCK)) < 0) {
+      KBXERROR ("Failed to create event loop: %m\n");
+      goto error;
+   }
+   if (g_use_uring && !(uring_start ())) {
+      KBWARN ("Cannot use io_uring (%m), using epoll\n");
+   }
+   if (!g_ring
+         && ((g_epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0
+            || (epoll_ctl (g_epfd, EPOLL_CTL_ADD, g_wakefd, &wake)) != 0
+            || (epoll_ctl (g_epfd, EPOLL_CTL_ADD, g_timerfd, &timer)) != 0)) {
+      KBXERROR ("Failed to create event loop: %m\n");
+      goto error;
+   }
+
+   // Signals are for the other threads
+   sigfillset (&all);
+   pthread_sigmask (SIG_SETMASK, &all, &saved);
+   int rc = pthread_create (&g_thread, NULL, g_ring ? loop_uring : loop, NULL);
+   pthread_sigmask (SIG_SETMASK, &saved, NULL);
+   if (rc != 0) {
+      errno = rc;
+      KBXERROR ("Failed to start event loop thread: %m\n");
+      goto error;
+   }
+   g_stopping = false;
+   return true;
+
+error:
+   if (g_ring) {
+      uring_stop ();
+   }
+   if (g_epfd >= 0) {
+      close (g_epfd);
+   }
+   if (g_wakefd >= 0) {
+      close (g_wakefd);
+   }
+   if (g_timerfd >= 0) {
+      close (g_timerfd);
+   }
+   g_epfd = g_wakefd = g_timerfd = -1;
+   return false;
+}
+
+void kbmux_use_uring (bool enable)
+{
+   pthread_mutex_lock (&g_lock);
+   g_use_uring = enable;
+   pthread_mutex_unlock (&g_lock);
+}
+
+bool kbmux_add (pid_t pid, int fd, kbsink_t *sink,
+                uint64_t timeout, uint64_t grace,
+                kbmux_done_t *done, void *arg)
+{
+   struct child_t *child = NULL;
+   int pidfd = -1;
+   bool error = true;
+
+   pthread_mutex_lock (&g_lock);
+
+   if (g_unsupported) {
+      goto cleanup;
+   }
+   if ((pidfd = pidfd_open (pid)) < 0) {
+      g_unsupported = errno == ENOSYS;
+      goto cleanup;
+   }
+   if (!(start ())) {
+      goto cleanup;
+   }
+   if (!(child = calloc (1, sizeof *child))) {
+      KBIERROR ("OOM allocating child %i\n", (int)pid);
+      goto cleanup;
+   }
+
+   child->pid = pid;
+   child->pidfd = pidfd;
+   child->fd = fd;
+   child->sink = sink;
+   child->done = done;
+   child->arg = arg;
+   child->buf = -1;
+   child->output.child = child;
+   child->output.event = event_OUTPUT;
+   child->exit.child = child;
+   child->exit.event = event_EXIT;
+   child->deadline = timeout ? now_ms () + timeout * 1000 : 0;
+   child->grace = grace * 1000;
+   child->next = g_queue;
+   g_queue = child;
+
+   uint64_t one = 1;
+   if ((write (g_wakefd, &one, sizeof one)) < 0) {
+      // The counter cannot overflow in practice, and the loop is awake
+      // anyway if it did.
+   }
+
+   error = false;
+cleanup:
+   pthread_mutex_unlock (&g_lock);
+   if (error) {
+      free (child);
+      if (pidfd >= 0) {
+         close (pidfd);
+      }
+   }
+   return !error;
+}
+
+struct waiter_t {
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   bool done;
+   int status;
+   bool timedout;
+};
+
+static void waiter_done (int status, bool timedout, void *arg)
+{
+   struct waiter_t *w = arg;
+   pthread_mutex_lock (&w->lock);
+   w->status = status;
+   w->timedout = timedout;
+   w->done = true;
+   pthread_cond_signal (&w->cond);
+   pthread_mutex_unlock (&w->lock);
+}
+
+int kbmux_wait (pid_t pid, int fd, kbsink_t *sink,
+                uint64_t timeout, uint64_t grace, bool *timedout)
+{
+   struct waiter_t w = {
+      PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, -1, false,
+   };
+
+   if (!(kbmux_add (pid, fd, sink, timeout, grace, waiter_done, &w))) {
+      return -1;
+   }
+
+   pthread_mutex_lock (&w.lock);
+   while (!w.done) {
+      pthread_cond_wait (&w.cond, &w.lock);
+   }
+   pthread_mutex_unlock (&w.lock);
+   pthread_cond_destroy (&w.cond);
+   pthread_mutex_destroy (&w.lock);
+   *timedout = w.timedout;
+   return w.status;
+}
+
+void kbmux_stop (void)
+{
+   pthread_mutex_lock (&g_lock);
+   if (g_wakefd < 0) {
+      pthread_mutex_unlock (&g_lock);
+      return;
+   }
+   g_stopping = true;
+   uint64_t one = 1;
+   if ((write (g_wakefd, &one, sizeof one)) < 0) {
+      KBXERROR ("Failed to stop event loop: %m\n");
+   }
+   pthread_mutex_unlock (&g_lock);
+
+   pthread_join (g_thread, NULL);
+
+   pthread_mutex_lock (&g_lock);
+   if (g_ring) {
+      uring_stop ();
+   } else {
+      close (g_epfd);
+   }
+   close (g_wakefd);
+   close (g_timerfd);
+   g_epfd = g_wakefd = g_timerfd = -1;
+   g_armed = 0;
+   g_npending = 0;
+   g_wake_pending = g_timer_pending = false;
+   g_stopping = false;
+   pthread_mutex_unlock (&g_lock);
+}
+
@@ -0,0 +1,60 @@
+
+#ifndef H_KBMUX
+#define H_KBMUX
+
+// A single thread that supervises every running child: an epoll loop that
+// moves the output of each child from its pipe to its sink, and is told of
+// the exit of each child by a pidfd. The loop is started with the first
+// child it is given, so that a run that starts no children has no thread.
+//
+// Children can only be supervised when the kernel supports pidfds (Linux
+// 5.3 and later); otherwise kbmux_add() fails and the caller reads and reaps
+// the child itself.
+//
+// The loop can instead be driven by an io_uring, which batches the reads of
+// all the children into one system call per wakeup, reads into registered
+// buffers, and splices into log files. It falls back to epoll if the kernel
+// does not allow an io_uring.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Called from the loop thread once the output of the child has reached
+   // EOF and the child has been reaped, with its wait status and whether it
+   // was killed for running past its timeout. A `status` of -1 means that the
+   // loop could not watch the child after all, and nothing was read or
+   // reaped.
+   typedef void (kbmux_done_t) (int status, bool timedout, void *arg);
+
+   // Drive the loop with an io_uring. This must be done before the first
+   // child is added.
+   void kbmux_use_uring (bool enable);
+
+   // Supervise the child `pid`, moving its output from `fd` (the read end of
+   // its stdout pipe, which may be made non-blocking) to `sink` until EOF. The
+   // caller keeps ownership of `fd` and `sink`, and must not use either
+   // until `done` is called. Returns false if the child cannot be supervised.
+   //
+   // If `timeout` is not 0, the process group of the child (which must lead
+   // one) is sent SIGTERM once it has run for that many seconds, and SIGKILL
+   // `grace` seconds later.
+   bool kbmux_add (pid_t pid, int fd, kbsink_t *sink,
+                   uint64_t timeout, uint64_t grace,
+                   kbmux_done_t *done, void *arg);
+
+   // As kbmux_add(), but waits for the child. Returns its wait status, or -1
+   // if it cannot be supervised (in which case nothing was read or reaped).
+   int kbmux_wait (pid_t pid, int fd, kbsink_t *sink,
+                   uint64_t timeout, uint64_t grace, bool *timedout);
+
+   // Stop the loop thread. No child may be running.
+   void kbmux_stop (void);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
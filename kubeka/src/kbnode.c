@@ -20,15 +20,25 @@
 #include <inttypes.h>
 #include <limits.h>
 
+#include <sys/types.h>
+
 #include "ds_set.h"
 #include "ds_array.h"
 #include "ds_hmap.h"
 #include "ds_str.h"
 
 #include "kbnode.h"
+#include "kbindex.h"
+#include "kbcmd.h"
+#include "kbpool.h"
 #include "kbperiod.h"
+#include "kbsink.h"
 #include "kbsym.h"
 #include "kbutil.h"
+#include "kbcancel.h"
+#include "kbwork.h"
+
+extern char **environ;
 
 #define INCPTR(x)    do {\
    (x) = (x) + 1;\
@@ -60,7 +70,7 @@ static const struct {
 static const char *node_type_name (enum kbnode_type_t type)
 {
 
-   static char unknown[45];
+   static __thread char unknown[45];
 
    for (size_t i=0; i<sizeof node_type_names / sizeof node_type_names[0]; i++) {
       if (node_type_names[i].type == type) {
@@ -84,48 +94,42 @@ static enum kbnode_type_t node_type_type (const char *name)
 struct kbnode_t {
    enum kbnode_type_t type;
    kbsymtab_t *symtab;
-   kbnode_t *parent;
-   ds_array_t *jobs;
-   ds_array_t *handlers;
    uint64_t flags;
+
+   // Nodes read from a file are allocated individually and have no pool. All the
+   // nodes of an instantiated tree are stored in a pool, and the links between
+   // them are indices into that pool. The children of a node are stored at
+   // consecutive indices starting at `children`: first the `njobs` jobs, then
+   // the `nhandlers` handlers.
+   //
+   // The pool is either private to the tree, in which case `owner` is set on
+   // the root, or it belongs to a region shared by many trees.
+   kbpool_t *pool;
+   size_t index;
+   size_t parent;
+   size_t children;
+   size_t njobs;
+   size_t nhandlers;
+   bool owner;
+
+   // The variables set for the node with kbnode_setenv(), as NAME=VALUE, in
+   // the order they were set.
+   char **env;
 };
 
-static size_t find_node (ds_array_t *nodelist, kbnode_t *node)
-{
-   if (!nodelist || !node) {
-      return (size_t)-1;
-   }
-   size_t nnodes = ds_array_length (nodelist);
-   for (size_t i=0; i<nnodes; i++) {
-      if ((ds_array_get (nodelist, i)) == node) {
-         return i;
-      }
-   }
-   return (size_t)-1;
-}
+struct kbnode_region_t {
+   kbpool_t *pool;
+   kbsymtab_image_t *image;
+};
 
-static size_t node_find_job (kbnode_t *node, kbnode_t *job)
+static kbnode_t *node_at (const kbpool_t *pool, size_t index)
 {
-   return node ? find_node (node->jobs, job) : (size_t)-1;
+   return index == KBPOOL_NONE ? NULL : kbpool_get (pool, index);
 }
 
-static size_t node_find_handler (kbnode_t *node, kbnode_t *handler)
+static kbnode_t *node_parent (const kbnode_t *node)
 {
-   return node ? find_node (node->handlers, handler) : (size_t)-1;
-}
-
-
-static const kbnode_t *node_findbyid (ds_array_t *all, const char *id)
-{
-   size_t n = ds_array_length (all);
-   for (size_t i=0; i< n; i++) {
-      const kbnode_t *node = ds_array_get (all, i);
-      const char *node_id = kbsymtab_get_string (node->symtab, KBNODE_KEY_ID);
-      if ((strcmp (node_id, id)) == 0) {
-         return node;
-      }
-   }
-   return NULL;
+   return node ? node_at (node->pool, node->parent) : NULL;
 }
 
 static const kbnode_t *node_findparent (const kbnode_t *node, const char *id)
@@ -133,14 +137,14 @@ static const kbnode_t *node_findparent (const kbnode_t *node, const char *id)
    if (!node)
       return NULL;
 
-   fprintf (stderr, "Checking [%s] for a parent with id [%s]\n",
+   fprintf (KBDIAG, "Checking [%s] for a parent with id [%s]\n",
             kbsymtab_get_string (node->symtab, KBNODE_KEY_ID),
             id);
    if ((strcmp (kbsymtab_get_string (node->symtab, KBNODE_KEY_ID), id)) == 0) {
       return node;
    }
 
-   return node_findparent (node->parent, id);
+   return node_findparent (node_parent (node), id);
 }
 
 struct djobs_t {
@@ -149,7 +153,7 @@ struct djobs_t {
 };
 
 static struct djobs_t *node_find_dependent_jobs (const kbnode_t *node,
-                                                 ds_array_t *all,
+                                                 const kbindex_t *all,
                                                  size_t *nerrors)
 {
    if (!node || !all) {
@@ -203,7 +207,7 @@ static struct djobs_t *node_find_dependent_jobs (const kbnode_t *node,
          NULL,
       };
 
-      sighandlers = kbnode_filter_handlers (all, sigs);
+      sighandlers = kbindex_filter_handlers (all, sigs);
       if (!sighandlers) {
          KBIERROR ("OOM filtering signals into array\n");
          INCPTR (*nerrors);
@@ -260,32 +264,46 @@ static void node_del (kbnode_t *node)
    if (!node)
       return;
 
-   // Remove this node from parent's list of jobs and handlers
-   if (node->parent) {
-      size_t me = -1;
-      if ((me = node_find_job (node->parent, node)) != (size_t)-1) {
-         ds_array_rm (node->parent->jobs, me);
-      }
-      if ((me = node_find_handler (node->parent, node)) != (size_t)-1) {
-         ds_array_rm (node->parent->jobs, me);
-      }
+   if (node->symtab) {
+      kbsymtab_del (node->symtab);
    }
+   kbutil_strarray_del (node->env);
+   free (node);
+}
 
-   // Recursively delete all jobs and handlers
-   ds_array_fptr (node->jobs, (void (*) (void *))node_del);
-   ds_array_fptr (node->handlers, (void (*) (void *))node_del);
-   ds_array_del (node->jobs);
-   ds_array_del (node->handlers);
-
-   // Clear out the symbol table
-   kbsymtab_del (node->symtab);
+// Releases everything held by the nodes stored at index `from` onwards, in a
+// single pass over the pool, without following any links between nodes.
+static void node_pool_release (kbpool_t *pool, size_t from)
+{
+   size_t nnodes = kbpool_length (pool);
+   for (size_t i=from; i<nnodes; i++) {
+      kbnode_t *node = node_at (pool, i);
+      if (node->symtab) {
+         kbsymtab_del (node->symtab);
+         node->symtab = NULL;
+      }
+      kbutil_strarray_del (node->env);
+      node->env = NULL;
+   }
+}
 
-   free (node);
+// Releases everything held by the subtree rooted at `node`. The slots remain in
+// the pool until the pool itself is deleted.
+static void node_subtree_release (kbnode_t *node)
+{
+   size_t nchildren = node->njobs + node->nhandlers;
+   for (size_t i=0; i<nchildren; i++) {
+      node_subtree_release (node_at (node->pool, node->children + i));
+   }
+   if (node->symtab) {
+      kbsymtab_del (node->symtab);
+      node->symtab = NULL;
+   }
+   kbutil_strarray_del (node->env);
+   node->env = NULL;
 }
 
-static kbnode_t *node_new (const char *fname, size_t line,
-                           const char *typename,
-                           kbnode_t *parent, enum childtype_t childtype)
+static kbnode_t *node_new (const char *fname, size_t line, const char *typename)
 {
    bool error = true;
    enum kbnode_type_t type = node_type_type (typename);
@@ -307,6 +325,10 @@ static kbnode_t *node_new (const char *fname, size_t line,
       goto cleanup;
    }
 
+   ret->index = KBPOOL_NONE;
+   ret->parent = KBPOOL_NONE;
+   ret->children = KBPOOL_NONE;
+
    if (!(ret->symtab = kbsymtab_new ())) {
       goto cleanup;
    }
@@ -317,36 +339,13 @@ static kbnode_t *node_new (const char *fname, size_t line,
       goto cleanup;
    }
 
-   if (!(ret->jobs = ds_array_new ()) || !(ret->handlers = ds_array_new ())) {
-      goto cleanup;
-   }
-
-   // Attach to parent, if a parent is specified.
-   if (parent) {
-      ret->parent = parent;
-      void *inserted = NULL;
-      switch (childtype) {
-         case childtype_JOB:
-            inserted = ds_array_ins_tail (parent->jobs, ret);
-            break;
-
-         case childtype_HANDLER:
-            inserted = ds_array_ins_tail (parent->handlers, ret);
-            break;
-
-         case childtype_NONE:
-            break;
-      }
-      if (!inserted) {
-         goto cleanup;
-      }
-   }
    ret->type = type;
 
    error = false;
 cleanup:
    if (error) {
       node_del (ret);
+      ret = NULL;
    }
    return ret;
 }
@@ -361,26 +360,55 @@ static int64_t node_line (const kbnode_t *node)
    return kbsymtab_get_int (node->symtab, KBNODE_KEY_LINE);
 }
 
-static kbnode_t *node_instantiate (const kbnode_t *src,
-                                   kbnode_t *parent, enum childtype_t childtype,
-                                   ds_array_t *all,
-                                   size_t *errors, size_t *warnings)
+// Creates the instance of `src` in the pool, as the next child of `parent` (or as
+// the root of the tree if `parent` is KBPOOL_NONE) and returns its index. The
+// parent must already have reserved the slots for all its children.
+//
+// On error the node is left in the pool, which is released by the caller that
+// created the pool.
+static size_t node_instantiate (const kbnode_t *src, kbpool_t *pool,
+                                size_t parent, enum childtype_t childtype,
+                                const kbindex_t *all,
+                                size_t *errors, size_t *warnings)
 {
-   bool error = true;
+   size_t ret = KBPOOL_NONE;
    struct djobs_t *jobs = NULL;
    const kbnode_t *ref = NULL;
+   kbnode_t *pnode = node_at (pool, parent);
+   kbnode_t *node = NULL;
 
-   fprintf (stderr, "Instantiating [%s] as child of [%s]\n",
+   fprintf (KBDIAG, "Instantiating [%s] as child of [%s]\n",
          kbsymtab_get_string (src->symtab, KBNODE_KEY_ID),
-         parent ? kbnode_getvalue_first (parent, KBNODE_KEY_ID) : "NULL");
+         pnode ? kbnode_getvalue_first (pnode, KBNODE_KEY_ID) : "NULL");
+
+   // 1. Claim the slot for the new node. A root node gets a fresh slot, a child
+   // gets the next slot in the range its parent reserved.
+   size_t index = KBPOOL_NONE;
+   if (!pnode) {
+      index = kbpool_alloc (pool, 1);
+   } else {
+      index = pnode->children + pnode->njobs + pnode->nhandlers;
+      switch (childtype) {
+         case childtype_JOB:        pnode->njobs++;      break;
+         case childtype_HANDLER:    pnode->nhandlers++;  break;
+         case childtype_NONE:       index = KBPOOL_NONE; break;
+      }
+   }
+   if (!(node = node_at (pool, index))) {
+      KBIERROR ("Failed to allocate node in pool\n");
+      INCPTR (*errors);
+      goto cleanup;
+   }
 
-   // 1. Create a new node (fname and line don't matter here, it will be set
-   // below anyway during the cloning of the symbol table)
-   kbnode_t *ret = node_new ("", 0, node_type_name (src->type), parent, childtype);
+   node->type = src->type;
+   node->pool = pool;
+   node->index = index;
+   node->parent = parent;
+   node->children = KBPOOL_NONE;
+   node->env = NULL;
 
-   // 2. Copy the symbol table (easier to just recreate it)
-   kbsymtab_del (ret->symtab);
-   if (!(ret->symtab = kbsymtab_copy (src->symtab))) {
+   // 2. Copy the symbol table
+   if (!(node->symtab = kbsymtab_copy (src->symtab))) {
       KBIERROR ("OOM creating new symbol table\n");
       INCPTR (*errors);
       goto cleanup;
@@ -389,14 +417,25 @@ static kbnode_t *node_instantiate (const kbnode_t *src,
    // 3, Find all the references to jobs and handlers
    if (!(jobs = node_find_dependent_jobs (src, all, errors))) {
       // No JOBS[] to create jobs from, no signals to emit, so nothing to do.
-      error = false;
+      ret = index;
       goto cleanup;
    }
 
-   // 4. Recursively create all jobs
-   for (size_t i=0; jobs && jobs[i].id && jobs[i].childtype; i++) {
+   // 4. Reserve a consecutive range of slots for all the children, then
+   // recursively create all of them.
+   size_t njobs = 0;
+   while (jobs[njobs].id && jobs[njobs].childtype) {
+      njobs++;
+   }
+   if (njobs && (node->children = kbpool_alloc (pool, njobs)) == KBPOOL_NONE) {
+      KBIERROR ("OOM reserving %zu children\n", njobs);
+      INCPTR (*errors);
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<njobs; i++) {
 
-      if (!(ref = node_findbyid (all, jobs[i].id))) {
+      if (!(ref = kbindex_find (all, jobs[i].id))) {
          KBPARSE_ERROR (node_filename (src), node_line (src),
                "Failed to find reference to job [%s]\n", jobs[i].id);
          INCPTR (*errors);
@@ -405,21 +444,22 @@ static kbnode_t *node_instantiate (const kbnode_t *src,
 
       // If the job node is also an ancestor, then we give up - nodes
       // cannot reference each other recursively.
-      const kbnode_t *ancestor = node_findparent (parent, jobs[i].id);
+      const kbnode_t *ancestor = node_findparent (pnode, jobs[i].id);
       if (ancestor) {
          KBPARSE_ERROR (node_filename (src), node_line (src),
                "Reference-cycle found. Node [%s] recursively calls node [%s]\n",
                kbsymtab_get_string (src->symtab, KBNODE_KEY_ID),
                kbsymtab_get_string (ancestor->symtab, KBNODE_KEY_ID));
-         fprintf (stderr, "Node 1:\n");
-         kbnode_dump (parent, stderr, 0);
-         fprintf (stderr, "Node 2:\n");
-         kbnode_dump (ancestor, stderr, 0);
+         fprintf (KBDIAG, "Node 1:\n");
+         kbnode_dump (pnode, KBDIAG, 0);
+         fprintf (KBDIAG, "Node 2:\n");
+         kbnode_dump (ancestor, KBDIAG, 0);
          INCPTR(*errors);
          goto cleanup;
       }
 
-      if (!(node_instantiate (ref, ret, jobs[i].childtype, all, errors, warnings))) {
+      if ((node_instantiate (ref, pool, index, jobs[i].childtype, all,
+                             errors, warnings)) == KBPOOL_NONE) {
          KBPARSE_ERROR (node_filename (src), node_line (src),
                   "Failed to instantiate job %zu [%s]\n", i, jobs[i].id);
          INCPTR (*errors);
@@ -427,17 +467,12 @@ static kbnode_t *node_instantiate (const kbnode_t *src,
       }
    }
 
-   ret->flags |= KBNODE_FLAG_INSTANTIATED;
+   node->flags |= KBNODE_FLAG_INSTANTIATED;
 
-   error = false;
+   ret = index;
 
 cleanup:
    free (jobs);
-   if (error) {
-      node_del (ret);
-      ret = NULL;
-   }
-
    return ret;
 }
 
@@ -512,6 +547,11 @@ enum kbnode_type_t kbnode_type (const kbnode_t *node)
    return node ? node->type : kbnode_type_UNKNOWN;
 }
 
+enum kbnode_type_t kbnode_type_parse (const char *name)
+{
+   return name ? node_type_type (name) : kbnode_type_UNKNOWN;
+}
+
 void kbnode_dump (const kbnode_t *node, FILE *outf, size_t level)
 {
 #define INDENT(l)    for (size_t i=0; i<((l) * 3); i++) fputc (' ', outf)
@@ -523,36 +563,148 @@ void kbnode_dump (const kbnode_t *node, FILE *outf, size_t level)
    }
 
    INDENT (level);
+   const kbnode_t *parent = node_parent (node);
    fprintf (outf, "Node [%s] with parent [%s]: 0x%" PRIx64 "\n",
          node_type_name (node->type),
-         node->parent ? kbnode_getvalue_first (node->parent, KBNODE_KEY_ID) : "null",
+         parent ? kbnode_getvalue_first (parent, KBNODE_KEY_ID) : "null",
          node->flags);
 
    kbsymtab_dump (node->symtab, outf, level);
 
-   size_t nchildren = ds_array_length (node->jobs);
    INDENT (level + 1);
-   fprintf (outf, "njobs: %zu\n", nchildren);
-   for (size_t i=0; i<nchildren; i++) {
-      kbnode_dump ((kbnode_t *)(ds_array_get (node->jobs, i)), outf, level + 1);
+   fprintf (outf, "njobs: %zu\n", node->njobs);
+   for (size_t i=0; i<node->njobs; i++) {
+      kbnode_dump (kbnode_job (node, i), outf, level + 1);
    }
-   nchildren = ds_array_length (node->jobs);
    INDENT (level + 1);
-   fprintf (outf, "nhandlers: %zu\n", nchildren);
-   for (size_t i=0; i<nchildren; i++) {
-      kbnode_dump ((kbnode_t *)(ds_array_get (node->handlers, i)), outf, level + 1);
+   fprintf (outf, "nhandlers: %zu\n", node->nhandlers);
+   for (size_t i=0; i<node->nhandlers; i++) {
+      kbnode_dump (kbnode_handler (node, i), outf, level + 1);
    }
 #undef INDENT
 }
 
-const ds_array_t *kbnode_jobs (const kbnode_t *node)
+size_t kbnode_njobs (const kbnode_t *node)
+{
+   return node ? node->njobs : 0;
+}
+
+size_t kbnode_nhandlers (const kbnode_t *node)
+{
+   return node ? node->nhandlers : 0;
+}
+
+static kbnode_t *node_child (const kbnode_t *node, size_t index)
 {
-   return node ? node->jobs : NULL;
+   kbnode_t *ret = node_at (node->pool, node->children + index);
+   return ret && !(ret->flags & KBNODE_FLAG_DETACHED) ? ret : NULL;
 }
 
-const ds_array_t *kbnode_handlers (const kbnode_t *node)
+kbnode_t *kbnode_job (const kbnode_t *node, size_t index)
 {
-   return node ? node->handlers : NULL;
+   if (!node || index >= node->njobs) {
+      return NULL;
+   }
+   return node_child (node, index);
+}
+
+kbnode_t *kbnode_handler (const kbnode_t *node, size_t index)
+{
+   if (!node || index >= node->nhandlers) {
+      return NULL;
+   }
+   return node_child (node, node->njobs + index);
+}
+
+kbnode_t *kbnode_parent (const kbnode_t *node)
+{
+   return node_parent (node);
+}
+
+bool kbnode_setenv (kbnode_t *node, const char *name, const char *value)
+{
+   char *var = ds_str_cat (name, "=", value, NULL);
+   if (!var || !(kbutil_strarray_append (&node->env, var))) {
+      KBIERROR ("OOM setting [%s] in the environment of a node\n", name);
+      free (var);
+      return false;
+   }
+   return true;
+}
+
+// The index of the variable `name` (of `len` bytes) in `vars`, the last one
+// if it was set more than once, or -1 if it is not there.
+static ssize_t env_find (char *const *vars, const char *name, size_t len)
+{
+   ssize_t ret = -1;
+   for (size_t i=0; vars && vars[i]; i++) {
+      if ((strncmp (vars[i], name, len)) == 0 && vars[i][len] == '=') {
+         ret = (ssize_t)i;
+      }
+   }
+   return ret;
+}
+
+const char *kbnode_getenv (const kbnode_t *node, const char *name)
+{
+   size_t len = strlen (name);
+   for (; node; node = node_parent (node)) {
+      ssize_t index = env_find (node->env, name, len);
+      if (index >= 0) {
+         return &node->env[index][len + 1];
+      }
+   }
+   return getenv (name);
+}
+
+bool kbnode_environ (const kbnode_t *node, char ***envp)
+{
+   const char **vars = NULL;
+   size_t nvars = 0, cap = 0;
+   size_t depth = 0;
+
+   *envp = NULL;
+
+   for (const kbnode_t *n = node; n; n = node_parent (n)) {
+      if (n->env) {
+         cap += kbutil_strarray_length ((const char **)n->env);
+      }
+      depth++;
+   }
+   if (!cap) {
+      return true;
+   }
+   for (size_t i=0; environ && environ[i]; i++) {
+      cap++;
+   }
+   if (!(vars = calloc (cap + 1, sizeof *vars))) {
+      KBIERROR ("OOM creating environment of %zu variables\n", cap);
+      return false;
+   }
+   for (size_t i=0; environ && environ[i]; i++) {
+      vars[nvars++] = environ[i];
+   }
+
+   // The nearest setting of a variable wins, so ancestors go first
+   for (size_t skip=depth; skip; skip--) {
+      const kbnode_t *n = node;
+      for (size_t i=1; i<skip; i++) {
+         n = node_parent (n);
+      }
+      for (size_t i=0; n->env && n->env[i]; i++) {
+         size_t len = strcspn (n->env[i], "=");
+         ssize_t index = env_find ((char *const *)vars, n->env[i], len);
+         if (index >= 0) {
+            vars[index] = n->env[i];
+         } else {
+            vars[nvars++] = n->env[i];
+         }
+      }
+   }
+
+   *envp = kbutil_strarray_copy (vars);
+   free (vars);
+   return *envp != NULL;
 }
 
 const char **kbnode_keys (const kbnode_t *node)
@@ -562,7 +714,75 @@ const char **kbnode_keys (const kbnode_t *node)
 
 void kbnode_del (kbnode_t *node)
 {
-   node_del (node);
+   if (!node)
+      return;
+
+   if (!node->pool) {
+      node_del (node);
+      return;
+   }
+
+   if (node->owner) {
+      node_pool_release (node->pool, 0);
+      kbpool_del (node->pool);
+      return;
+   }
+
+   // Unlink the node by marking it; its parent no longer returns it as a
+   // child. The storage is reclaimed when the pool is deleted.
+   if (!(node->flags & KBNODE_FLAG_DETACHED)) {
+      node->flags |= KBNODE_FLAG_DETACHED;
+      node_subtree_release (node);
+   }
+}
+
+kbnode_region_t *kbnode_region_new (void)
+{
+   kbnode_region_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      return NULL;
+   }
+   if (!(ret->pool = kbpool_new (sizeof (kbnode_t)))) {
+      free (ret);
+      return NULL;
+   }
+   return ret;
+}
+
+void kbnode_region_del (kbnode_region_t *region)
+{
+   if (!region)
+      return;
+
+   node_pool_release (region->pool, 0);
+   kbpool_del (region->pool);
+   kbsymtab_image_del (region->image);
+   free (region);
+}
+
+size_t kbnode_region_compact (kbnode_region_t *region)
+{
+   if (!region)
+      return 0;
+
+   if (region->image) {
+      KBIERROR ("Region has already been compacted\n");
+      return 0;
+   }
+
+   size_t nnodes = kbpool_length (region->pool);
+   kbsymtab_t **tables = calloc (nnodes + 1, sizeof *tables);
+   if (!tables) {
+      KBIERROR ("OOM allocating %zu symbol tables for compaction\n", nnodes);
+      return 0;
+   }
+   for (size_t i=0; i<nnodes; i++) {
+      tables[i] = node_at (region->pool, i)->symtab;
+   }
+
+   region->image = kbsymtab_compact (tables, nnodes);
+   free (tables);
+   return kbsymtab_image_size (region->image);
 }
 
 bool kbnode_get_srcdef (const kbnode_t *node, const char **id, const char **fname,
@@ -608,18 +828,7 @@ const char **kbnode_getvalue_all (const kbnode_t *node, const char *key)
 bool kbnode_set_single (kbnode_t *node, const char *key, size_t index,
                         const char *newvalue)
 {
-   const char **values = kbsymtab_get (node->symtab, key);
-   if (!values || !values[0]) {
-      return false;
-   }
-   size_t nvalues = kbutil_strarray_length (values);
-   if (index > nvalues) {
-      return false;
-   }
-
-   free ((void *)values[index]);
-   values[index] = ds_str_dup (newvalue);
-   return values[index] ? true : false;
+   return kbsymtab_set_single (node->symtab, key, index, newvalue);
 }
 
 
@@ -711,7 +920,7 @@ bool kbnode_read_file (ds_array_t *dst, const char *fname,
          }
          *tmp = 0;
 
-         if (!(current = node_new (fname, lc, &line[1], NULL, childtype_NONE))) {
+         if (!(current = node_new (fname, lc, &line[1]))) {
             KBPARSE_ERROR (fname, lc,
                   "Node creation attempt failure near: '%s'\n", &line[1]);
             *nerrors = (*nerrors) + 1;
@@ -829,11 +1038,10 @@ cleanup:
 static bool node_filter_func_types (const void *element, void *param)
 {
    const kbnode_t *node = element;
-   const char **types = param;
+   const enum kbnode_type_t *types = param;
 
-   for (size_t i=0; types && types[i]; i++) {
-      enum kbnode_type_t type = node_type_type (types[i]);
-      if (node->type == type) {
+   for (size_t i=0; types && types[i] != kbnode_type_UNKNOWN; i++) {
+      if (node->type == types[i]) {
          return true;
       }
    }
@@ -1048,13 +1256,113 @@ void kbnode_check (kbnode_t *node, size_t *errors, size_t *warnings)
                "Exactly one of EXEC, EMITS or JOBS must be specified\n");
       INCPTR(*errors);
    }
+
+   const char **shells = kbsymtab_get (node->symtab, KBNODE_KEY_SHELL);
+   enum kbcmd_mode_t mode;
+   for (size_t i=0; shells && shells[i]; i++) {
+      if (!(kbcmd_mode (shells[i], &mode))) {
+         KBPARSE_ERROR (fname, line,
+                  "Node [%s] has invalid value for SHELL: [%s] (must be one "
+                  "of none, sh or bash)\n", id, shells[i]);
+         INCPTR (*errors);
+      }
+   }
+
+   const char **limits = kbsymtab_get (node->symtab, KBNODE_KEY_OUTPUT_LIMIT);
+   size_t limit;
+   for (size_t i=0; limits && limits[i]; i++) {
+      if (!(kbsink_parse_limit (limits[i], &limit))) {
+         KBPARSE_ERROR (fname, line,
+                  "Node [%s] has invalid value for OUTPUT_LIMIT: [%s] (must be "
+                  "a number of bytes, with an optional K, M or G suffix)\n",
+                  id, limits[i]);
+         INCPTR (*errors);
+      }
+   }
+
+   const char **scopes = kbsymtab_get (node->symtab, KBNODE_KEY_WORKSPACE);
+   enum kbwork_scope_t scope;
+   for (size_t i=0; scopes && scopes[i]; i++) {
+      if (!(kbwork_scope (scopes[i], &scope, NULL))) {
+         KBPARSE_ERROR (fname, line,
+                  "Node [%s] has invalid value for WORKSPACE: [%s] (must be one "
+                  "of node, run, persistent:<name>, clone:<name> or link:<name>)\n", id, scopes[i]);
+         INCPTR (*errors);
+      }
+   }
+
+   // Cached outputs and artifacts are written into the directory of the
+   // node, so must be in it
+   static const char *relative[] = {
+      KBNODE_KEY_CACHE_OUTPUTS,
+      KBNODE_KEY_ARTIFACTS_IN,
+      KBNODE_KEY_ARTIFACTS_OUT,
+   };
+   for (size_t i=0; i<sizeof relative / sizeof relative[0]; i++) {
+      const char **paths = kbsymtab_get (node->symtab, relative[i]);
+      for (size_t j=0; paths && paths[j]; j++) {
+         bool parent = false;
+         for (const char *p = paths[j]; p; p = strchr (p, '/')) {
+            p += (*p == '/');
+            if ((strncmp (p, "..", 2)) == 0 && (p[2] == 0 || p[2] == '/')) {
+               parent = true;
+            }
+         }
+         if (!paths[j][0] || paths[j][0] == '/' || parent) {
+            KBPARSE_ERROR (fname, line,
+                     "Node [%s] has invalid value for %s: [%s] (must be a "
+                     "relative path that does not contain ..)\n",
+                     id, relative[i], paths[j]);
+            INCPTR (*errors);
+         }
+      }
+   }
+
+   static const char *durations[] = {
+      KBNODE_KEY_TIMEOUT,
+      KBNODE_KEY_KILL_GRACE,
+   };
+   for (size_t i=0; i<sizeof durations / sizeof durations[0]; i++) {
+      const char **values = kbsymtab_get (node->symtab, durations[i]);
+      uint64_t seconds;
+      for (size_t j=0; values && values[j]; j++) {
+         if (!(kbperiod_seconds (values[j], &seconds))) {
+            KBPARSE_ERROR (fname, line,
+                     "Node [%s] has invalid value for %s: [%s] (must be a "
+                     "number with a unit, such as 30s or 5mins)\n",
+                     id, durations[i], values[j]);
+            INCPTR (*errors);
+         }
+      }
+   }
 }
 
 ds_array_t *kbnode_filter_types (const ds_array_t *nodes, const char *type, ...)
 {
    va_list ap;
    va_start (ap, type);
-   char **types = collect_args (type, ap);
+   char **names = collect_args (type, ap);
+   va_end (ap);
+   if (!names) {
+      return NULL;
+   }
+
+   // Resolve the type names once, rather than once per node.
+   size_t ntypes = kbutil_strarray_length ((const char **)names);
+   enum kbnode_type_t *types = calloc (ntypes + 1, sizeof *types);
+   if (!types) {
+      KBIERROR ("OOM error allocating array of %zu entries\n", ntypes + 1);
+      free (names);
+      return NULL;
+   }
+   size_t n = 0;
+   for (size_t i=0; i<ntypes; i++) {
+      if ((types[n] = node_type_type (names[i])) != kbnode_type_UNKNOWN) {
+         n++;
+      }
+   }
+   free (names);
+
    ds_array_t *ret = ds_array_filter (nodes, node_filter_func_types, types);
    free (types);
    return ret;
@@ -1075,8 +1383,14 @@ ds_array_t *kbnode_filter_handlers (const ds_array_t *nodes, const char **signal
    return ds_array_filter (nodes, node_filter_handlers, signals);
 }
 
+bool kbnode_handles (const kbnode_t *node, const char **signals)
+{
+   return node ? node_filter_handlers (node, signals) : false;
+}
+
 
-kbnode_t *kbnode_instantiate (const kbnode_t *src, ds_array_t *all,
+kbnode_t *kbnode_instantiate (const kbnode_t *src, const kbindex_t *all,
+                              kbnode_region_t *region,
                               size_t *errors, size_t *warnings)
 {
    if (!src) {
@@ -1085,14 +1399,27 @@ kbnode_t *kbnode_instantiate (const kbnode_t *src, ds_array_t *all,
       return NULL;
    }
 
-   kbnode_t *ret = node_instantiate (src, NULL, childtype_NONE,
-                                     all, errors, warnings);
-   if (!ret) {
+   kbpool_t *pool = region ? region->pool : kbpool_new (sizeof (kbnode_t));
+   if (!pool) {
+      INCPTR(*errors);
+      return NULL;
+   }
+
+   size_t first = kbpool_length (pool);
+   size_t root = node_instantiate (src, pool, KBPOOL_NONE, childtype_NONE,
+                                   all, errors, warnings);
+   if (root == KBPOOL_NONE) {
       KBPARSE_ERROR (node_filename (src), node_line (src),
             "Failed to instantiate node\n");
+      node_pool_release (pool, first);
+      if (!region) {
+         kbpool_del (pool);
+      }
       return NULL;
    }
 
+   kbnode_t *ret = node_at (pool, root);
+   ret->owner = !region;
    return ret;
 }
 
@@ -1103,6 +1430,6 @@ const char **kbnode_resolve (const kbnode_t *node, const char *symbol)
 
    const char **ret = kbsymtab_get (node->symtab, symbol);
 
-   return ret ? ret : kbnode_resolve (node->parent, symbol);
+   return ret ? ret : kbnode_resolve (node_parent (node), symbol);
 }
 
@@ -13,6 +13,9 @@
 #define H_KBNODE
 
 typedef struct kbnode_t kbnode_t;
+typedef struct kbnode_region_t kbnode_region_t;
+// See kbindex.h, which needs this header first.
+struct kbindex_t;
 
 enum kbnode_type_t {
    kbnode_type_UNKNOWN = 0,
@@ -39,8 +42,19 @@ enum kbnode_type_t {
 #define KBNODE_KEY_WDIR       "DIRECTORY"
 #define KBNODE_KEY_WUSER      "RUNAS_USER"
 #define KBNODE_KEY_WGROUP     "RUNAS_GROUP"
+#define KBNODE_KEY_SHELL      "SHELL"
+#define KBNODE_KEY_OUTPUT_LIMIT "OUTPUT_LIMIT"
+#define KBNODE_KEY_TIMEOUT    "TIMEOUT"
+#define KBNODE_KEY_KILL_GRACE "KILL_GRACE"
+#define KBNODE_KEY_WORKSPACE  "WORKSPACE"
+#define KBNODE_KEY_CACHE_INPUTS  "CACHE_INPUTS"
+#define KBNODE_KEY_CACHE_OUTPUTS "CACHE_OUTPUTS"
+#define KBNODE_KEY_ARTIFACTS_IN  "ARTIFACTS_IN"
+#define KBNODE_KEY_ARTIFACTS_OUT "ARTIFACTS_OUT"
+#define KBNODE_KEY_STDIN      "STDIN"
 
 #define KBNODE_FLAG_INSTANTIATED    (1 >> 0)
+#define KBNODE_FLAG_DETACHED        (1 << 1)
 
 #ifdef __cplusplus
 extern "C" {
@@ -56,6 +70,10 @@ extern "C" {
    // Get the node type.
    enum kbnode_type_t kbnode_type (const kbnode_t *node);
 
+   // Return the node type with the specified name (one of the KBNODE_TYPE_*
+   // strings), or kbnode_type_UNKNOWN if there is no such type.
+   enum kbnode_type_t kbnode_type_parse (const char *name);
+
    // Write the node out to the file descriptor provided (used during development)
    void kbnode_dump (const kbnode_t *node, FILE *outf, size_t level);
 
@@ -63,14 +81,51 @@ extern "C" {
    // array only, and not each element in the returned array.
    const char **kbnode_keys (const kbnode_t *node);
 
-   // Return all the jobs/handlers of a node.
-   const ds_array_t *kbnode_jobs (const kbnode_t *node);
-   const ds_array_t *kbnode_handlers (const kbnode_t *node);
+   // Return the number of jobs/handlers of a node, and the job/handler at the
+   // specified index (only instantiated nodes have jobs and handlers). NULL is
+   // returned if the index is out of range.
+   size_t kbnode_njobs (const kbnode_t *node);
+   size_t kbnode_nhandlers (const kbnode_t *node);
+   kbnode_t *kbnode_job (const kbnode_t *node, size_t index);
+   kbnode_t *kbnode_handler (const kbnode_t *node, size_t index);
+
+   // Return the parent of an instantiated node, or NULL for the root of the
+   // tree and for nodes that were not instantiated.
+   kbnode_t *kbnode_parent (const kbnode_t *node);
+
+   // The environment of the commands of a node is the environment of this
+   // process, with the variables set by kbnode_setenv() (the `setenv`
+   // builtin) on the node and on its ancestors on top, the nearest setting of
+   // each variable winning. The environment of this process is never changed.
+   bool kbnode_setenv (kbnode_t *node, const char *name, const char *value);
+   const char *kbnode_getenv (const kbnode_t *node, const char *name);
+
+   // Build the environment of the commands of `node` as a new array for
+   // execve(), to be freed with kbutil_strarray_del(). If neither the node nor
+   // its ancestors set any variable `*envp` is set to NULL: the commands get
+   // the environment of this process. Returns false on OOM.
+   bool kbnode_environ (const kbnode_t *node, char ***envp);
 
    // Delete a node and all its jobs and handlers (only instantiated nodes have
-   // jobs and handlers).
+   // jobs and handlers). Deleting the root of a tree that was instantiated
+   // without a region deletes the entire tree in a single pass. Deleting any
+   // other instantiated node unlinks it from its parent (it is flagged with
+   // KBNODE_FLAG_DETACHED and no longer returned as a job or handler) and
+   // releases its subtree; the nodes themselves are released with the region.
    void kbnode_del (kbnode_t *node);
 
+   // Create and delete a region in which many trees can be instantiated.
+   // Deleting the region deletes all the trees in it in one operation, so the
+   // trees in a region need not be deleted individually.
+   kbnode_region_t *kbnode_region_new (void);
+   void kbnode_region_del (kbnode_region_t *region);
+
+   // Pack the symbols of every tree in the region into a single read-mostly
+   // image, freeing the per-node hash tables. Returns the size of the image in
+   // bytes, or zero on error (the trees remain usable in either case). A region
+   // can only be compacted once.
+   size_t kbnode_region_compact (kbnode_region_t *region);
+
    // Get the source filename and line number where this node was declared. On error
    // the `fname` is set to a constant string, line number is set to zero and
    // `false` is returned.
@@ -116,13 +171,21 @@ extern "C" {
    // final parameter must be NULL.
    ds_array_t *kbnode_filter_handlers (const ds_array_t *nodes, const char **signals);
 
+   // Returns true if the node handles any of the specified signals. Note that
+   // the final element of `signals` must be NULL.
+   bool kbnode_handles (const kbnode_t *node, const char **signals);
+
    // Instantiate and return the specified node `src`. The returned node will be a
    // tree which contains all child nodes as specified in the value of the `JOBS[]`
    // symbol.
    //
-   // The `all` array is used to locate nodes referenced by `src`. The number of
-   // errors and warnings are populated in the respective parameters.
-   kbnode_t *kbnode_instantiate (const kbnode_t *src, ds_array_t *all,
+   // The index `all` (see kbindex.h) is used to locate nodes referenced by
+   // `src`, by ID and by handled signal. The tree is stored in `region`, or on
+   // its own if `region` is NULL, in which case the caller must delete the
+   // returned node. The number of errors and warnings are populated in the
+   // respective parameters.
+   kbnode_t *kbnode_instantiate (const kbnode_t *src, const struct kbindex_t *all,
+                                 kbnode_region_t *region,
                                  size_t *errors, size_t *warnings);
 
    // Return the first occurrence of `value` in the symbol table. If the value
@@ -6,6 +6,7 @@
 #include <ctype.h>
 #include <string.h>
 #include <inttypes.h>
+#include <errno.h>
 
 #include "kbutil.h"
 #include "kbperiod.h"
@@ -20,14 +21,14 @@ enum period_unit_t {
 
 static enum period_unit_t parse_unit (const char *src)
 {
-   if (src[1] == 0) {
-      return strchr ("smhd", src[0]) ? true : false;
-   }
-
    static const struct {
       const char *suffix;
       enum period_unit_t unit;
    } suffixes[] = {
+      { "s",         unit_SEC    },
+      { "m",         unit_MIN    },
+      { "h",         unit_HOUR   },
+      { "d",         unit_DAY    },
       { "sec",       unit_SEC    },
       { "secs",      unit_SEC    },
       { "second",    unit_SEC    },
@@ -98,6 +99,22 @@ kbperiod_t *kbperiod_parse (const char *src)
    return ret;
 }
 
+bool kbperiod_seconds (const char *src, uint64_t *seconds)
+{
+   char *unit = NULL;
+   if (!src || !isdigit (src[0])) {
+      return false;
+   }
+   errno = 0;
+   unsigned long long nunits = strtoull (src, &unit, 10);
+   enum period_unit_t factor = parse_unit (unit);
+   if (errno || factor == unit_UNKNOWN || nunits > UINT64_MAX / factor) {
+      return false;
+   }
+   *seconds = (uint64_t)nunits * factor;
+   return true;
+}
+
 void kbperiod_del (kbperiod_t *kbp)
 {
    if (kbp) {
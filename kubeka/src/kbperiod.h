@@ -11,6 +11,10 @@ extern "C" {
    kbperiod_t *kbperiod_parse (const char *src);
    void kbperiod_del (kbperiod_t *kbp);
 
+   // Parse a duration written as a PERIOD is (such as 30s or 5mins) into
+   // seconds.
+   bool kbperiod_seconds (const char *src, uint64_t *seconds);
+
    uint64_t kbperiod_remaining (kbperiod_t *kbp);
    void kbperiod_reset (kbperiod_t *kbp);
 
@@ -0,0 +1,105 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "kbutil.h"
+#include "kbpool.h"
+
+/* ************************************************************************
+ * Block `n` holds (KBPOOL_BLOCK0 << n) elements, so the first block is small
+ * (most trees are small) and large trees end up in a handful of large
+ * contiguous blocks. Because the block sizes are powers of two the mapping from
+ * index to block is a single bit-scan, and because the directory of blocks is
+ * a fixed array it never needs to be reallocated.
+ */
+#define KBPOOL_BLOCK0      (16)
+#define KBPOOL_NBLOCKS     (48)
+
+struct kbpool_t {
+   size_t elemsize;
+   size_t nelems;
+   size_t capacity;
+   size_t nblocks;
+   uint8_t *blocks[KBPOOL_NBLOCKS];
+};
+
+static size_t block_size (size_t block)
+{
+   return ((size_t)KBPOOL_BLOCK0) << block;
+}
+
+static size_t block_start (size_t block)
+{
+   return ((size_t)KBPOOL_BLOCK0) * ((((size_t)1) << block) - 1);
+}
+
+static size_t block_of (size_t index)
+{
+   size_t n = (index / KBPOOL_BLOCK0) + 1;
+   return (sizeof (unsigned long long) * 8) - 1 - __builtin_clzll (n);
+}
+
+kbpool_t *kbpool_new (size_t elemsize)
+{
+   kbpool_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      KBIERROR ("OOM allocating pool\n");
+      return NULL;
+   }
+   ret->elemsize = elemsize;
+   return ret;
+}
+
+void kbpool_del (kbpool_t *pool)
+{
+   if (!pool)
+      return;
+
+   for (size_t i=0; i<pool->nblocks; i++) {
+      free (pool->blocks[i]);
+   }
+   free (pool);
+}
+
+size_t kbpool_alloc (kbpool_t *pool, size_t nelems)
+{
+   if (!pool || !nelems) {
+      return KBPOOL_NONE;
+   }
+
+   while (pool->capacity - pool->nelems < nelems) {
+      if (pool->nblocks >= KBPOOL_NBLOCKS) {
+         KBIERROR ("Pool exhausted (%zu elements)\n", pool->nelems);
+         return KBPOOL_NONE;
+      }
+      size_t nbytes = block_size (pool->nblocks) * pool->elemsize;
+      if (!(pool->blocks[pool->nblocks] = calloc (1, nbytes))) {
+         KBIERROR ("OOM allocating pool block of %zu bytes\n", nbytes);
+         return KBPOOL_NONE;
+      }
+      pool->capacity += block_size (pool->nblocks);
+      pool->nblocks++;
+   }
+
+   size_t ret = pool->nelems;
+   pool->nelems += nelems;
+   return ret;
+}
+
+void *kbpool_get (const kbpool_t *pool, size_t index)
+{
+   if (!pool || index >= pool->nelems) {
+      return NULL;
+   }
+   size_t block = block_of (index);
+   return &pool->blocks[block][(index - block_start (block)) * pool->elemsize];
+}
+
+size_t kbpool_length (const kbpool_t *pool)
+{
+   return pool ? pool->nelems : 0;
+}
+
@@ -0,0 +1,38 @@
+
+#ifndef H_KBPOOL
+#define H_KBPOOL
+
+// A pool of fixed-size elements. Elements are handed out as runs of consecutive
+// indices and are addressed by index. The storage grows in blocks and an element
+// never moves once it has been allocated, so the pointer returned by
+// `kbpool_get()` remains valid until the pool is deleted.
+
+#define KBPOOL_NONE     ((size_t)-1)
+
+typedef struct kbpool_t kbpool_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   kbpool_t *kbpool_new (size_t elemsize);
+   void kbpool_del (kbpool_t *pool);
+
+   // Allocate `nelems` zeroed elements with consecutive indices. Returns the index
+   // of the first element, or KBPOOL_NONE on error.
+   size_t kbpool_alloc (kbpool_t *pool, size_t nelems);
+
+   // Return the element at `index`, or NULL if the index is out of range.
+   void *kbpool_get (const kbpool_t *pool, size_t index);
+
+   // Return the number of elements allocated from the pool.
+   size_t kbpool_length (const kbpool_t *pool);
+
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,369 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+
+#include <pthread.h>
+
+#include "kbutil.h"
+#include "kbcancel.h"
+#include "kbsink.h"
+#include "kbshell.h"
+
+extern char **environ;
+
+struct shell_t {
+   pid_t pid;        // -1 if the shell must be (re)started before use
+   int fd;
+   bool busy;
+};
+
+static struct shell_t *g_shells = NULL;
+static size_t g_nshells = 0;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_free = PTHREAD_COND_INITIALIZER;
+
+// Boundaries are "kubeka-<nonce>-<counter>". The nonce is random, so that the
+// output of a command cannot contain the boundary by accident.
+static char g_nonce[33];
+static uint64_t g_counter = 0;
+
+static bool shell_start (struct shell_t *sh)
+{
+   int sv[2] = { -1, -1 };
+   posix_spawn_file_actions_t actions;
+   posix_spawnattr_t attr;
+   sigset_t none, all;
+   char *argv[] = { (char *)"sh", NULL };
+   int rc = 0;
+
+   sh->pid = -1;
+   sh->fd = -1;
+
+   if ((socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) != 0) {
+      KBXERROR ("Failed to create shell socket: %m\n");
+      return false;
+   }
+
+   sigemptyset (&none);
+   sigfillset (&all);
+   posix_spawn_file_actions_init (&actions);
+   posix_spawnattr_init (&attr);
+
+   // The shell reads commands from, and writes results to, the same socket.
+   // It leads its own process group, so that a cancelled command can be
+   // killed along with the shell that runs it.
+   if ((rc = posix_spawn_file_actions_adddup2 (&actions, sv[1], STDIN_FILENO)) != 0
+         || (rc = posix_spawn_file_actions_adddup2 (&actions, sv[1], STDOUT_FILENO)) != 0
+         || (rc = posix_spawnattr_setsigmask (&attr, &none)) != 0
+         || (rc = posix_spawnattr_setsigdefault (&attr, &all)) != 0
+         || (rc = posix_spawnattr_setpgroup (&attr, 0)) != 0
+         || (rc = posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK
+                                                 | POSIX_SPAWN_SETSIGDEF
+                                                 | POSIX_SPAWN_SETPGROUP)) != 0
+         || (rc = posix_spawn (&sh->pid, "/bin/sh", &actions, &attr,
+                               argv, environ)) != 0) {
+      errno = rc;
+      KBXERROR ("Failed to start pooled shell: %m\n");
+      sh->pid = -1;
+   }
+
+   posix_spawnattr_destroy (&attr);
+   posix_spawn_file_actions_destroy (&actions);
+   close (sv[1]);
+
+   if (sh->pid < 0) {
+      close (sv[0]);
+      return false;
+   }
+   sh->fd = sv[0];
+   return true;
+}
+
+static void shell_stop (struct shell_t *sh)
+{
+   if (sh->pid < 0) {
+      return;
+   }
+   // The shell exits when it reads EOF
+   close (sh->fd);
+   while ((waitpid (sh->pid, NULL, 0)) < 0 && errno == EINTR)
+      ;
+   sh->pid = -1;
+   sh->fd = -1;
+}
+
+static bool send_all (int fd, const char *buf, size_t len)
+{
+   while (len) {
+      ssize_t nbytes = send (fd, buf, len, MSG_NOSIGNAL);
+      if (nbytes < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return false;
+      }
+      buf += nbytes;
+      len -= (size_t)nbytes;
+   }
+   return true;
+}
+
+// Appends `src` to `dst` in single quotes, so that the shell takes it as is.
+static char *quote (char *dst, const char *src)
+{
+   *dst++ = '\'';
+   for (; *src; src++) {
+      if (*src == '\'') {
+         memcpy (dst, "'\\''", 4);
+         dst += 4;
+      } else {
+         *dst++ = *src;
+      }
+   }
+   *dst++ = '\'';
+   *dst = 0;
+   return dst;
+}
+
+static char *frame (const char *command, const char *wdir, const char *boundary)
+{
+   static const char *fmt[] = {
+      "( cd -- ", " && eval ", " ) </dev/null; printf '\\n%s %d\\n' ", " $?\n",
+   };
+
+   // Quoting at most quadruples the length of a string
+   size_t len = 4 * (strlen (command) + strlen (wdir) + strlen (boundary)) + 6;
+   for (size_t i=0; i<sizeof fmt / sizeof fmt[0]; i++) {
+      len += strlen (fmt[i]);
+   }
+
+   char *ret = malloc (len + 1);
+   if (!ret) {
+      return NULL;
+   }
+   char *cursor = stpcpy (ret, fmt[0]);
+   cursor = quote (cursor, wdir);
+   cursor = stpcpy (cursor, fmt[1]);
+   cursor = quote (cursor, command);
+   cursor = stpcpy (cursor, fmt[2]);
+   cursor = quote (cursor, boundary);
+   stpcpy (cursor, fmt[3]);
+   return ret;
+}
+
+// Checks whether `src`, which starts with a newline, is the trailer. Returns
+// 1 if it is (with the exit code in `code`), 0 if it may be once more data
+// arrives, and -1 if it is not.
+static int trailer_match (const char *src, size_t len, const char *boundary,
+                          size_t blen, int *code)
+{
+   size_t n = len - 1 < blen ? len - 1 : blen;
+   if ((memcmp (src + 1, boundary, n)) != 0) {
+      return -1;
+   }
+   if (n < blen || len == blen + 1) {
+      return 0;
+   }
+   if (src[blen + 1] != ' ') {
+      return -1;
+   }
+
+   // An exit code has at most three digits
+   *code = 0;
+   for (size_t i=blen + 2; i<len && i<blen + 6; i++) {
+      if (src[i] == '\n' && i > blen + 2) {
+         return 1;
+      }
+      if (src[i] < '0' || src[i] > '9') {
+         return -1;
+      }
+      *code = *code * 10 + (src[i] - '0');
+   }
+   return len < blen + 6 ? 0 : -1;
+}
+
+// Writes the output of the command to `sink` up to the trailer. Only a
+// possible start of the trailer is held back. Returns the exit code of the
+// command, or -1 if the shell went away before writing the trailer.
+static int read_result (int fd, const char *boundary, kbsink_t *sink)
+{
+   char buf[16 * 1024];
+   size_t blen = strlen (boundary);
+   size_t len = 0;
+
+   while (true) {
+      ssize_t nbytes = recv (fd, &buf[len], sizeof buf - len, 0);
+      if (nbytes < 0 && errno == EINTR) {
+         continue;
+      }
+      if (nbytes <= 0) {
+         kbsink_write (sink, buf, len);
+         return -1;
+      }
+      len += (size_t)nbytes;
+
+      size_t keep = len;
+      for (char *nl = memchr (buf, '\n', len); nl;
+            nl = memchr (nl + 1, '\n', len - (size_t)(nl + 1 - buf))) {
+         int code = 0;
+         int match = trailer_match (nl, len - (size_t)(nl - buf), boundary,
+                                    blen, &code);
+         if (match == 1) {
+            kbsink_write (sink, buf, (size_t)(nl - buf));
+            return code;
+         }
+         if (match == 0) {
+            keep = (size_t)(nl - buf);
+            break;
+         }
+         if (nl + 1 == buf + len) {
+            break;
+         }
+      }
+
+      if (!(kbsink_write (sink, buf, keep))) {
+         KBXERROR ("Failed to write output: %m\n");
+      }
+      memmove (buf, &buf[keep], len - keep);
+      len -= keep;
+   }
+}
+
+bool kbshell_pool_start (size_t nshells)
+{
+   uint8_t random[16];
+   bool error = true;
+
+   if (g_shells) {
+      return true;
+   }
+
+   FILE *inf = fopen ("/dev/urandom", "r");
+   if (!inf || (fread (random, 1, sizeof random, inf)) != sizeof random) {
+      KBXERROR ("Failed to read a random boundary for the shell pool: %m\n");
+      goto cleanup;
+   }
+   for (size_t i=0; i<sizeof random; i++) {
+      snprintf (&g_nonce[i * 2], 3, "%02x", random[i]);
+   }
+
+   if (!(g_shells = calloc (nshells + 1, sizeof *g_shells))) {
+      KBIERROR ("OOM allocating pool of %zu shells\n", nshells);
+      goto cleanup;
+   }
+   g_nshells = nshells;
+   for (size_t i=0; i<nshells; i++) {
+      g_shells[i].pid = -1;
+      g_shells[i].fd = -1;
+   }
+
+   // All the shells start now, in the environment of this process.
+   for (size_t i=0; i<nshells; i++) {
+      if (!(shell_start (&g_shells[i]))) {
+         goto cleanup;
+      }
+   }
+
+   error = false;
+cleanup:
+   if (inf) {
+      fclose (inf);
+   }
+   if (error) {
+      kbshell_pool_stop ();
+   }
+   return !error;
+}
+
+void kbshell_pool_stop (void)
+{
+   for (size_t i=0; i<g_nshells; i++) {
+      shell_stop (&g_shells[i]);
+   }
+   free (g_shells);
+   g_shells = NULL;
+   g_nshells = 0;
+}
+
+bool kbshell_pool_running (void)
+{
+   return g_shells != NULL;
+}
+
+int kbshell_command (const char *command, const char *wdir,
+                     kbcancel_t *cancel, kbsink_t *sink)
+{
+   struct shell_t *sh = NULL;
+   char boundary[64];
+   char *request = NULL;
+   int ret = -1;
+
+   if (!g_shells) {
+      return -1;
+   }
+
+   pthread_mutex_lock (&g_lock);
+   while (!sh) {
+      for (size_t i=0; i<g_nshells && !sh; i++) {
+         if (!g_shells[i].busy) {
+            sh = &g_shells[i];
+         }
+      }
+      if (!sh) {
+         pthread_cond_wait (&g_free, &g_lock);
+      }
+   }
+   sh->busy = true;
+   snprintf (boundary, sizeof boundary, "kubeka-%s-%" PRIu64, g_nonce, g_counter++);
+   pthread_mutex_unlock (&g_lock);
+
+   // A shell that died is only replaced when it is next needed
+   if (sh->pid < 0 && !(shell_start (sh))) {
+      goto cleanup;
+   }
+
+   if (!(request = frame (command, wdir, boundary))) {
+      KBIERROR ("OOM creating request for [%s]\n", command);
+      goto cleanup;
+   }
+
+   if (!(send_all (sh->fd, request, strlen (request)))) {
+      KBXERROR ("Failed to send [%s] to pooled shell %i: %m\n", command, (int)sh->pid);
+      shell_stop (sh);
+      goto cleanup;
+   }
+
+   kbcancel_enter (cancel, sh->pid);
+   int code = read_result (sh->fd, boundary, sink);
+   kbcancel_leave (cancel, sh->pid);
+   if (code < 0) {
+      // The command may have run, so it must not be run again
+      KBXERROR ("Pooled shell %i went away while running [%s]\n",
+                (int)sh->pid, command);
+      shell_stop (sh);
+      code = EXIT_FAILURE;
+   }
+   ret = (code & 0xff) << 8;
+
+cleanup:
+   free (request);
+   pthread_mutex_lock (&g_lock);
+   sh->busy = false;
+   pthread_cond_signal (&g_free);
+   pthread_mutex_unlock (&g_lock);
+   return ret;
+}
+
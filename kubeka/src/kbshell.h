@@ -0,0 +1,42 @@
+
+#ifndef H_KBSHELL
+#define H_KBSHELL
+
+// A pool of long-lived shells for running short commands, so that a command
+// does not pay for starting a new shell. Each shell reads commands from a
+// socket on its stdin, and writes their output followed by a trailer to the
+// same socket on its stdout:
+//
+//    <output>\n<boundary> <exit code>\n
+//
+// where <boundary> is unique to the command. Every command runs in a subshell,
+// in its working directory and with stdin from /dev/null, so that it cannot
+// change the state of the shell or read the commands that follow it.
+//
+// The shells run as the daemon user, with the environment that the daemon had
+// when the pool was started.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   bool kbshell_pool_start (size_t nshells);
+   void kbshell_pool_stop (void);
+   bool kbshell_pool_running (void);
+
+   // Run `command` in `wdir` in one of the shells of the pool, waiting for a
+   // free shell if necessary, and write its output to `sink` as
+   // kbexec_command() does. The shell is registered with `cancel` while it
+   // runs the command, and is replaced if it is killed. Returns a wait status
+   // built from the exit code, or -1 if the command could not be given to any
+   // shell (in which case it was not run).
+   int kbshell_command (const char *command, const char *wdir,
+                        kbcancel_t *cancel, kbsink_t *sink);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,327 @@
+
+// For splice()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "ds_str.h"
+
+#include "kbutil.h"
+#include "kbsink.h"
+
+struct kbsink_t {
+   size_t limit;
+   size_t total;
+
+   // Without a log file the tail is collected in `buf`, which holds up to
+   // twice the limit so that it is only compacted once every `limit` bytes.
+   // With a log file the tail is read back from the file when it is needed.
+   char *buf;
+   size_t buflen;
+   size_t bufcap;
+
+   char *logfile;
+   int logfd;
+   bool nosplice;
+};
+
+static char *g_logdir = NULL;
+static uint64_t g_seq = 0;
+
+bool kbsink_set_logdir (const char *dir)
+{
+   struct stat sb;
+
+   free (g_logdir);
+   g_logdir = NULL;
+   if (!dir) {
+      return true;
+   }
+
+   if ((stat (dir, &sb)) != 0 || !S_ISDIR (sb.st_mode)) {
+      KBXERROR ("Log directory [%s] is not a directory: %m\n", dir);
+      return false;
+   }
+   if (!(g_logdir = ds_str_dup (dir))) {
+      KBIERROR ("OOM copying log directory [%s]\n", dir);
+      return false;
+   }
+   return true;
+}
+
+bool kbsink_parse_limit (const char *src, size_t *limit)
+{
+   static const struct {
+      char suffix;
+      size_t factor;
+   } suffixes[] = {
+      { 0,     1 },
+      { 'K',   1024 },
+      { 'M',   1024 * 1024 },
+      { 'G',   1024 * 1024 * 1024 },
+   };
+
+   char *end = NULL;
+   if (!src || src[0] < '0' || src[0] > '9') {
+      return false;
+   }
+   errno = 0;
+   unsigned long long value = strtoull (src, &end, 10);
+   if (errno) {
+      return false;
+   }
+
+   for (size_t i=0; i<sizeof suffixes / sizeof suffixes[0]; i++) {
+      if (end[0] != suffixes[i].suffix || (end[0] && end[1])) {
+         continue;
+      }
+      if (value > SIZE_MAX / suffixes[i].factor) {
+         return false;
+      }
+      *limit = (size_t)value * suffixes[i].factor;
+      return true;
+   }
+   return false;
+}
+
+static char *logfile_name (const char *id)
+{
+   char suffix[64];
+   snprintf (suffix, sizeof suffix, "-%lld-%i-%llu.log", (long long)time (NULL),
+             (int)getpid (), (unsigned long long)__sync_fetch_and_add (&g_seq, 1));
+
+   char *ret = ds_str_cat (g_logdir, "/", id, suffix, NULL);
+   if (!ret) {
+      return NULL;
+   }
+   // The node ID must not take the file out of the log directory.
+   for (char *tmp = &ret[strlen (g_logdir) + 1]; *tmp; tmp++) {
+      if (*tmp == '/') {
+         *tmp = '_';
+      }
+   }
+   return ret;
+}
+
+kbsink_t *kbsink_new (const char *id, size_t limit)
+{
+   kbsink_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      KBIERROR ("OOM allocating output sink for [%s]\n", id);
+      return NULL;
+   }
+   ret->limit = limit;
+   ret->logfd = -1;
+
+   if (g_logdir) {
+      // Not O_APPEND, as splice() refuses to write to such a file.
+      if (!(ret->logfile = logfile_name (id))
+            || (ret->logfd = open (ret->logfile,
+                                   O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                                   0640)) < 0) {
+         KBXERROR ("Failed to create log file [%s] for [%s]: %m\n",
+                   ret->logfile ? ret->logfile : "", id);
+         kbsink_del (ret);
+         return NULL;
+      }
+   }
+
+   return ret;
+}
+
+void kbsink_del (kbsink_t *sink)
+{
+   if (!sink) {
+      return;
+   }
+   if (sink->logfd >= 0) {
+      close (sink->logfd);
+   }
+   free (sink->logfile);
+   free (sink->buf);
+   free (sink);
+}
+
+static bool tail_reserve (kbsink_t *sink, size_t len)
+{
+   if (len < sink->bufcap) {
+      return true;
+   }
+   size_t newcap = sink->bufcap ? sink->bufcap * 2 : 4096;
+   while (newcap <= len) {
+      newcap *= 2;
+   }
+   char *tmp = realloc (sink->buf, newcap);
+   if (!tmp) {
+      KBIERROR ("OOM growing output tail to %zu bytes\n", newcap);
+      return false;
+   }
+   sink->buf = tmp;
+   sink->bufcap = newcap;
+   return true;
+}
+
+static bool tail_append (kbsink_t *sink, const char *buf, size_t len)
+{
+   size_t limit = sink->limit;
+
+   if (len > limit) {
+      buf += len - limit;
+      len = limit;
+      sink->buflen = 0;
+   }
+   // Keep only the last `limit` bytes once the buffer holds twice as many.
+   if (limit <= SIZE_MAX / 2 && sink->buflen + len > limit * 2) {
+      size_t keep = limit - len;
+      memmove (sink->buf, &sink->buf[sink->buflen - keep], keep);
+      sink->buflen = keep;
+   }
+   if (!(tail_reserve (sink, sink->buflen + len))) {
+      return false;
+   }
+   memcpy (&sink->buf[sink->buflen], buf, len);
+   sink->buflen += len;
+   sink->buf[sink->buflen] = 0;
+   return true;
+}
+
+bool kbsink_write (kbsink_t *sink, const void *buf, size_t len)
+{
+   sink->total += len;
+   if (sink->logfd < 0) {
+      return tail_append (sink, buf, len);
+   }
+
+   const char *src = buf;
+   while (len) {
+      ssize_t nbytes = write (sink->logfd, src, len);
+      if (nbytes < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return false;
+      }
+      src += nbytes;
+      len -= (size_t)nbytes;
+   }
+   return true;
+}
+
+int kbsink_splicefd (const kbsink_t *sink)
+{
+   return sink->nosplice ? -1 : sink->logfd;
+}
+
+void kbsink_spliced (kbsink_t *sink, size_t len)
+{
+   sink->total += len;
+}
+
+void kbsink_nosplice (kbsink_t *sink)
+{
+   sink->nosplice = true;
+}
+
+ssize_t kbsink_pump (kbsink_t *sink, int fd)
+{
+   ssize_t nbytes;
+
+   // Straight from the pipe to the log file. This fails with EINVAL if `fd`
+   // is not a pipe, or the file system of the log does not support it, in
+   // which case the output is copied instead.
+   if (sink->logfd >= 0 && !sink->nosplice) {
+      nbytes = splice (fd, NULL, sink->logfd, NULL, 1024 * 1024,
+                       SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+      if (nbytes >= 0) {
+         sink->total += (size_t)nbytes;
+         return nbytes;
+      }
+      if (errno != EINVAL && errno != ENOSYS) {
+         return -1;
+      }
+      sink->nosplice = true;
+   }
+
+   char buf[16 * 1024];
+   if ((nbytes = read (fd, buf, sizeof buf)) > 0
+         && !(kbsink_write (sink, buf, (size_t)nbytes))) {
+      return -1;
+   }
+   return nbytes;
+}
+
+bool kbsink_drain (kbsink_t *sink, int fd)
+{
+   ssize_t nbytes;
+   while ((nbytes = kbsink_pump (sink, fd)) != 0) {
+      if (nbytes > 0 || errno == EINTR) {
+         continue;
+      }
+      if (errno != EAGAIN) {
+         return false;
+      }
+      // The splice() does not block, so wait for the pipe here.
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      poll (&pfd, 1, -1);
+   }
+   return true;
+}
+
+size_t kbsink_total (const kbsink_t *sink)
+{
+   return sink->total;
+}
+
+const char *kbsink_logfile (const kbsink_t *sink)
+{
+   return sink->logfile;
+}
+
+const char *kbsink_tail (kbsink_t *sink, size_t *len)
+{
+   size_t taillen = sink->total < sink->limit ? sink->total : sink->limit;
+
+   if (sink->logfd >= 0) {
+      // Read the tail back from the end of the log.
+      if (!(tail_reserve (sink, taillen))) {
+         taillen = 0;
+      }
+      size_t index = 0;
+      while (index < taillen) {
+         ssize_t nbytes = pread (sink->logfd, &sink->buf[index], taillen - index,
+                                 (off_t)(sink->total - taillen + index));
+         if (nbytes < 0 && errno == EINTR) {
+            continue;
+         }
+         if (nbytes <= 0) {
+            break;
+         }
+         index += (size_t)nbytes;
+      }
+      sink->buflen = index;
+      if (sink->buf) {
+         sink->buf[index] = 0;
+      }
+      taillen = index;
+   }
+
+   if (!sink->buf) {
+      *len = 0;
+      return "";
+   }
+   *len = taillen < sink->buflen ? taillen : sink->buflen;
+   return &sink->buf[sink->buflen - *len];
+}
+
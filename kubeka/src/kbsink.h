@@ -0,0 +1,63 @@
+
+#ifndef H_KBSINK
+#define H_KBSINK
+
+// The destination of the output of a command. When a log directory is set,
+// each sink writes to its own log file in that directory, and the output is
+// moved from the pipe of the command to the file with splice(), so that it
+// never passes through the daemon. Only the last `limit` bytes of the output
+// (the tail, used in messages) are ever held in memory.
+
+// The tail that is kept for nodes that do not set OUTPUT_LIMIT.
+#define KBSINK_DEFAULT_LIMIT     (1024 * 1024)
+
+typedef struct kbsink_t kbsink_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Set the directory in which log files are created, or stop creating them
+   // if `dir` is NULL. This must be done before any sink is created.
+   bool kbsink_set_logdir (const char *dir);
+
+   // Parse an OUTPUT_LIMIT value: a number of bytes with an optional K, M or
+   // G suffix.
+   bool kbsink_parse_limit (const char *src, size_t *limit);
+
+   // Create a sink for a run of the node `id`, keeping a tail of `limit`
+   // bytes. A limit of (size_t)-1 keeps everything.
+   kbsink_t *kbsink_new (const char *id, size_t limit);
+   void kbsink_del (kbsink_t *sink);
+
+   // Move everything from `fd` to the sink, until EOF.
+   bool kbsink_drain (kbsink_t *sink, int fd);
+
+   // Move what can be read from `fd` without blocking to the sink. Returns
+   // the number of bytes moved, 0 at EOF, or -1 with errno set (EAGAIN if
+   // nothing was available yet).
+   ssize_t kbsink_pump (kbsink_t *sink, int fd);
+   bool kbsink_write (kbsink_t *sink, const void *buf, size_t len);
+
+   // For callers that splice the output themselves: the log file to splice
+   // to (-1 if the output must be given to kbsink_write() instead), the
+   // accounting of `len` bytes spliced to it, and giving up on splicing when
+   // the log file does not support it.
+   int kbsink_splicefd (const kbsink_t *sink);
+   void kbsink_spliced (kbsink_t *sink, size_t len);
+   void kbsink_nosplice (kbsink_t *sink);
+
+   // The total number of bytes written to the sink, the path of its log file
+   // (NULL if there is none), and its tail as a nul-terminated string owned
+   // by the sink.
+   size_t kbsink_total (const kbsink_t *sink);
+   const char *kbsink_logfile (const kbsink_t *sink);
+   const char *kbsink_tail (kbsink_t *sink, size_t *len);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -5,6 +5,7 @@
 #include <ctype.h>
 #include <limits.h>
 #include <inttypes.h>
+#include <stdint.h>
 
 #include "ds_str.h"
 #include "ds_hmap.h"
@@ -101,10 +102,123 @@ static char **parse_value (const char *value)
 /* ***********************************************************
  * Symbol table datastructure
  */
+
+// A symbol image holds the compacted contents of many symbol tables: every
+// key and value string is copied into a single blob (strings that occur in
+// several tables are copied each time), and the tables are arrays of offsets
+// into the blob. The values of a key are a NULL-terminated
+// run of pointers into the blob, so that lookups can return them directly.
+struct image_entry_t {
+   uint32_t key;        // Offset of the key in the blob
+   uint32_t values;     // Index of the first value in `values`
+};
+
+struct kbsymtab_image_t {
+   char *blob;
+   size_t blob_len;
+   struct image_entry_t *entries;   // In the original order of each table
+   uint32_t *sorted;                // Per table, entries sorted by key
+   size_t nentries;
+   const char **values;
+   size_t nvalues;
+};
+
 struct kbsymtab_t {
    ds_hmap_t *table; // { char *: char ** }
+
+   // A compacted table has no hash table. Its symbols are a run of `nentries`
+   // entries in an image, and `sorted` holds the indices of those entries in
+   // key order for lookups.
+   const kbsymtab_image_t *image;
+   const struct image_entry_t *entries;
+   const uint32_t *sorted;
+   size_t nentries;
 };
 
+static const char **image_get (const kbsymtab_t *st, const char *key)
+{
+   size_t lo = 0, hi = st->nentries;
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      const struct image_entry_t *entry = &st->entries[st->sorted[mid]];
+      int rc = strcmp (&st->image->blob[entry->key], key);
+      if (rc == 0) {
+         return &st->image->values[entry->values];
+      }
+      if (rc < 0) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return NULL;
+}
+
+static const char **image_keys (const kbsymtab_t *st)
+{
+   if (!st->nentries) {
+      return NULL;
+   }
+   const char **ret = calloc (st->nentries + 1, sizeof *ret);
+   if (!ret) {
+      return NULL;
+   }
+   for (size_t i=0; i<st->nentries; i++) {
+      ret[i] = &st->image->blob[st->entries[i].key];
+   }
+   return ret;
+}
+
+static void table_del (ds_hmap_t *table)
+{
+   char **keys = NULL;
+   size_t nkeys = 0;
+   nkeys = ds_hmap_keys (table, (void ***)&keys, NULL);
+
+   for (size_t i=0; i<nkeys && keys && keys[i]; i++) {
+      char **values = NULL;
+      if (!(ds_hmap_get_str_ptr (table, keys[i], (void **)&values, NULL))) {
+         KBWARN ("Failed to get known good key [%s]\n", keys[i]);
+      }
+      kbutil_strarray_del (values);
+   }
+   free (keys);
+   ds_hmap_del (table);
+}
+
+// Compacted tables are read-only; before the first write the symbols are
+// copied out of the image into a new hash table.
+static bool symtab_thaw (kbsymtab_t *st)
+{
+   if (st->table) {
+      return true;
+   }
+
+   ds_hmap_t *table = ds_hmap_new (512);
+   if (!table) {
+      KBIERROR ("OOM thawing symbol table\n");
+      return false;
+   }
+
+   for (size_t i=0; i<st->nentries; i++) {
+      const char *key = &st->image->blob[st->entries[i].key];
+      char **values = kbutil_strarray_copy (&st->image->values[st->entries[i].values]);
+      if (!values || !(ds_hmap_set_str_ptr (table, key, values, 0))) {
+         KBIERROR ("OOM thawing symbol [%s]\n", key);
+         kbutil_strarray_del (values);
+         table_del (table);
+         return false;
+      }
+   }
+
+   st->table = table;
+   st->image = NULL;
+   st->entries = NULL;
+   st->sorted = NULL;
+   st->nentries = 0;
+   return true;
+}
+
 void kbsymtab_dump (const kbsymtab_t *s, FILE *outf, size_t level)
 {
 #define INDENT    for (size_t i=0; i<(level * 3); i++) fputc (' ', outf)
@@ -117,18 +231,17 @@ void kbsymtab_dump (const kbsymtab_t *s, FILE *outf, size_t level)
       return;
    }
 
-   char **keys = NULL;
-   size_t nkeys = ds_hmap_keys (s->table, (void ***)&keys, NULL);
-   if (nkeys == (size_t)-1) {
-      KBWARN ("Failed to retrieve elements of symbol table\n");
+   const char **keys = kbsymtab_keys (s);
+   if (!keys) {
+      // Empty table
       return;
    }
 
    char *tmp = NULL;
 
-   for (size_t i=0; i<nkeys && keys && keys[i]; i++) {
-      const char **value = NULL;
-      if (!(ds_hmap_get_str_ptr (s->table, keys[i], (void **)&value, NULL))) {
+   for (size_t i=0; keys[i]; i++) {
+      const char **value = kbsymtab_get (s, keys[i]);
+      if (!value) {
          KBWARN ("Failed to retrieve value for key [%s]\n", keys[i]);
       }
       free (tmp);
@@ -162,19 +275,12 @@ kbsymtab_t *kbsymtab_new (void)
 
 void kbsymtab_del (kbsymtab_t *st)
 {
-   char **keys = NULL;
-   size_t nkeys = 0;
-   nkeys = ds_hmap_keys (st->table, (void ***)&keys, NULL);
+   if (!st)
+      return;
 
-   for (size_t i=0; i<nkeys && keys && keys[i]; i++) {
-      char **values = NULL;
-      if (!(ds_hmap_get_str_ptr (st->table, keys[i], (void **)&values, NULL))) {
-         KBWARN ("Failed to get known good key [%s]\n", keys[i]);
-      }
-      kbutil_strarray_del (values);
+   if (st->table) {
+      table_del (st->table);
    }
-   free (keys);
-   ds_hmap_del (st->table);
    free (st);
 }
 
@@ -182,21 +288,21 @@ kbsymtab_t *kbsymtab_copy (kbsymtab_t *st)
 {
    bool error = true;
    kbsymtab_t *ret = NULL;
-   char **keys = NULL;
+   const char **keys = NULL;
 
    if (!(ret = kbsymtab_new ())) {
       KBIERROR ("OOM attempting to create new symbol table\n");
       goto cleanup;
    }
 
-   if (!(ds_hmap_keys (st->table, (void ***)&keys, NULL))) {
+   if (!(keys = kbsymtab_keys (st))) {
       KBIERROR ("OOM allocating keys\n");
       goto cleanup;
    }
 
    for (size_t i=0; keys && keys[i]; i++) {
       const char **srcvals = NULL;
-      if (!(ds_hmap_get_str_ptr (st->table, keys[i], (void **)&srcvals, NULL))) {
+      if (!(srcvals = kbsymtab_get (st, keys[i]))) {
          KBIERROR ("OOM getting source values\n");
          goto cleanup;
       }
@@ -228,6 +334,10 @@ const char **kbsymtab_get (const kbsymtab_t *st, const char *key)
    if (!st)
       return NULL;
 
+   if (!st->table) {
+      return image_get (st, key);
+   }
+
    const char **ret = NULL;
    if (!(ds_hmap_get_str_ptr (st->table, key, (void **)&ret, NULL))) {
       // KBWARN ("Failed to find symbol [%s]\n", key);
@@ -238,6 +348,10 @@ const char **kbsymtab_get (const kbsymtab_t *st, const char *key)
 
 const char **kbsymtab_keys (const kbsymtab_t *st)
 {
+   if (!st->table) {
+      return image_keys (st);
+   }
+
    const char **keys = NULL;
    if (!(ds_hmap_keys (st->table, (void ***)&keys, NULL))) {
       free (keys);
@@ -340,6 +454,10 @@ bool kbsymtab_set (const char *fname, size_t lc, bool force,
    size_t index = (size_t)-1;
    char *keycopy = NULL;
 
+   if (!(symtab_thaw (st))) {
+      return false;
+   }
+
    // Normalise the key (remove the `[]`)
    if (!(keycopy = ds_str_dup (key))) {
       KBPARSE_ERROR (fname, lc, "OOM Error copying key\n");
@@ -434,6 +552,10 @@ bool kbsymtab_append (const char *fname, size_t lc, bool force,
    bool error = true;
    char **existing = NULL;
 
+   if (!(symtab_thaw (st))) {
+      return false;
+   }
+
    size_t index = 0;
    enum keytype_t keytype = detect_keytype (key, &index);
    char *keycopy = ds_str_dup (key);
@@ -511,20 +633,30 @@ bool kbsymtab_exists (kbsymtab_t *st, const char *key)
    if (!st || !key)
       return false;
 
-   const char **keys = NULL;
-   if (!(ds_hmap_keys (st->table, (void ***)&keys, NULL))) {
-      KBIERROR ("Failed to retrieve keys to search for '%s'\n", key);
+   return kbsymtab_get (st, key) != NULL;
+}
+
+bool kbsymtab_set_single (kbsymtab_t *st, const char *key, size_t index,
+                          const char *value)
+{
+   if (!st || !key || !(symtab_thaw (st)))
+      return false;
+
+   char **values = NULL;
+   if (!(ds_hmap_get_str_ptr (st->table, key, (void **)&values, NULL)) || !values) {
+      return false;
+   }
+   if (index >= kbutil_strarray_length ((const char **)values)) {
       return false;
    }
 
-   for (size_t i=0; keys && keys[i]; i++) {
-      if ((strcmp (keys[i], key)) == 0) {
-         free (keys);
-         return true;
-      }
+   char *tmp = ds_str_dup (value);
+   if (!tmp) {
+      return false;
    }
-   free (keys);
-   return false;
+   free (values[index]);
+   values[index] = tmp;
+   return true;
 }
 
 const char *kbsymtab_get_string (const kbsymtab_t *st, const char *key)
@@ -547,3 +679,150 @@ int64_t kbsymtab_get_int (const kbsymtab_t *st, const char *key)
    return ret;
 }
 
+// Sorts the entries of a single table by key. Tables are small, so a simple
+// insertion sort is sufficient.
+static void image_sort (const kbsymtab_image_t *img,
+                        const struct image_entry_t *entries, uint32_t *sorted,
+                        size_t nentries)
+{
+   for (size_t i=0; i<nentries; i++) {
+      uint32_t current = sorted[i];
+      const char *key = &img->blob[entries[current].key];
+      size_t j = i;
+      while (j > 0 && strcmp (&img->blob[entries[sorted[j - 1]].key], key) > 0) {
+         sorted[j] = sorted[j - 1];
+         j--;
+      }
+      sorted[j] = current;
+   }
+}
+
+kbsymtab_image_t *kbsymtab_compact (kbsymtab_t **tables, size_t ntables)
+{
+   bool error = true;
+   kbsymtab_image_t *ret = NULL;
+   char **keys = NULL;
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      KBIERROR ("OOM allocating symbol image\n");
+      goto cleanup;
+   }
+
+   // 1. Measure everything that has to be stored
+   for (size_t i=0; i<ntables; i++) {
+      if (!tables[i] || !tables[i]->table) {
+         continue;
+      }
+      free (keys);
+      keys = NULL;
+      size_t nkeys = ds_hmap_keys (tables[i]->table, (void ***)&keys, NULL);
+      for (size_t j=0; j<nkeys && keys && keys[j]; j++) {
+         const char **values = NULL;
+         ds_hmap_get_str_ptr (tables[i]->table, keys[j], (void **)&values, NULL);
+         ret->blob_len += strlen (keys[j]) + 1;
+         for (size_t k=0; values && values[k]; k++) {
+            ret->blob_len += strlen (values[k]) + 1;
+            ret->nvalues++;
+         }
+         ret->nvalues++;
+         ret->nentries++;
+      }
+   }
+
+   if (ret->blob_len > UINT32_MAX || ret->nvalues > UINT32_MAX) {
+      KBIERROR ("Symbol tables too large to compact (%zu bytes, %zu values)\n",
+                ret->blob_len, ret->nvalues);
+      goto cleanup;
+   }
+
+   if (!(ret->blob = malloc (ret->blob_len + 1))
+         || !(ret->entries = calloc (ret->nentries + 1, sizeof *ret->entries))
+         || !(ret->sorted = calloc (ret->nentries + 1, sizeof *ret->sorted))
+         || !(ret->values = calloc (ret->nvalues + 1, sizeof *ret->values))) {
+      KBIERROR ("OOM allocating symbol image of %zu bytes\n", ret->blob_len);
+      goto cleanup;
+   }
+
+   // 2. Copy each table into the image, and replace its hash table with the
+   // entries in the image. A table whose keys cannot be retrieved is left
+   // as it is.
+   size_t blob_len = 0, nentries = 0, nvalues = 0;
+   for (size_t i=0; i<ntables; i++) {
+      kbsymtab_t *st = tables[i];
+      if (!st || !st->table) {
+         continue;
+      }
+      free (keys);
+      keys = NULL;
+      size_t nkeys = ds_hmap_keys (st->table, (void ***)&keys, NULL);
+      if (nkeys == (size_t)-1 || (nkeys && !keys)) {
+         continue;
+      }
+
+      size_t first = nentries;
+      for (size_t j=0; j<nkeys && keys[j]; j++) {
+         const char **values = NULL;
+         ds_hmap_get_str_ptr (st->table, keys[j], (void **)&values, NULL);
+
+         struct image_entry_t *entry = &ret->entries[nentries];
+         entry->key = (uint32_t)blob_len;
+         entry->values = (uint32_t)nvalues;
+         ret->sorted[nentries] = (uint32_t)(nentries - first);
+         nentries++;
+
+         size_t len = strlen (keys[j]) + 1;
+         memcpy (&ret->blob[blob_len], keys[j], len);
+         blob_len += len;
+
+         for (size_t k=0; values && values[k]; k++) {
+            len = strlen (values[k]) + 1;
+            memcpy (&ret->blob[blob_len], values[k], len);
+            ret->values[nvalues++] = &ret->blob[blob_len];
+            blob_len += len;
+         }
+         ret->values[nvalues++] = NULL;
+      }
+
+      image_sort (ret, &ret->entries[first], &ret->sorted[first], nentries - first);
+
+      table_del (st->table);
+      st->table = NULL;
+      st->image = ret;
+      st->entries = &ret->entries[first];
+      st->sorted = &ret->sorted[first];
+      st->nentries = nentries - first;
+   }
+
+   error = false;
+cleanup:
+   free (keys);
+   if (error) {
+      kbsymtab_image_del (ret);
+      ret = NULL;
+   }
+   return ret;
+}
+
+void kbsymtab_image_del (kbsymtab_image_t *img)
+{
+   if (!img)
+      return;
+
+   free (img->blob);
+   free (img->entries);
+   free (img->sorted);
+   free (img->values);
+   free (img);
+}
+
+size_t kbsymtab_image_size (const kbsymtab_image_t *img)
+{
+   if (!img)
+      return 0;
+
+   return sizeof *img
+        + img->blob_len + 1
+        + (img->nentries + 1) * (sizeof *img->entries + sizeof *img->sorted)
+        + (img->nvalues + 1) * sizeof *img->values;
+}
+
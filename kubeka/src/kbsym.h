@@ -3,6 +3,7 @@
 #define H_KBSYM
 
 typedef struct kbsymtab_t kbsymtab_t;
+typedef struct kbsymtab_image_t kbsymtab_image_t;
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,6 +32,18 @@ extern "C" {
    const char *kbsymtab_get_string (const kbsymtab_t *st, const char *key);
    int64_t kbsymtab_get_int (const kbsymtab_t *st, const char *key);
 
+   // Replace the value at `index` of an existing key.
+   bool kbsymtab_set_single (kbsymtab_t *st, const char *key, size_t index,
+                             const char *value);
+
+   // Copy the symbols of all the tables into a single packed image, and free
+   // the hash tables. The tables stay usable: reads are served from the image,
+   // and the first write to a table copies it out of the image again. The
+   // image must be deleted only after all the tables using it.
+   kbsymtab_image_t *kbsymtab_compact (kbsymtab_t **tables, size_t ntables);
+   void kbsymtab_image_del (kbsymtab_image_t *img);
+   size_t kbsymtab_image_size (const kbsymtab_image_t *img);
+
 #ifdef __cplusplus
 };
 #endif
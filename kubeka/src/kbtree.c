@@ -5,7 +5,6 @@
 #include <signal.h>
 
 #include "ds_array.h"
-#include "ds_set.h"
 #include "ds_str.h"
 
 
@@ -13,93 +12,124 @@
 #include "kbsym.h"
 #include "kbnode.h"
 #include "kbtree.h"
+#include "kbcancel.h"
 #include "kbbi.h"
 
 #define INCPTR(x)    do {\
    (x) = (x) + 1;\
 } while (0)
 
-static int cmpnode (const void *lhs, size_t lhslen,
-                    const void *rhs, size_t rhslen)
+// FNV-1a
+static uint64_t hash_id (const char *id)
 {
-   const kbnode_t *l = lhs;
-   const kbnode_t *r = rhs;
-   return kbnode_cmp (l, lhslen, r, rhslen);
+   uint64_t ret = 14695981039346656037ULL;
+   for (size_t i=0; id[i]; i++) {
+      ret ^= (uint8_t)id[i];
+      ret *= 1099511628211ULL;
+   }
+   return ret;
 }
 
-static void array_push (const void *node, size_t len, void *array)
+static void report_duplicates (const ds_array_t *nodes, const size_t *next,
+                               size_t first, size_t count)
 {
-   (void)len;
-   ds_array_t *a = array;
-   if (!(ds_array_ins_tail (a, (void *)node))) {
-      KBIERROR ("Error inserting node into array (full node dump follows)\n");
-      kbnode_dump (node, stderr, 0);
+   const char *id = NULL, *fname = NULL;
+   size_t line = 0;
+
+   kbnode_get_srcdef (ds_array_get (nodes, first), &id, &fname, &line);
+   fprintf (KBDIAG, "Duplicate node [%s] defined %zu times:\n", id, count);
+   for (size_t i=first; i!=(size_t)-1; i=next[i]) {
+      kbnode_get_srcdef (ds_array_get (nodes, i), &id, &fname, &line);
+      fprintf (KBDIAG, "   %s:%zu\n", fname, line);
    }
 }
 
-
 ds_array_t *kbtree_coalesce (ds_array_t *nodes, size_t *nduplicates,
                              size_t *nerrors, size_t *nwarnings)
 {
    bool error = true;
+   ds_array_t *ret = NULL;
 
    *nerrors = 0;
    *nwarnings = 0;
 
-   ds_set_t *set = NULL;
    size_t ndups = 0;
    size_t nnodes = ds_array_length (nodes);
 
-   if (!nnodes) {
-      return ds_array_new ();
+   // Each node's ID and its hash are fetched once. Nodes with the same ID are
+   // chained together through `next`, in the order in which they were read,
+   // and the first node of each chain is stored in an open-addressed table of
+   // at least twice as many slots as there are nodes.
+   size_t nslots = 16;
+   while (nslots < nnodes * 2) {
+      nslots *= 2;
+   }
+   const char **ids = calloc (nnodes + 1, sizeof *ids);
+   uint64_t *hashes = calloc (nnodes + 1, sizeof *hashes);
+   size_t *next = calloc (nnodes + 1, sizeof *next);
+   size_t *last = calloc (nnodes + 1, sizeof *last);
+   size_t *count = calloc (nnodes + 1, sizeof *count);
+   size_t *slots = calloc (nslots, sizeof *slots);
+
+   if (!ids || !hashes || !next || !last || !count || !slots
+         || !(ret = ds_array_new ())) {
+      KBIERROR ("OOM error creating table for %zu nodes.\n", nnodes);
+      INCPTR (*nerrors);
+      goto cleanup;
    }
 
-   if (!(set = ds_set_new (cmpnode, nnodes))) {
-      KBIERROR ("OOM error creating set for nodes.\n");
-      *nerrors = (*nerrors) + 1;
-      return NULL;
+   for (size_t i=0; i<nslots; i++) {
+      slots[i] = (size_t)-1;
    }
 
    for (size_t i=0; i<nnodes; i++) {
-      kbnode_t *node = ds_array_get (nodes, i);
-      kbnode_t *existing = ds_set_find (set, node, 0);
-      if (existing) {
-         const char *node_src_fname = NULL;
-         const char *node_id = NULL;
-         size_t node_src_line = 0;
-         const char *existing_src_fname = NULL;
-         const char *existing_id = NULL;
-         size_t existing_src_line = 0;
-
-         if (!(kbnode_get_srcdef (existing, &existing_id, &existing_src_fname,
-                                  &existing_src_line))
-               || !(kbnode_get_srcdef (node, &node_id, &node_src_fname,
-                                       &node_src_line))) {
-            KBIERROR ("Failed to retrieve file/line number information for duplicate"
-                      " nodes, aborting\n");
-            *nerrors = (*nerrors) + 1;
-            goto cleanup;
+      next[i] = (size_t)-1;
+      count[i] = 1;
+      ids[i] = kbnode_getvalue_first (ds_array_get (nodes, i), KBNODE_KEY_ID);
+      if (!ids[i][0]) {
+         // Nodes without an ID are never duplicates; they are reported when
+         // the node is checked.
+         continue;
+      }
+
+      hashes[i] = hash_id (ids[i]);
+      size_t slot = hashes[i] & (nslots - 1);
+      while (slots[slot] != (size_t)-1) {
+         size_t first = slots[slot];
+         if (hashes[first] == hashes[i] && (strcmp (ids[first], ids[i])) == 0) {
+            break;
          }
+         slot = (slot + 1) & (nslots - 1);
+      }
+
+      size_t first = slots[slot];
+      if (first == (size_t)-1) {
+         slots[slot] = i;
+         last[i] = i;
+         continue;
+      }
+
+      next[last[first]] = i;
+      last[first] = i;
+      count[first]++;
+      ids[i] = NULL;    // Not the first of its group
+      ndups++;
+      INCPTR (*nerrors);
+   }
 
-         fprintf (stderr, "Duplicate node found ...\n");
-         fprintf (stderr, "Node-1 found in [%s:%zu]\n",
-                  existing_src_fname, existing_src_line);
-         fprintf (stderr, "Node-2 found in [%s:%zu]\n",
-                  node_src_fname, node_src_line);
-         fprintf (stderr, "=== Node-1 dump follows: === \n");
-         kbnode_dump (existing, stderr, 0);
-         fprintf (stderr, "=== Node-2 dump follows: === \n");
-         kbnode_dump (node, stderr, 0);
-         ndups++;
-         *nerrors = (*nerrors) + 1;
+   // Keep the first node of each group, in the order the nodes were read,
+   // and report each group of duplicates once.
+   for (size_t i=0; i<nnodes; i++) {
+      if (!ids[i]) {
+         continue;
       }
-      int added = ds_set_add (set, node, 0);
-      if (added < 0) {
-         KBIERROR ("Failed to add following node to set of all nodes\n");
-         kbnode_dump (node, stderr, 0);
+      if (count[i] > 1) {
+         report_duplicates (nodes, next, i, count[i]);
       }
-      if (added == 0) {
-         KBXERROR ("Failed to add node (duplicate found)\n");
+      if (!(ds_array_ins_tail (ret, ds_array_get (nodes, i)))) {
+         KBIERROR ("OOM creating deduplicated list\n");
+         INCPTR (*nerrors);
+         goto cleanup;
       }
    }
 
@@ -110,23 +140,20 @@ ds_array_t *kbtree_coalesce (ds_array_t *nodes, size_t *nduplicates,
 
    error = false;
 cleanup:
+   free (ids);
+   free (hashes);
+   free (next);
+   free (last);
+   free (count);
+   free (slots);
    if (error) {
-      ds_set_del (set);
-      set = NULL;
-   }
-
-   ds_array_t *ret = ds_array_new ();
-   if (!ret) {
-      KBIERROR ("OOM creating deduplicated list\n");
-      return NULL;
+      ds_array_del (ret);
+      ret = NULL;
    }
-
-   ds_set_iterate (set, array_push, ret);
-   ds_set_del (set);
    return ret;
 }
 
-static char *exec_builtin (char *ref, const kbnode_t *node, size_t *nerrors,
+static char *exec_builtin (char *ref, kbnode_t *node, size_t *nerrors,
                            const char *fname, size_t line)
 {
    char *func = &ref[2];
@@ -156,42 +183,14 @@ static char *exec_builtin (char *ref, const kbnode_t *node, size_t *nerrors,
       return NULL;
    }
 
+   // Builtins only change the tree that they are called in, so trees can be
+   // evaluated concurrently.
    char *ret = fptr (func, params, node, nerrors, fname, line);
    *end = '>';
    *(params - 1) = ' ';
    return ret;
 }
 
-static char *resolve (char *ref, const kbnode_t *node, size_t *nerrors,
-                      const char *fname, size_t line)
-{
-   if ((strchr (ref, ' '))) {
-      return exec_builtin (ref, node, nerrors, fname, line);
-   }
-
-   char *start = &ref[2];
-   char *end = strchr (start, '>');
-   if (!end) {
-      KBPARSE_ERROR (fname, line, "Missing terminating '>' in symbol reference\n");
-      INCPTR (*nerrors);
-      return NULL;
-   }
-
-   *end = 0;
-   const char **values = kbnode_resolve (node, start);
-
-   if (!values) {
-      KBPARSE_ERROR (fname, line, "Failed to find values for symbol %s\n",
-               start);
-      INCPTR (*nerrors);
-      *end = '>';
-      return NULL;
-   }
-
-   *end = '>';
-   return kbutil_strarray_format (values);
-}
-
 static char *find_next_ref (const char *src, size_t *nerrors,
                             const char *fname, size_t line)
 {
@@ -224,104 +223,523 @@ static char *find_next_ref (const char *src, size_t *nerrors,
    return ret;
 }
 
-void kbtree_eval (kbnode_t *root, size_t *nerrors, size_t *nwarnings)
+/* ************************************************************************
+ * Evaluation. Every variable of every node in the tree is a vertex, and a
+ * reference `$<name>` in a value is an edge to the variable `name` in the
+ * nearest node (the referencing node itself, or one of its ancestors) that
+ * defines it. The variables are evaluated depth-first along those edges, so
+ * that every variable is evaluated once, after everything it refers to. A
+ * reference back to a variable whose evaluation is still in progress is a
+ * cycle, and is reported with its full path.
+ *
+ * Variables are dynamically scoped: the references in the value of an
+ * inherited variable are resolved from the node that uses it, not from the
+ * node that defines it. A variable is therefore evaluated once for each node
+ * (the scope) that uses it, and the values are kept per scope and variable.
+ * Only the values evaluated in the scope of their own node are stored in the
+ * node. Where nothing between the two nodes changes how a value resolves, it
+ * is evaluated once in the scope of the node that defines it and shared.
+ */
+
+enum varstate_t {
+   varstate_PENDING = 0,
+   varstate_ACTIVE,
+   varstate_DONE,
+   varstate_FAILED,
+};
+
+struct evalvar_t {
+   size_t node;
+   size_t key;
+};
+
+// A variable of an ancestor, evaluated in the scope of a node.
+struct inherited_t {
+   struct evalvar_t var;
+   enum varstate_t state;
+   char **values;
+};
+
+struct evalnode_t {
+   kbnode_t *node;
+   size_t parent;
+   size_t depth;
+   const char **keys;
+   size_t nkeys;
+   // The values of each key as read, before any substitution
+   char ***raw;
+   enum varstate_t *states;
+   unsigned *marks;
+   struct inherited_t *inherited;
+   size_t ninherited;
+};
+
+// A variable being evaluated, in the scope of the node `scope`
+struct evalstep_t {
+   size_t scope;
+   struct evalvar_t var;
+};
+
+struct evaltree_t {
+   struct evalnode_t *nodes;
+   size_t nnodes;
+   // The variables currently being evaluated, outermost first
+   struct evalstep_t *path;
+   size_t npath;
+   size_t cap;
+   // Marks the variables visited by one call to evaltree_shadowed()
+   unsigned gen;
+};
+
+static bool evaltree_add (struct evaltree_t *t, kbnode_t *node, size_t parent,
+                          size_t *nerrors)
 {
-   const char **keys = kbnode_keys (root);
-   const char *fname;
-   const char *id;
-   size_t line;
-
-   if (!(kbnode_get_srcdef (root, &id, &fname, &line))) {
-      KBXERROR ("Failed to get node filename and line number information\n");
+   struct evalnode_t *tmp = realloc (t->nodes, (t->nnodes + 1) * sizeof *tmp);
+   if (!tmp) {
+      KBIERROR ("OOM growing evaluation tree\n");
       INCPTR (*nerrors);
-      goto cleanup;
+      return false;
    }
-
-   if (!keys) {
-      KBPARSE_ERROR (fname, line, "Failed to get node symbols\n");
+   t->nodes = tmp;
+
+   struct evalnode_t *en = &t->nodes[t->nnodes];
+   memset (en, 0, sizeof *en);
+   en->node = node;
+   en->parent = parent;
+   en->depth = parent == (size_t)-1 ? 0 : t->nodes[parent].depth + 1;
+   en->keys = kbnode_keys (node);
+   for (en->nkeys=0; en->keys && en->keys[en->nkeys]; en->nkeys++)
+      ;
+   en->states = calloc (en->nkeys + 1, sizeof *en->states);
+   en->marks = calloc (en->nkeys + 1, sizeof *en->marks);
+   en->raw = calloc (en->nkeys + 1, sizeof *en->raw);
+   // The node is counted before its values are copied, so that they are
+   // released with it on error.
+   t->nnodes++;
+   if (!en->states || !en->marks || !en->raw) {
+      KBIERROR ("OOM allocating evaluation state\n");
       INCPTR (*nerrors);
-      goto cleanup;
+      return false;
+   }
+   for (size_t i=0; i<en->nkeys; i++) {
+      const char **values = kbnode_getvalue_all (node, en->keys[i]);
+      if (values && !(en->raw[i] = kbutil_strarray_copy (values))) {
+         INCPTR (*nerrors);
+         return false;
+      }
+   }
+   return true;
+}
+
+// Collects the nodes in the order in which they were evaluated before: the
+// handlers, then the jobs (each with its own subtree), then the node itself.
+static bool evaltree_collect (struct evaltree_t *t, kbnode_t *node, size_t parent,
+                              size_t *nerrors)
+{
+   if (!(evaltree_add (t, node, parent, nerrors))) {
+      return false;
+   }
+   size_t self = t->nnodes - 1;
+
+   size_t nnodes = kbnode_nhandlers (node);
+   for (size_t i=0; i<nnodes; i++) {
+      kbnode_t *child = kbnode_handler (node, i);
+      if (child && !(evaltree_collect (t, child, self, nerrors))) {
+         return false;
+      }
+   }
+
+   nnodes = kbnode_njobs (node);
+   for (size_t i=0; i<nnodes; i++) {
+      kbnode_t *child = kbnode_job (node, i);
+      if (child && !(evaltree_collect (t, child, self, nerrors))) {
+         return false;
+      }
    }
+   return true;
+}
 
-   // Recursively evaluate all handlers and jobs attached to this node. Have to
-   // do this first because the current node would try to resolve symbols that
-   // may be present in the dependent nodes.
-   const ds_array_t *children = kbnode_handlers (root);
-   size_t nnodes = ds_array_length (children);
-   for (size_t i=0; i < nnodes; i++) {
-      kbtree_eval (ds_array_get (children, i), nerrors, nwarnings);
+static void evaltree_del (struct evaltree_t *t)
+{
+   for (size_t i=0; i<t->nnodes; i++) {
+      struct evalnode_t *en = &t->nodes[i];
+      for (size_t j=0; en->raw && j<en->nkeys; j++) {
+         kbutil_strarray_del (en->raw[j]);
+      }
+      for (size_t j=0; j<en->ninherited; j++) {
+         kbutil_strarray_del (en->inherited[j].values);
+      }
+      free (en->keys);
+      free (en->raw);
+      free (en->states);
+      free (en->marks);
+      free (en->inherited);
    }
+   free (t->nodes);
+   free (t->path);
+}
 
-   children = kbnode_jobs (root);
-   nnodes = ds_array_length (children);
-   for (size_t i=0; i < nnodes; i++) {
-      kbtree_eval (ds_array_get (children, i), nerrors, nwarnings);
+// Finds the variable that `symbol` refers to from node `en`.
+static bool evaltree_find (const struct evaltree_t *t, size_t en,
+                           const char *symbol, struct evalvar_t *var)
+{
+   for (size_t i=en; i!=(size_t)-1; i=t->nodes[i].parent) {
+      const struct evalnode_t *n = &t->nodes[i];
+      for (size_t j=0; j<n->nkeys; j++) {
+         if ((strcmp (n->keys[j], symbol)) == 0) {
+            var->node = i;
+            var->key = j;
+            return true;
+         }
+      }
    }
+   return false;
+}
+
+// Whether the value of `var` in the scope of the node `scope` could differ
+// from its value in the scope of its own node: it (or a variable that it
+// refers to) refers to a variable that is defined below that node, or calls
+// a function, which acts on the node that it is called from.
+static bool evaltree_shadowed (struct evaltree_t *t, size_t scope, size_t depth,
+                               struct evalvar_t var)
+{
+   struct evalnode_t *en = &t->nodes[var.node];
+   if (en->marks[var.key] == t->gen) {
+      return false;
+   }
+   en->marks[var.key] = t->gen;
+
+   char **values = en->raw[var.key];
+   for (size_t i=0; values && values[i]; i++) {
+      // Malformed references are reported when the value is evaluated
+      const char *cursor = values[i];
+      const char *start;
+      while ((start = strstr (cursor, "$<"))) {
+         const char *end = strchr (&start[2], '>');
+         if (!end) {
+            break;
+         }
+         cursor = &end[1];
 
-   // for each $key in the symtab {
-   //    for each $value in the array of values from $key {
-   //       value = perform_subst (value, node)
-   //       node_set_symbol
-   //       }
-   //    }
-   // }
-   //
+         size_t len = (size_t)(end - &start[2]);
+         char *symbol = calloc (len + 1, 1);
+         if (!symbol) {
+            return true;
+         }
+         memcpy (symbol, &start[2], len);
 
-   for (size_t i=0; keys[i]; i++) {
-      if (!(kbnode_get_srcdef (root, &id, &fname, &line))) {
-         KBXERROR ("Failed to get node filename and line number information\n");
+         struct evalvar_t ref;
+         bool shadowed = (strchr (symbol, ' ')) != NULL;
+         if (!shadowed && (evaltree_find (t, scope, symbol, &ref))) {
+            shadowed = t->nodes[ref.node].depth > depth
+                     || evaltree_shadowed (t, scope, depth, ref);
+         }
+         free (symbol);
+         if (shadowed) {
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+// The variable `var` as it is inherited by the node `scope`, added if it is
+// not there yet. Returns its index in the inherited variables of `scope`.
+static size_t evaltree_inherit (struct evaltree_t *t, size_t scope,
+                                struct evalvar_t var, size_t *nerrors)
+{
+   struct evalnode_t *en = &t->nodes[scope];
+   for (size_t i=0; i<en->ninherited; i++) {
+      if (en->inherited[i].var.node == var.node
+            && en->inherited[i].var.key == var.key) {
+         return i;
+      }
+   }
+
+   struct inherited_t *tmp = realloc (en->inherited,
+                                      (en->ninherited + 1) * sizeof *tmp);
+   if (!tmp) {
+      KBIERROR ("OOM growing inherited variables\n");
+      INCPTR (*nerrors);
+      return (size_t)-1;
+   }
+   en->inherited = tmp;
+   memset (&en->inherited[en->ninherited], 0, sizeof *tmp);
+   en->inherited[en->ninherited].var = var;
+   return en->ninherited++;
+}
+
+static bool evaltree_push (struct evaltree_t *t, size_t scope,
+                           struct evalvar_t var, size_t *nerrors)
+{
+   if (t->npath >= t->cap) {
+      size_t newcap = t->cap ? t->cap * 2 : 16;
+      struct evalstep_t *tmp = realloc (t->path, newcap * sizeof *tmp);
+      if (!tmp) {
+         KBIERROR ("OOM growing evaluation path\n");
          INCPTR (*nerrors);
-         goto cleanup;
+         return false;
       }
+      t->path = tmp;
+      t->cap = newcap;
+   }
+   t->path[t->npath].scope = scope;
+   t->path[t->npath].var = var;
+   t->npath++;
+   return true;
+}
 
-      const char **values = kbnode_getvalue_all (root, keys[i]);
-      if (!values) {
-         KBPARSE_ERROR (fname, line, "Failed to get values for symbol %s\n",
-                  keys[i]);
-         INCPTR (*nwarnings); // TODO: Should this be an error?
-         continue;
+static void report_cycle (const struct evaltree_t *t, size_t scope,
+                          struct evalvar_t var, const char *fname, size_t line)
+{
+   size_t start = t->npath;
+   while (start > 0) {
+      start--;
+      if (t->path[start].scope == scope
+            && t->path[start].var.node == var.node
+            && t->path[start].var.key == var.key) {
+         break;
       }
+   }
 
-      for (size_t j=0; values[j]; j++) {
+   KBPARSE_ERROR (fname, line, "Circular substitution: ");
+   for (size_t i=start; i<t->npath; i++) {
+      const struct evalnode_t *n = &t->nodes[t->path[i].var.node];
+      fprintf (KBDIAG, "[%s]$<%s> -> ",
+               kbnode_getvalue_first (n->node, KBNODE_KEY_ID),
+               n->keys[t->path[i].var.key]);
+   }
+   fprintf (KBDIAG, "[%s]$<%s>\n",
+            kbnode_getvalue_first (t->nodes[var.node].node, KBNODE_KEY_ID),
+            t->nodes[var.node].keys[var.key]);
+}
 
-         char *newvalue = ds_str_dup (values[j]);
-         char *ref = NULL;
-         size_t errors = 0;
+static const char **eval_var (struct evaltree_t *t, size_t scope,
+                              struct evalvar_t var, size_t *nerrors,
+                              size_t *nwarnings);
 
-         while (!errors && (ref = find_next_ref (newvalue, &errors, fname, line))) {
-            char *resolved = resolve (ref, root, &errors, fname, line);
-            if (errors || !resolved) {
-               free (ref);
-               ref = NULL;
-               break;
-            }
-            char *tmp = ds_str_strsubst (newvalue, ref, resolved, NULL);
-            free (ref);
-            ref = NULL;
-            free (resolved);
-            resolved = NULL;
-            if (!tmp) {
-               KBIERROR ("OOM performing substitution\n");
-               break;
+// Substitutes every reference in `value`, resolved from the node `scope`,
+// evaluating the variables that it refers to first. The substituted text is
+// not scanned again.
+static char *eval_value (struct evaltree_t *t, size_t scope, const char *value,
+                         size_t *nerrors, size_t *nwarnings,
+                         const char *fname, size_t line)
+{
+   kbnode_t *node = t->nodes[scope].node;
+   char *ret = ds_str_dup ("");
+   const char *cursor = value;
+   char *ref = NULL;
+
+   while (ret && (ref = find_next_ref (cursor, nerrors, fname, line))) {
+      const char *start = strstr (cursor, ref);
+      char *resolved = NULL;
+      struct evalvar_t var;
+
+      if ((strchr (ref, ' '))) {
+         resolved = exec_builtin (ref, node, nerrors, fname, line);
+      } else {
+         size_t reflen = strlen (ref);
+         ref[reflen - 1] = 0;
+         if (!(evaltree_find (t, scope, &ref[2], &var))) {
+            KBPARSE_ERROR (fname, line, "Failed to find values for symbol %s\n",
+                     &ref[2]);
+            INCPTR (*nerrors);
+         } else {
+            const char **values = eval_var (t, scope, var, nerrors, nwarnings);
+            if (values) {
+               resolved = kbutil_strarray_format (values);
             }
-            free (newvalue);
-            newvalue = tmp;
-        }
-         *nerrors = (*nerrors) + errors;
-         if (errors) {
-            KBPARSE_ERROR (fname, line, "Aborting due to errors\n");
-            free (newvalue);
-            break;
          }
+         ref[reflen - 1] = '>';
+      }
+
+      if (!resolved) {
+         free (ret);
+         ret = NULL;
+         break;
+      }
+
+      // The text between the previous reference and this one is copied as is
+      size_t prefix = (size_t)(start - cursor);
+      char *before = calloc (prefix + 1, 1);
+      char *tmp = NULL;
+      if (before) {
+         memcpy (before, cursor, prefix);
+         tmp = ds_str_cat (ret, before, resolved, NULL);
+      }
+      free (before);
+      free (resolved);
+      free (ret);
+      if (!(ret = tmp)) {
+         KBIERROR ("OOM performing substitution\n");
+         INCPTR (*nerrors);
+      }
+      cursor = start + strlen (ref);
+      free (ref);
+      ref = NULL;
+   }
+   free (ref);
+
+   if (ret) {
+      char *tmp = ds_str_cat (ret, cursor, NULL);
+      free (ret);
+      ret = tmp;
+   }
+   return ret;
+}
+
+// Evaluates all the values of a single variable in the scope of the node
+// `scope`. Returns the values, or NULL if the variable could not be
+// evaluated.
+static const char **eval_var (struct evaltree_t *t, size_t scope,
+                              struct evalvar_t var, size_t *nerrors,
+                              size_t *nwarnings)
+{
+   // An inherited variable whose value does not depend on the node that uses
+   // it is evaluated (once) in its own node.
+   if (var.node != scope) {
+      t->gen++;
+      if (!(evaltree_shadowed (t, scope, t->nodes[var.node].depth, var))) {
+         scope = var.node;
+      }
+   }
+
+   struct evalnode_t *en = &t->nodes[var.node];
+   const char *fname, *id;
+   size_t line;
+   size_t inh = (size_t)-1;
+   enum varstate_t state = en->states[var.key];
+
+   kbnode_get_srcdef (en->node, &id, &fname, &line);
 
-         kbnode_set_single (root, keys[i], j, newvalue);
+   if (var.node != scope) {
+      if ((inh = evaltree_inherit (t, scope, var, nerrors)) == (size_t)-1) {
+         return NULL;
+      }
+      state = t->nodes[scope].inherited[inh].state;
+   }
+
+   const char *key = en->keys[var.key];
+   switch (state) {
+      case varstate_DONE:
+         return inh == (size_t)-1
+              ? kbnode_getvalue_all (en->node, key)
+              : (const char **)t->nodes[scope].inherited[inh].values;
+      case varstate_FAILED:   return NULL;
+      case varstate_ACTIVE:
+         report_cycle (t, scope, var, fname, line);
+         INCPTR (*nerrors);
+         return NULL;
+      case varstate_PENDING:  break;
+   }
+
+   // Values are evaluated from what was read, as the node's own values may
+   // have been evaluated (in its own scope) already.
+   char **values = en->raw[var.key];
+   if (!values) {
+      KBPARSE_ERROR (fname, line, "Failed to get values for symbol %s\n", key);
+      INCPTR (*nwarnings); // TODO: Should this be an error?
+      state = varstate_FAILED;
+      goto done;
+   }
+
+   if (!(evaltree_push (t, scope, var, nerrors))) {
+      state = varstate_FAILED;
+      goto done;
+   }
+   state = varstate_ACTIVE;
+   if (inh == (size_t)-1) {
+      en->states[var.key] = state;
+   } else {
+      t->nodes[scope].inherited[inh].state = state;
+   }
+
+   char **evaluated = NULL;
+   state = varstate_DONE;
+   for (size_t i=0; values[i]; i++) {
+      size_t errors = 0;
+      char *newvalue = eval_value (t, scope, values[i], &errors, nwarnings,
+                                   fname, line);
+      *nerrors = (*nerrors) + errors;
+      if (errors || !newvalue) {
+         KBPARSE_ERROR (fname, line, "Aborting due to errors\n");
+         free (newvalue);
+         state = varstate_FAILED;
+         break;
+      }
+      if (inh == (size_t)-1) {
+         kbnode_set_single (en->node, key, i, newvalue);
+         free (newvalue);
+      } else if (!(kbutil_strarray_append (&evaluated, newvalue))) {
+         KBIERROR ("OOM storing evaluated value\n");
+         INCPTR (*nerrors);
          free (newvalue);
-         newvalue = NULL;
+         state = varstate_FAILED;
+         break;
       }
    }
+   t->npath--;
 
-cleanup:
-   free (keys);
+   if (inh != (size_t)-1) {
+      if (state == varstate_DONE && !evaluated) {
+         // No values at all
+         evaluated = calloc (1, sizeof *evaluated);
+         state = evaluated ? state : varstate_FAILED;
+      }
+      if (state == varstate_DONE) {
+         t->nodes[scope].inherited[inh].values = evaluated;
+      } else {
+         kbutil_strarray_del (evaluated);
+      }
+   }
+
+done:
+   if (inh == (size_t)-1) {
+      en->states[var.key] = state;
+   } else {
+      t->nodes[scope].inherited[inh].state = state;
+   }
+   if (state != varstate_DONE) {
+      return NULL;
+   }
+   return inh == (size_t)-1
+        ? kbnode_getvalue_all (en->node, key)
+        : (const char **)t->nodes[scope].inherited[inh].values;
 }
 
+void kbtree_eval (kbnode_t *root, size_t *nerrors, size_t *nwarnings)
+{
+   struct evaltree_t t;
+
+   if (!root) {
+      // Detached jobs and handlers are skipped
+      return;
+   }
+
+   memset (&t, 0, sizeof t);
+   if (!(evaltree_collect (&t, root, (size_t)-1, nerrors))) {
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<t.nnodes; i++) {
+      if (!t.nodes[i].keys) {
+         const char *fname, *id;
+         size_t line;
+         kbnode_get_srcdef (t.nodes[i].node, &id, &fname, &line);
+         KBPARSE_ERROR (fname, line, "Failed to get node symbols\n");
+         INCPTR (*nerrors);
+         goto cleanup;
+      }
+   }
+
+   // Nodes are collected parent first, but evaluated children first.
+   for (size_t i=t.nnodes; i>0; i--) {
+      for (size_t j=0; j<t.nodes[i - 1].nkeys; j++) {
+         struct evalvar_t var = { i - 1, j };
+         eval_var (&t, i - 1, var, nerrors, nwarnings);
+      }
+   }
 
+cleanup:
+   evaltree_del (&t);
+}
@@ -6,13 +6,18 @@
 extern "C" {
 #endif
 
-   // Returns a set of the nodes, along with a count of duplicates in the
-   // `nduplicates` parameter.
+   // Returns the nodes with duplicates (nodes with the same ID as an earlier
+   // node) removed, in the order given, along with a count of duplicates in
+   // the `nduplicates` parameter. Each group of duplicates is reported once,
+   // with the location of every node in the group.
    ds_array_t *kbtree_coalesce (ds_array_t *nodes, size_t *nduplicates,
                                 size_t *nerrors, size_t *nwarnings);
 
    // Using the given node as the root of an instantiated tree, perform
-   // all the variable substitutions.
+   // all the variable substitutions. Variables are evaluated once for each
+   // node that uses them (references resolve from that node, as the scope is
+   // dynamic), after the variables that they refer to; circular substitutions
+   // are errors and are reported with the path of the cycle.
    void kbtree_eval (kbnode_t *root, size_t *nerrors, size_t *nwarnings);
 
 
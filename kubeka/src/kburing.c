@@ -0,0 +1,228 @@
+
+// For syscall()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "kburing.h"
+
+struct kburing_t {
+   int fd;
+
+   void *sq_ring;
+   size_t sq_ringlen;
+   struct io_uring_sqe *sqes;
+   size_t sqeslen;
+   unsigned *sq_head;
+   unsigned *sq_tail;
+   unsigned *sq_array;
+   unsigned sq_mask;
+   unsigned sq_entries;
+   // Entries up to `sq_local` are filled in, those up to `sq_submitted` have
+   // been given to the kernel.
+   unsigned sq_local;
+   unsigned sq_submitted;
+
+   void *cq_ring;
+   size_t cq_ringlen;
+   struct io_uring_cqe *cqes;
+   unsigned *cq_head;
+   unsigned *cq_tail;
+   unsigned cq_mask;
+};
+
+#ifdef __NR_io_uring_setup
+
+static int uring_setup (unsigned entries, struct io_uring_params *params)
+{
+   return (int)syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter (int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+   return (int)syscall (__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register (int fd, unsigned opcode, const void *arg,
+                           unsigned nargs)
+{
+   return (int)syscall (__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+#else
+
+static int uring_setup (unsigned entries, struct io_uring_params *params)
+{
+   (void)entries;
+   (void)params;
+   errno = ENOSYS;
+   return -1;
+}
+
+static int uring_enter (int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+   (void)fd;
+   (void)submit;
+   (void)wait;
+   (void)flags;
+   errno = ENOSYS;
+   return -1;
+}
+
+static int uring_register (int fd, unsigned opcode, const void *arg,
+                           unsigned nargs)
+{
+   (void)fd;
+   (void)opcode;
+   (void)arg;
+   (void)nargs;
+   errno = ENOSYS;
+   return -1;
+}
+
+#endif
+
+static void *map (int fd, size_t len, off_t offset)
+{
+   void *ret = mmap (NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+   return ret == MAP_FAILED ? NULL : ret;
+}
+
+kburing_t *kburing_new (unsigned entries)
+{
+   struct io_uring_params params;
+   kburing_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      return NULL;
+   }
+   memset (&params, 0, sizeof params);
+
+   if ((ret->fd = uring_setup (entries, &params)) < 0) {
+      free (ret);
+      return NULL;
+   }
+
+   ret->sq_ringlen = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+   ret->sqeslen = params.sq_entries * sizeof (struct io_uring_sqe);
+   ret->cq_ringlen = params.cq_off.cqes
+                   + params.cq_entries * sizeof (struct io_uring_cqe);
+
+   if (!(ret->sq_ring = map (ret->fd, ret->sq_ringlen, IORING_OFF_SQ_RING))
+         || !(ret->sqes = map (ret->fd, ret->sqeslen, IORING_OFF_SQES))
+         || !(ret->cq_ring = map (ret->fd, ret->cq_ringlen, IORING_OFF_CQ_RING))) {
+      int saved = errno;
+      kburing_del (ret);
+      errno = saved;
+      return NULL;
+   }
+
+   char *sq = ret->sq_ring;
+   ret->sq_head = (unsigned *)&sq[params.sq_off.head];
+   ret->sq_tail = (unsigned *)&sq[params.sq_off.tail];
+   ret->sq_array = (unsigned *)&sq[params.sq_off.array];
+   ret->sq_mask = *(unsigned *)&sq[params.sq_off.ring_mask];
+   ret->sq_entries = params.sq_entries;
+   ret->sq_local = ret->sq_submitted = *ret->sq_tail;
+
+   char *cq = ret->cq_ring;
+   ret->cq_head = (unsigned *)&cq[params.cq_off.head];
+   ret->cq_tail = (unsigned *)&cq[params.cq_off.tail];
+   ret->cq_mask = *(unsigned *)&cq[params.cq_off.ring_mask];
+   ret->cqes = (struct io_uring_cqe *)&cq[params.cq_off.cqes];
+
+   return ret;
+}
+
+void kburing_del (kburing_t *ring)
+{
+   if (!ring) {
+      return;
+   }
+   if (ring->cq_ring) {
+      munmap (ring->cq_ring, ring->cq_ringlen);
+   }
+   if (ring->sqes) {
+      munmap (ring->sqes, ring->sqeslen);
+   }
+   if (ring->sq_ring) {
+      munmap (ring->sq_ring, ring->sq_ringlen);
+   }
+   close (ring->fd);
+   free (ring);
+}
+
+bool kburing_register_buffers (kburing_t *ring, const struct iovec *bufs,
+                               unsigned nbufs)
+{
+   return uring_register (ring->fd, IORING_REGISTER_BUFFERS, bufs, nbufs) == 0;
+}
+
+struct io_uring_sqe *kburing_sqe (kburing_t *ring)
+{
+   unsigned head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+   if (ring->sq_local - head >= ring->sq_entries) {
+      if (!(kburing_submit (ring, 0))) {
+         return NULL;
+      }
+      head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+      if (ring->sq_local - head >= ring->sq_entries) {
+         return NULL;
+      }
+   }
+
+   unsigned index = ring->sq_local & ring->sq_mask;
+   struct io_uring_sqe *ret = &ring->sqes[index];
+   memset (ret, 0, sizeof *ret);
+   ring->sq_array[index] = index;
+   ring->sq_local++;
+   return ret;
+}
+
+bool kburing_submit (kburing_t *ring, unsigned wait)
+{
+   __atomic_store_n (ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+
+   while (true) {
+      unsigned nsubmit = ring->sq_local - ring->sq_submitted;
+      if (!nsubmit && !wait) {
+         return true;
+      }
+      int rc = uring_enter (ring->fd, nsubmit, wait,
+                            wait ? IORING_ENTER_GETEVENTS : 0);
+      if (rc < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return false;
+      }
+      ring->sq_submitted += (unsigned)rc;
+      return true;
+   }
+}
+
+struct io_uring_cqe *kburing_cqe (kburing_t *ring)
+{
+   unsigned head = *ring->cq_head;
+   if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      return NULL;
+   }
+   return &ring->cqes[head & ring->cq_mask];
+}
+
+void kburing_seen (kburing_t *ring)
+{
+   __atomic_store_n (ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
@@ -0,0 +1,44 @@
+
+#ifndef H_KBURING
+#define H_KBURING
+
+// A minimal io_uring, on the raw system calls: the submission queue is only
+// handed to the kernel by kburing_submit(), so that everything queued while
+// the completions of one wakeup are processed is submitted in one call.
+// Callers include <linux/io_uring.h> for the entries themselves.
+
+typedef struct kburing_t kburing_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Returns NULL with errno set if the kernel has no io_uring (ENOSYS), or
+   // it is not permitted (EPERM).
+   kburing_t *kburing_new (unsigned entries);
+   void kburing_del (kburing_t *ring);
+
+   // Register `nbufs` buffers for the *_FIXED operations.
+   bool kburing_register_buffers (kburing_t *ring, const struct iovec *bufs,
+                                  unsigned nbufs);
+
+   // A zeroed submission entry, or NULL if the queue is still full after
+   // submitting what is in it.
+   struct io_uring_sqe *kburing_sqe (kburing_t *ring);
+
+   // Submit all the queued entries, and wait until at least `wait`
+   // completions are available. Returns false with errno set on failure.
+   bool kburing_submit (kburing_t *ring, unsigned wait);
+
+   // The next completion, or NULL if there is none. Each completion must be
+   // released with kburing_seen() before the next one is fetched.
+   struct io_uring_cqe *kburing_cqe (kburing_t *ring);
+   void kburing_seen (kburing_t *ring);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
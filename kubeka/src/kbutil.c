@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "ds_str.h"
 
@@ -238,3 +239,34 @@ cleanup:
    return ret;
 }
 
+size_t kbutil_rss (void)
+{
+   FILE *inf = fopen ("/proc/self/statm", "r");
+   if (!inf) {
+      return 0;
+   }
+
+   size_t npages = 0, nresident = 0;
+   if ((fscanf (inf, "%zu %zu", &npages, &nresident)) != 2) {
+      nresident = 0;
+   }
+   fclose (inf);
+
+   long pagesize = sysconf (_SC_PAGESIZE);
+   return pagesize > 0 ? nresident * (size_t)pagesize : 0;
+}
+
+static __thread FILE *g_diag = NULL;
+
+FILE *kbutil_diag (void)
+{
+   return g_diag ? g_diag : stderr;
+}
+
+FILE *kbutil_diag_redirect (FILE *outf)
+{
+   FILE *ret = g_diag;
+   g_diag = outf;
+   return ret;
+}
+
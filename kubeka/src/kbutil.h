@@ -13,34 +13,38 @@
 #ifndef H_KBUTIL
 #define H_KBUTIL
 
+// All diagnostics go to the calling thread's diagnostic stream, which is
+// stderr unless the thread has redirected it with kbutil_diag_redirect().
+#define KBDIAG          (kbutil_diag ())
+
 #define KBWARN(...)     do {\
-   fprintf (stderr, "Warning: ");\
-   fprintf (stderr, __VA_ARGS__);\
-   fflush (stderr);\
+   fprintf (KBDIAG, "Warning: ");\
+   fprintf (KBDIAG, __VA_ARGS__);\
+   fflush (KBDIAG);\
 } while (0)
 
 #define KBIERROR(...)     do {\
-   fprintf (stderr, "[%s:%i] Error in %s(): ", __FILE__, __LINE__, __func__);\
-   fprintf (stderr, __VA_ARGS__);\
-   fflush (stderr);\
+   fprintf (KBDIAG, "[%s:%i] Error in %s(): ", __FILE__, __LINE__, __func__);\
+   fprintf (KBDIAG, __VA_ARGS__);\
+   fflush (KBDIAG);\
 } while (0)
 
 #define KBXERROR(...)     do {\
-   fprintf (stderr, "Error: ");\
-   fprintf (stderr, __VA_ARGS__);\
-   fflush (stderr);\
+   fprintf (KBDIAG, "Error: ");\
+   fprintf (KBDIAG, __VA_ARGS__);\
+   fflush (KBDIAG);\
 } while (0)
 
 #define KBPARSE_ERROR(fname,line, ...)     do {\
-   fprintf (stderr, "Error in %s:%zu: ", fname, line);\
-   fprintf (stderr, __VA_ARGS__);\
-   fflush (stderr);\
+   fprintf (KBDIAG, "Error in %s:%zu: ", fname, line);\
+   fprintf (KBDIAG, __VA_ARGS__);\
+   fflush (KBDIAG);\
 } while (0)
 
 #define KBPARSE_WARN(fname,line, ...)     do {\
-   fprintf (stderr, "Warning in %s:%zu: ", fname, line);\
-   fprintf (stderr, __VA_ARGS__);\
-   fflush (stderr);\
+   fprintf (KBDIAG, "Warning in %s:%zu: ", fname, line);\
+   fprintf (KBDIAG, __VA_ARGS__);\
+   fflush (KBDIAG);\
 } while (0)
 
 
@@ -63,6 +67,15 @@ extern "C" {
    char **kbutil_strarray_append (char ***dst, char *s);
    char **kbutil_strarray_copy (const char **src);
 
+   // Return the resident set size of this process in bytes, or zero if it
+   // cannot be determined.
+   size_t kbutil_rss (void);
+
+   // Return the diagnostic stream of the calling thread. Redirecting it to
+   // `outf` returns the previous redirection; a NULL `outf` restores stderr.
+   FILE *kbutil_diag (void);
+   FILE *kbutil_diag_redirect (FILE *outf);
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,894 @@
+
+// For copy_file_range()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <pthread.h>
+
+#include "ds_str.h"
+
+#include "kbutil.h"
+#include "kbcancel.h"
+#include "kbwork.h"
+
+#define DEFAULT_ROOT    "/tmp"
+#define PERSISTENT_DIR  "/kubeka-persistent"
+#define LOCK_SUFFIX     ".lock"
+// How often a run that waits for a persistent workspace checks whether it
+// was cancelled.
+#define LOCK_POLL_MS    (250)
+
+// From <linux/fs.h>, which cannot be included with <sys/mount.h>
+#ifndef FICLONE
+#define FICLONE         _IOW (0x94, 9, int)
+#endif
+
+static char *g_root = NULL;
+static bool g_mounted = false;
+static uint64_t g_budget = 0;
+
+// Only one thread evicts at a time; other processes are kept out of the
+// workspaces that are being removed by their locks.
+static pthread_mutex_t g_evict_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct kbwork_t {
+   char *prefix;
+   char *path;
+
+   // Persistent workspaces only: the name, and the lock file while the
+   // workspace is in use. They belong to the workspace of a run, which keeps
+   // them in the `persistent` list.
+   char *name;
+   int lockfd;
+   kbwork_t *persistent;
+   kbwork_t *next;
+
+   // Clones only: the persistent workspace that is copied, which belongs to
+   // the run, and whether its files are hard linked rather than copied.
+   kbwork_t *source;
+   bool link;
+};
+
+static bool persistent_dir (char **dir)
+{
+   *dir = ds_str_cat (g_root ? g_root : DEFAULT_ROOT, PERSISTENT_DIR, NULL);
+   if (!*dir) {
+      KBIERROR ("OOM creating name of persistent workspaces\n");
+      return false;
+   }
+   // The workspaces in it belong to the users that the commands run as, who
+   // must be able to reach them, but cannot list or change the directory.
+   if (!(kbwork_private_dir (*dir, 0711))) {
+      free (*dir);
+      *dir = NULL;
+      return false;
+   }
+   return true;
+}
+
+static void root_release (void)
+{
+   if (g_mounted && (umount2 (g_root, MNT_DETACH)) != 0) {
+      KBWARN ("Failed to unmount workspace tmpfs [%s]: %m\n", g_root);
+   }
+   g_mounted = false;
+   free (g_root);
+   g_root = NULL;
+}
+
+bool kbwork_set_root (const char *dir, size_t quota)
+{
+   root_release ();
+   if (!dir) {
+      return true;
+   }
+
+   if ((mkdir (dir, 0755)) != 0 && errno != EEXIST) {
+      KBXERROR ("Failed to create workspace root [%s]: %m\n", dir);
+      return false;
+   }
+   if (!(g_root = ds_str_dup (dir))) {
+      KBIERROR ("OOM copying workspace root [%s]\n", dir);
+      return false;
+   }
+
+   if (quota) {
+      char options[64];
+      snprintf (options, sizeof options, "size=%zu,mode=0755", quota);
+      if ((mount ("kubeka", dir, "tmpfs", MS_NOSUID | MS_NODEV, options)) != 0) {
+         KBWARN ("Cannot mount a tmpfs of %zu bytes on [%s] (%m), workspaces "
+                 "will be created there without a quota\n", quota, dir);
+      } else {
+         g_mounted = true;
+      }
+   }
+   return true;
+}
+
+void kbwork_set_budget (uint64_t budget)
+{
+   g_budget = budget;
+}
+
+bool kbwork_scope (const char *value, enum kbwork_scope_t *scope,
+                   const char **name)
+{
+   // Scopes with a name are prefixes of the value
+   static const struct {
+      const char *name;
+      enum kbwork_scope_t scope;
+      bool named;
+   } scopes[] = {
+      { "node",         kbwork_scope_NODE,         false },
+      { "run",          kbwork_scope_RUN,          false },
+      { "persistent:",  kbwork_scope_PERSISTENT,   true },
+      { "clone:",       kbwork_scope_CLONE,        true },
+      { "link:",        kbwork_scope_LINK,         true },
+   };
+
+   for (size_t i=0; value && i<sizeof scopes / sizeof scopes[0]; i++) {
+      if (!scopes[i].named) {
+         if ((strcmp (value, scopes[i].name)) == 0) {
+            *scope = scopes[i].scope;
+            return true;
+         }
+         continue;
+      }
+
+      size_t len = strlen (scopes[i].name);
+      if ((strncmp (value, scopes[i].name, len)) != 0) {
+         continue;
+      }
+      const char *tmp = &value[len];
+      if (!tmp[0]) {
+         return false;
+      }
+      for (size_t j=0; tmp[j]; j++) {
+         if (!isalnum ((unsigned char)tmp[j]) && tmp[j] != '-' && tmp[j] != '_') {
+            return false;
+         }
+      }
+      *scope = scopes[i].scope;
+      if (name) {
+         *name = tmp;
+      }
+      return true;
+   }
+   return false;
+}
+
+kbwork_t *kbwork_new (enum kbwork_scope_t scope, const char *id)
+{
+   kbwork_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      KBIERROR ("OOM allocating workspace for [%s]\n", id);
+      return NULL;
+   }
+   ret->lockfd = -1;
+   const char *kind = scope == kbwork_scope_RUN ? "/run-" : "/node-";
+   if (!(ret->prefix = ds_str_cat (g_root ? g_root : DEFAULT_ROOT, kind, id,
+                                   "XXXXXX", NULL))) {
+      KBIERROR ("OOM creating workspace name for [%s]\n", id);
+      free (ret);
+      return NULL;
+   }
+   return ret;
+}
+
+// Remove `name` in the directory `parent`, and everything in it if it is a
+// directory. Only directories are opened, and never through a symbolic link,
+// so nothing outside of `name` is removed.
+static bool remove_at (int parent, const char *name, bool isdir)
+{
+   bool error = false;
+
+   if (!isdir) {
+      if ((unlinkat (parent, name, 0)) == 0) {
+         return true;
+      }
+      if (errno != EISDIR) {
+         return false;
+      }
+   }
+
+   int fd = openat (parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+   if (fd < 0) {
+      return false;
+   }
+   DIR *dir = fdopendir (fd);
+   if (!dir) {
+      close (fd);
+      return false;
+   }
+
+   struct dirent *de;
+   while ((de = readdir (dir))) {
+      if ((strcmp (de->d_name, ".")) == 0 || (strcmp (de->d_name, "..")) == 0) {
+         continue;
+      }
+      // Filesystems that do not report the type are handled by the EISDIR
+      // check above.
+      if (!(remove_at (dirfd (dir), de->d_name, de->d_type == DT_DIR))) {
+         error = true;
+      }
+   }
+   closedir (dir);
+
+   if ((unlinkat (parent, name, AT_REMOVEDIR)) != 0) {
+      error = true;
+   }
+   return !error;
+}
+
+bool kbwork_remove (const char *path)
+{
+   return remove_at (AT_FDCWD, path, false);
+}
+
+bool kbwork_private_dir (const char *path, mode_t mode)
+{
+   struct stat sb;
+   int fd = -1;
+
+   if ((mkdir (path, mode)) != 0 && errno != EEXIST) {
+      KBXERROR ("Failed to create [%s]: %m\n", path);
+      return false;
+   }
+   if ((fd = open (path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0
+         || (fstat (fd, &sb)) != 0) {
+      KBXERROR ("Failed to open directory [%s]: %m\n", path);
+      if (fd >= 0) {
+         close (fd);
+      }
+      return false;
+   }
+   close (fd);
+
+   if (sb.st_uid != geteuid () || (sb.st_mode & (S_IWGRP | S_IWOTH))) {
+      KBXERROR ("Refusing to use [%s]: it must be owned by uid %u and not "
+                "writable by its group or others\n", path, (unsigned)geteuid ());
+      return false;
+   }
+   return true;
+}
+
+bool kbwork_make_parents (const char *path)
+{
+   char *tmp = ds_str_dup (path);
+   if (!tmp) {
+      return false;
+   }
+   for (char *p = strchr (&tmp[1], '/'); p; p = strchr (&p[1], '/')) {
+      *p = 0;
+      if ((mkdir (tmp, 0700)) != 0 && errno != EEXIST) {
+         free (tmp);
+         return false;
+      }
+      *p = '/';
+   }
+   free (tmp);
+   return true;
+}
+
+// The bytes allocated to `name` in the directory `parent`, and to everything
+// in it.
+static uint64_t usage_at (int parent, const char *name)
+{
+   struct stat sb;
+   if ((fstatat (parent, name, &sb, AT_SYMLINK_NOFOLLOW)) != 0) {
+      return 0;
+   }
+   uint64_t ret = (uint64_t)sb.st_blocks * 512;
+   if (!S_ISDIR (sb.st_mode)) {
+      return ret;
+   }
+
+   int fd = openat (parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+   if (fd < 0) {
+      return ret;
+   }
+   DIR *dir = fdopendir (fd);
+   if (!dir) {
+      close (fd);
+      return ret;
+   }
+   struct dirent *de;
+   while ((de = readdir (dir))) {
+      if ((strcmp (de->d_name, ".")) != 0 && (strcmp (de->d_name, "..")) != 0) {
+         ret += usage_at (dirfd (dir), de->d_name);
+      }
+   }
+   closedir (dir);
+   return ret;
+}
+
+uint64_t kbwork_usage (const char *path)
+{
+   return usage_at (AT_FDCWD, path);
+}
+
+struct lru_t {
+   char *name;
+   struct timespec used;
+   uint64_t size;
+};
+
+static int lru_cmp (const void *lhs, const void *rhs)
+{
+   const struct lru_t *l = lhs, *r = rhs;
+   if (l->used.tv_sec != r->used.tv_sec) {
+      return l->used.tv_sec < r->used.tv_sec ? -1 : 1;
+   }
+   if (l->used.tv_nsec != r->used.tv_nsec) {
+      return l->used.tv_nsec < r->used.tv_nsec ? -1 : 1;
+   }
+   return 0;
+}
+
+// Remove the least recently used persistent workspaces, other than `keep`,
+// until they take no more than the budget. The time of last use is the
+// modification time of the lock file, which is never removed, so that a run
+// waiting on a lock is never left holding the lock of a removed file.
+static void evict (const char *keep)
+{
+   char *pdir = NULL;
+   DIR *dir = NULL;
+   struct lru_t *lru = NULL;
+   size_t nlru = 0, cap = 0;
+   uint64_t total = 0;
+
+   if (!g_budget) {
+      return;
+   }
+
+   pthread_mutex_lock (&g_evict_lock);
+
+   if (!(persistent_dir (&pdir)) || !(dir = opendir (pdir))) {
+      goto cleanup;
+   }
+
+   struct dirent *de;
+   while ((de = readdir (dir))) {
+      size_t len = strlen (de->d_name);
+      if (len <= sizeof LOCK_SUFFIX - 1
+            || (strcmp (&de->d_name[len - (sizeof LOCK_SUFFIX - 1)], LOCK_SUFFIX)) != 0) {
+         continue;
+      }
+      struct stat sb;
+      if ((fstatat (dirfd (dir), de->d_name, &sb, 0)) != 0) {
+         continue;
+      }
+      if (nlru >= cap) {
+         size_t newcap = cap ? cap * 2 : 16;
+         struct lru_t *tmp = realloc (lru, newcap * sizeof *tmp);
+         if (!tmp) {
+            KBIERROR ("OOM listing persistent workspaces\n");
+            goto cleanup;
+         }
+         lru = tmp;
+         cap = newcap;
+      }
+      char *name = ds_str_dup (de->d_name);
+      if (!name) {
+         KBIERROR ("OOM listing persistent workspaces\n");
+         goto cleanup;
+      }
+      name[len - (sizeof LOCK_SUFFIX - 1)] = 0;
+      lru[nlru].name = name;
+      lru[nlru].used = sb.st_mtim;
+      lru[nlru].size = usage_at (dirfd (dir), name);
+      total += lru[nlru].size;
+      nlru++;
+   }
+
+   qsort (lru, nlru, sizeof *lru, lru_cmp);
+
+   for (size_t i=0; i<nlru && total > g_budget; i++) {
+      if (!lru[i].size || (keep && (strcmp (lru[i].name, keep)) == 0)) {
+         continue;
+      }
+      // A workspace that is in use is skipped; the lock is held while it is
+      // removed, so that the next run waits for it to go.
+      char *lockname = ds_str_cat (lru[i].name, LOCK_SUFFIX, NULL);
+      int fd = lockname ? openat (dirfd (dir), lockname, O_RDWR | O_CLOEXEC) : -1;
+      free (lockname);
+      if (fd < 0) {
+         continue;
+      }
+      if ((flock (fd, LOCK_EX | LOCK_NB)) == 0) {
+         KBWARN ("Evicting persistent workspace [%s] (%" PRIu64 " bytes) to "
+                 "stay within the budget of %" PRIu64 " bytes\n",
+                 lru[i].name, lru[i].size, g_budget);
+         if (!(remove_at (dirfd (dir), lru[i].name, true))) {
+            KBWARN ("Failed to remove persistent workspace [%s/%s]: %m\n",
+                    pdir, lru[i].name);
+         }
+         total -= lru[i].size;
+      }
+      close (fd);
+   }
+   if (total > g_budget) {
+      KBWARN ("Persistent workspaces take %" PRIu64 " bytes, more than the "
+              "budget of %" PRIu64 " bytes\n", total, g_budget);
+   }
+
+cleanup:
+   for (size_t i=0; i<nlru; i++) {
+      free (lru[i].name);
+   }
+   free (lru);
+   if (dir) {
+      closedir (dir);
+   }
+   free (pdir);
+   pthread_mutex_unlock (&g_evict_lock);
+}
+
+void kbwork_del (kbwork_t *work)
+{
+   if (!work) {
+      return;
+   }
+
+   while (work->persistent) {
+      kbwork_t *next = work->persistent->next;
+      kbwork_del (work->persistent);
+      work->persistent = next;
+   }
+
+   if (work->name) {
+      // Kept for the next run; only its time of use changes
+      if (work->lockfd >= 0) {
+         futimens (work->lockfd, NULL);
+         close (work->lockfd);
+         evict (work->name);
+      }
+   } else if (work->path && !(kbwork_remove (work->path))) {
+      KBWARN ("Failed to remove workspace [%s]: %m (remove it manually)\n",
+              work->path);
+   }
+   free (work->name);
+   free (work->path);
+   free (work->prefix);
+   free (work);
+}
+
+kbwork_t *kbwork_persistent (kbwork_t *run, const char *name)
+{
+   kbwork_t **last = &run->persistent;
+   for (kbwork_t *w=run->persistent; w; w=w->next) {
+      if ((strcmp (w->name, name)) == 0) {
+         return w;
+      }
+      last = &w->next;
+   }
+
+   kbwork_t *ret = calloc (1, sizeof *ret);
+   if (!ret || !(ret->name = ds_str_dup (name))) {
+      KBIERROR ("OOM allocating persistent workspace [%s]\n", name);
+      free (ret);
+      return NULL;
+   }
+   ret->lockfd = -1;
+   *last = ret;
+   return ret;
+}
+
+kbwork_t *kbwork_clone (kbwork_t *run, const char *id, const char *name,
+                        bool link)
+{
+   kbwork_t *source = kbwork_persistent (run, name);
+   if (!source) {
+      return NULL;
+   }
+   kbwork_t *ret = kbwork_new (kbwork_scope_NODE, id);
+   if (ret) {
+      ret->source = source;
+      ret->link = link;
+   }
+   return ret;
+}
+
+// How the files of a clone are copied. A method that fails is not tried again
+// for the rest of the clone, as it failed because of the filesystem.
+struct copy_t {
+   bool link;
+   bool noreflink;
+   bool nocopyrange;
+   uid_t uid;
+   gid_t gid;
+};
+
+static bool copy_data (struct copy_t *c, int src, int dst, off_t size)
+{
+   if (!c->noreflink) {
+      if ((ioctl (dst, FICLONE, src)) == 0) {
+         return true;
+      }
+      c->noreflink = true;
+   }
+
+   off_t left = size;
+   while (!c->nocopyrange && left > 0) {
+      ssize_t nbytes = copy_file_range (src, NULL, dst, NULL, (size_t)left, 0);
+      if (nbytes < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP
+               && errno != EINVAL) {
+            return false;
+         }
+         c->nocopyrange = true;
+      } else if (nbytes == 0) {
+         // The file shrank
+         return true;
+      } else {
+         left -= nbytes;
+      }
+   }
+
+   // Continues from where copy_file_range() left the offsets
+   char buf[64 * 1024];
+   while (true) {
+      ssize_t nbytes = read (src, buf, sizeof buf);
+      if (nbytes < 0 && errno == EINTR) {
+         continue;
+      }
+      if (nbytes <= 0) {
+         return nbytes == 0;
+      }
+      for (ssize_t done = 0; done < nbytes; ) {
+         ssize_t rc = write (dst, &buf[done], (size_t)(nbytes - done));
+         if (rc < 0) {
+            if (errno == EINTR) {
+               continue;
+            }
+            return false;
+         }
+         done += rc;
+      }
+   }
+}
+
+// Give the copy `fd` (or `name` in `dir`, for symbolic links) of an entry
+// the owner of the workspace, and the mode and times of the original. The
+// times matter to the tools that rebuild what is out of date.
+static bool copy_attrs (struct copy_t *c, int fd, int dir, const char *name,
+                        const struct stat *sb)
+{
+   const struct timespec times[2] = { sb->st_atim, sb->st_mtim };
+   bool owner = c->uid != (uid_t)-1 || c->gid != (gid_t)-1;
+
+   if (fd < 0) {
+      return (!owner || (fchownat (dir, name, c->uid, c->gid, AT_SYMLINK_NOFOLLOW)) == 0)
+            && (utimensat (dir, name, times, AT_SYMLINK_NOFOLLOW)) == 0;
+   }
+   // After the chown, which clears the set-user-ID and set-group-ID bits
+   return (!owner || (fchown (fd, c->uid, c->gid)) == 0)
+         && (fchmod (fd, sb->st_mode & 07777)) == 0
+         && (futimens (fd, times)) == 0;
+}
+
+static bool clone_dir (struct copy_t *c, int src, int dst);
+
+// Copy `sname` in the directory `src` to `dname` in the directory `dst`.
+// Entries other than directories, regular files and symbolic links are not
+// copied.
+static bool clone_at (struct copy_t *c, int src, const char *sname,
+                      int dst, const char *dname)
+{
+   struct stat sb;
+   bool error = true;
+   int sfd = -1, dfd = -1;
+   char *target = NULL;
+
+   if ((fstatat (src, sname, &sb, AT_SYMLINK_NOFOLLOW)) != 0) {
+      return false;
+   }
+
+   if (S_ISDIR (sb.st_mode)) {
+      if ((mkdirat (dst, dname, 0700)) != 0
+            || (sfd = openat (src, sname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0
+            || (dfd = openat (dst, dname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0
+            || !(clone_dir (c, sfd, dfd))
+            || !(copy_attrs (c, dfd, dst, dname, &sb))) {
+         goto cleanup;
+      }
+
+   } else if (S_ISLNK (sb.st_mode)) {
+      size_t len = (size_t)sb.st_size + 1;
+      ssize_t nbytes;
+      if (!(target = malloc (len))
+            || (nbytes = readlinkat (src, sname, target, len)) < 0
+            || (size_t)nbytes >= len) {
+         goto cleanup;
+      }
+      target[nbytes] = 0;
+      if ((symlinkat (target, dst, dname)) != 0
+            || !(copy_attrs (c, -1, dst, dname, &sb))) {
+         goto cleanup;
+      }
+
+   } else if (S_ISREG (sb.st_mode)) {
+      if (c->link) {
+         if ((linkat (src, sname, dst, dname, 0)) != 0) {
+            goto cleanup;
+         }
+      } else if ((sfd = openat (src, sname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0
+            || (dfd = openat (dst, dname, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0
+            || !(copy_data (c, sfd, dfd, sb.st_size))
+            || !(copy_attrs (c, dfd, dst, dname, &sb))) {
+         goto cleanup;
+      }
+   }
+
+   error = false;
+cleanup:
+   free (target);
+   if (sfd >= 0) {
+      close (sfd);
+   }
+   if (dfd >= 0) {
+      close (dfd);
+   }
+   return !error;
+}
+
+// Copy everything in the directory `src` to the directory `dst`. Takes
+// ownership of neither descriptor.
+static bool clone_dir (struct copy_t *c, int src, int dst)
+{
+   bool error = false;
+   int fd = dup (src);
+   DIR *dir = fd < 0 ? NULL : fdopendir (fd);
+   if (!dir) {
+      if (fd >= 0) {
+         close (fd);
+      }
+      return false;
+   }
+
+   struct dirent *de;
+   while (!error && (de = readdir (dir))) {
+      if ((strcmp (de->d_name, ".")) != 0 && (strcmp (de->d_name, "..")) != 0) {
+         error = !(clone_at (c, dirfd (dir), de->d_name, dst, de->d_name));
+      }
+   }
+   closedir (dir);
+   return !error;
+}
+
+bool kbwork_copy (const char *src, const char *dst, uid_t uid, gid_t gid)
+{
+   struct copy_t c = { false, false, false, uid, gid };
+   return clone_at (&c, AT_FDCWD, src, AT_FDCWD, dst);
+}
+
+// Fill the new workspace `path` of the clone `work` from its source.
+static bool clone_fill (kbwork_t *work, const char *path, uid_t uid, gid_t gid)
+{
+   struct copy_t c = { work->link, false, false, uid, gid };
+   int src = -1, dst = -1;
+   bool error = true;
+
+   const char *spath = kbwork_path (work->source, uid, gid);
+   if (!spath) {
+      return false;
+   }
+   if ((src = open (spath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0
+         || (dst = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0
+         || !(clone_dir (&c, src, dst))) {
+      KBXERROR ("Failed to clone workspace [%s] into [%s]: %m\n", spath, path);
+      goto cleanup;
+   }
+
+   error = false;
+cleanup:
+   if (src >= 0) {
+      close (src);
+   }
+   if (dst >= 0) {
+      close (dst);
+   }
+   return !error;
+}
+
+// Lock the persistent workspace, waiting for the run that is using it to end
+// unless `cancel` fires first.
+static bool persistent_lock (kbwork_t *work, kbcancel_t *cancel)
+{
+   char *pdir = NULL;
+   char *lockname = NULL;
+   int fd = -1;
+   bool warned = false;
+   bool error = true;
+
+   if (!(persistent_dir (&pdir))) {
+      goto cleanup;
+   }
+   if (!(lockname = ds_str_cat (pdir, "/", work->name, LOCK_SUFFIX, NULL))) {
+      KBIERROR ("OOM creating name of persistent workspace [%s]\n", work->name);
+      goto cleanup;
+   }
+
+   if ((fd = open (lockname, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0) {
+      KBXERROR ("Failed to open [%s]: %m\n", lockname);
+      goto cleanup;
+   }
+   while ((flock (fd, LOCK_EX | LOCK_NB)) != 0) {
+      if (errno != EWOULDBLOCK && errno != EINTR) {
+         KBXERROR ("Failed to lock [%s]: %m\n", lockname);
+         goto cleanup;
+      }
+      if (!warned) {
+         KBWARN ("Persistent workspace [%s] is in use, waiting for it\n", work->name);
+         warned = true;
+      }
+      if (kbcancel_wait (cancel, LOCK_POLL_MS)) {
+         KBWARN ("Stopped waiting for persistent workspace [%s], run was "
+                 "cancelled\n", work->name);
+         goto cleanup;
+      }
+   }
+
+   work->lockfd = fd;
+   fd = -1;
+   error = false;
+
+cleanup:
+   if (fd >= 0) {
+      close (fd);
+   }
+   free (lockname);
+   free (pdir);
+   return !error;
+}
+
+static int name_cmp (const void *lhs, const void *rhs)
+{
+   const kbwork_t *const *l = lhs;
+   const kbwork_t *const *r = rhs;
+   return strcmp ((*l)->name, (*r)->name);
+}
+
+bool kbwork_lock (kbwork_t *run, kbcancel_t *cancel)
+{
+   kbwork_t **works = NULL;
+   size_t nworks = 0;
+   bool error = true;
+
+   for (kbwork_t *w=run->persistent; w; w=w->next) {
+      nworks++;
+   }
+   if (!nworks) {
+      return true;
+   }
+   if (!(works = malloc (nworks * sizeof *works))) {
+      KBIERROR ("OOM allocating list of persistent workspaces\n");
+      return false;
+   }
+   nworks = 0;
+   for (kbwork_t *w=run->persistent; w; w=w->next) {
+      works[nworks++] = w;
+   }
+
+   // Every run takes its locks in the order of their names, so that no two
+   // runs can each hold a lock that the other is waiting for.
+   qsort (works, nworks, sizeof *works, name_cmp);
+   for (size_t i=0; i<nworks; i++) {
+      if (works[i]->lockfd < 0 && !(persistent_lock (works[i], cancel))) {
+         goto cleanup;
+      }
+   }
+   error = false;
+
+cleanup:
+   for (size_t i=0; error && i<nworks; i++) {
+      if (works[i]->lockfd >= 0) {
+         close (works[i]->lockfd);
+         works[i]->lockfd = -1;
+      }
+   }
+   free (works);
+   return !error;
+}
+
+// Create the directory of the persistent workspace, which the run has locked,
+// if it is not there (because it is new, or was evicted).
+static const char *persistent_path (kbwork_t *work, uid_t uid, gid_t gid)
+{
+   char *pdir = NULL;
+   char *path = NULL;
+   bool error = true;
+
+   if (work->lockfd < 0) {
+      KBXERROR ("Persistent workspace [%s] was not locked by its run\n", work->name);
+      goto cleanup;
+   }
+   if (!(persistent_dir (&pdir))) {
+      goto cleanup;
+   }
+   if (!(path = ds_str_cat (pdir, "/", work->name, NULL))) {
+      KBIERROR ("OOM creating name of persistent workspace [%s]\n", work->name);
+      goto cleanup;
+   }
+
+   if ((mkdir (path, 0755)) == 0) {
+      if ((chown (path, uid, gid)) != 0) {
+         KBXERROR ("Failed to change ownership of workspace [%s]: %m\n", path);
+         rmdir (path);
+         goto cleanup;
+      }
+   } else {
+      struct stat sb;
+      if (errno != EEXIST || (lstat (path, &sb)) != 0 || !S_ISDIR (sb.st_mode)) {
+         KBXERROR ("Failed to create workspace [%s]: %m\n", path);
+         goto cleanup;
+      }
+   }
+
+   work->path = path;
+   path = NULL;
+   error = false;
+
+cleanup:
+   free (path);
+   free (pdir);
+   return error ? NULL : work->path;
+}
+
+const char *kbwork_path (kbwork_t *work, uid_t uid, gid_t gid)
+{
+   if (work->path) {
+      return work->path;
+   }
+   if (work->name) {
+      return persistent_path (work, uid, gid);
+   }
+
+   char *path = ds_str_dup (work->prefix);
+   if (!path) {
+      KBIERROR ("OOM copying workspace name [%s]\n", work->prefix);
+      return NULL;
+   }
+   if (!(mkdtemp (path))) {
+      KBXERROR ("Failed to create workspace [%s]: %m\n", path);
+      free (path);
+      return NULL;
+   }
+   // The manpage specifies that user ownership remains unchanged if
+   // specified as (uid_t)-1 and group ownership remains unchanged if
+   // specified as (gid_t)-1.
+   if ((chown (path, uid, gid)) != 0) {
+      KBXERROR ("Failed to change ownership of workspace [%s]: %m\n", path);
+      rmdir (path);
+      free (path);
+      return NULL;
+   }
+   if (work->source && !(clone_fill (work, path, uid, gid))) {
+      kbwork_remove (path);
+      free (path);
+      return NULL;
+   }
+   work->path = path;
+   return path;
+}
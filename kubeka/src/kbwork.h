@@ -0,0 +1,122 @@
+
+#ifndef H_KBWORK
+#define H_KBWORK
+
+// Workspaces: the temporary directories that commands run in when their node
+// sets no DIRECTORY. A workspace is only created when the first command needs
+// it, and is shared by all the commands of its node, or by all the commands of
+// a run for nodes with `WORKSPACE = run`. Workspaces are created under a root
+// directory (/tmp unless set), which may be a tmpfs mounted with a size quota,
+// and are removed without starting a process.
+//
+// Nodes with `WORKSPACE = persistent:<name>` instead share the workspace
+// <root>/kubeka-persistent/<name>, which is kept across runs so that builds
+// in it can be incremental. A run that uses one holds a lock on it (a flock()
+// on <name>.lock next to it) from before its first node starts until it ends,
+// so that no two runs use it at the same time, whether in this process or
+// another. When the persistent
+// workspaces take more than the budget, the least recently used ones that are
+// not locked are removed. As the root may be shared with other users (/tmp
+// is), kubeka-persistent must be owned by this process and writable by no one
+// else, or persistent workspaces are refused.
+//
+// Nodes with `WORKSPACE = clone:<name>` get a workspace of their own that
+// starts as a copy of the persistent workspace <name>, so that several jobs
+// (test shards, for example) can start from one prepared tree. Files are
+// cloned with FICLONE where the filesystem shares extents, and copied with
+// copy_file_range() (which the kernel may still do without moving the bytes
+// through memory) where it does not. With `WORKSPACE = link:<name>` files are
+// hard links to those of <name> instead, which is cheaper on any filesystem,
+// but is only safe for commands that replace files rather than modify them.
+
+// The value of the WORKSPACE key of a node.
+enum kbwork_scope_t {
+   kbwork_scope_NODE = 0,  // Key not set: one workspace for the node
+   kbwork_scope_RUN,       // One workspace for the whole run of the tree
+   kbwork_scope_PERSISTENT,// A named workspace that is kept across runs
+   kbwork_scope_CLONE,     // A copy of a persistent workspace
+   kbwork_scope_LINK,      // A hard link farm of a persistent workspace
+};
+
+typedef struct kbwork_t kbwork_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Create workspaces under `dir`, or under /tmp again if `dir` is NULL. If
+   // `quota` is not 0, a tmpfs of `quota` bytes is mounted on `dir` (which is
+   // created if necessary) and unmounted when the root is changed again. If
+   // the tmpfs cannot be mounted, workspaces are created in `dir` without a
+   // quota. Must be called before any workspace is created.
+   bool kbwork_set_root (const char *dir, size_t quota);
+
+   // Limit the total size of the persistent workspaces to `budget` bytes, or
+   // lift the limit if it is 0.
+   void kbwork_set_budget (uint64_t budget);
+
+   // Parse a value of the WORKSPACE key. Returns false if it is not one of
+   // `node`, `run`, `persistent:<name>`, `clone:<name>` or `link:<name>`,
+   // where the name is made of letters, digits, `-` and `_`. For the named
+   // scopes `*name` (if `name` is not NULL) is set to the name within `value`.
+   bool kbwork_scope (const char *value, enum kbwork_scope_t *scope,
+                      const char **name);
+
+   // A workspace for the node (or the root of the run) `id`. Its directory is
+   // created by kbwork_path(), and removed by kbwork_del(). Deleting the
+   // workspace of a run also unlocks the persistent workspaces of the run.
+   kbwork_t *kbwork_new (enum kbwork_scope_t scope, const char *id);
+   void kbwork_del (kbwork_t *work);
+
+   // The persistent workspace `name`, for the run whose workspace is `run`.
+   // It belongs to `run`, and must be locked with kbwork_lock() before its
+   // path is used.
+   kbwork_t *kbwork_persistent (kbwork_t *run, const char *name);
+
+   // Lock all the persistent workspaces of the run `run`, in the order of
+   // their names, waiting for the runs that use them to end. Returns false,
+   // holding none of them, if one could not be locked or if `cancel` fired
+   // while waiting.
+   bool kbwork_lock (kbwork_t *run, kbcancel_t *cancel);
+
+   // A workspace for the node `id` that is filled with a copy of the
+   // persistent workspace `name` of the run `run` (or hard links to its
+   // files, if `link` is set) when it is created. The caller deletes it, which
+   // leaves the persistent workspace as it is.
+   kbwork_t *kbwork_clone (kbwork_t *run, const char *id, const char *name,
+                           bool link);
+
+   // The directory of the workspace, created owned by `uid` and `gid` (either
+   // may be -1 to leave it unchanged) if it does not exist yet. Returns NULL
+   // if it could not be created.
+   const char *kbwork_path (kbwork_t *work, uid_t uid, gid_t gid);
+
+   // Remove the file or directory `path` and everything in it, without
+   // following symbolic links.
+   bool kbwork_remove (const char *path);
+
+   // Create the directory `path` with `mode` if it does not exist, and check
+   // that it is a directory (and not a symbolic link to one) that is owned by
+   // the effective user of this process and cannot be written by anyone else,
+   // so that nobody else can have prepared what is in it. Returns false,
+   // after reporting why, if it is not.
+   bool kbwork_private_dir (const char *path, mode_t mode);
+
+   // Create the directories above `path`, up to (and not including) its last
+   // component.
+   bool kbwork_make_parents (const char *path);
+
+   // Copy the file or directory `src` to `dst`, which must not exist, as the
+   // files of a clone are copied, owned by `uid` and `gid` as above.
+   bool kbwork_copy (const char *src, const char *dst, uid_t uid, gid_t gid);
+
+   // The bytes allocated to `path` and everything in it.
+   uint64_t kbwork_usage (const char *path);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -0,0 +1,445 @@
+
+// For pipe2()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <grp.h>
+
+#include "kbutil.h"
+#include "kbctx.h"
+#include "kbzygote.h"
+
+extern char **environ;
+
+// Requests larger than this are refused by the client, which then spawns the
+// command itself.
+#define REQUEST_MAX     (128 * 1024)
+
+// A request is this header followed by the supplementary groups, then by the
+// command, the working directory and the environment, each string terminated
+// by a nul byte.
+struct request_t {
+   uint32_t uid;
+   uint32_t gid;
+   uint32_t ngroups;
+   uint32_t nenv;
+   uint32_t len;
+};
+
+struct reply_t {
+   int32_t status;
+   int32_t error;
+};
+
+static int g_sock = -1;
+static pid_t g_pid = -1;
+
+static bool write_all (int fd, const void *buf, size_t len)
+{
+   const uint8_t *src = buf;
+   while (len) {
+      ssize_t nbytes = write (fd, src, len);
+      if (nbytes < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return false;
+      }
+      src += nbytes;
+      len -= (size_t)nbytes;
+   }
+   return true;
+}
+
+static bool read_all (int fd, void *buf, size_t len)
+{
+   uint8_t *dst = buf;
+   while (len) {
+      ssize_t nbytes = read (fd, dst, len);
+      if (nbytes < 0 && errno == EINTR) {
+         continue;
+      }
+      if (nbytes <= 0) {
+         return false;
+      }
+      dst += nbytes;
+      len -= (size_t)nbytes;
+   }
+   return true;
+}
+
+static void reply (int fd, int status, int error)
+{
+   struct reply_t r = { status, error };
+   write_all (fd, &r, sizeof r);
+}
+
+/* ************************************************************************
+ * The zygote side. The runner for a request starts the shell, so that the
+ * zygote itself never waits on anything but the next request.
+ */
+
+static void runner (const char *buf, size_t len, int infd, int outfd,
+                    int replyfd)
+{
+   const struct request_t *req = (const struct request_t *)buf;
+   const char **envp = NULL;
+   gid_t *groups = NULL;
+   int errfds[2] = { -1, -1 };
+   int error = 0;
+
+   signal (SIGCHLD, SIG_DFL);
+
+   // Unpack the request. Every string must be terminated inside the buffer.
+   const char *cursor = buf + sizeof *req;
+   const char *end = buf + len;
+   const char *strings[2] = { NULL, NULL };
+   if (req->ngroups > (len - sizeof *req) / sizeof *groups) {
+      reply (replyfd, -1, EINVAL);
+      _exit (EXIT_FAILURE);
+   }
+   if (!(groups = calloc (req->ngroups + 1, sizeof *groups))
+         || !(envp = calloc (req->nenv + 1, sizeof *envp))) {
+      reply (replyfd, -1, ENOMEM);
+      _exit (EXIT_FAILURE);
+   }
+   memcpy (groups, cursor, req->ngroups * sizeof *groups);
+   cursor += req->ngroups * sizeof *groups;
+   for (size_t i=0; i<2 + req->nenv; i++) {
+      const char *nul = cursor < end ? memchr (cursor, 0, (size_t)(end - cursor)) : NULL;
+      if (!nul) {
+         reply (replyfd, -1, EINVAL);
+         _exit (EXIT_FAILURE);
+      }
+      if (i < 2) {
+         strings[i] = cursor;
+      } else {
+         envp[i - 2] = cursor;
+      }
+      cursor = nul + 1;
+   }
+
+   // The shell reports a failure before execve() on this pipe, which is
+   // closed without any data by a successful execve().
+   if ((pipe2 (errfds, O_CLOEXEC)) != 0) {
+      reply (replyfd, -1, errno);
+      _exit (EXIT_FAILURE);
+   }
+
+   pid_t pid = fork ();
+   if (pid < 0) {
+      reply (replyfd, -1, errno);
+      _exit (EXIT_FAILURE);
+   }
+
+   if (pid == 0) {
+      char *argv[] = { (char *)"sh", (char *)"-c", (char *)strings[0], NULL };
+      signal (SIGINT, SIG_DFL);
+      signal (SIGPIPE, SIG_DFL);
+      // Each command leads its own process group, as those spawned by kbexec
+      setpgid (0, 0);
+      close (errfds[0]);
+      close (replyfd);
+      if ((infd >= 0 && (dup2 (infd, STDIN_FILENO)) < 0)
+            || (dup2 (outfd, STDOUT_FILENO)) < 0
+            || (close (outfd)) != 0
+            || (chdir (strings[1])) != 0
+            || (req->uid != (uint32_t)-1 && (setgroups (req->ngroups, groups)) != 0)
+            || (req->gid != (uint32_t)-1 && (setgid ((gid_t)req->gid)) != 0)
+            || (req->uid != (uint32_t)-1 && (setuid ((uid_t)req->uid)) != 0)) {
+         error = errno;
+      } else {
+         execve ("/bin/sh", argv, (char **)envp);
+         error = errno;
+      }
+      write_all (errfds[1], &error, sizeof error);
+      _exit (127);
+   }
+
+   close (errfds[1]);
+   close (outfd);
+   if ((read_all (errfds[0], &error, sizeof error))) {
+      waitpid (pid, NULL, 0);
+      reply (replyfd, -1, error);
+      _exit (EXIT_FAILURE);
+   }
+
+   // The daemon signals the process group of the shell on cancellation.
+   reply (replyfd, pid, 0);
+
+   int status = 0;
+   while ((waitpid (pid, &status, 0)) < 0) {
+      if (errno != EINTR) {
+         reply (replyfd, -1, errno);
+         _exit (EXIT_FAILURE);
+      }
+   }
+   reply (replyfd, status, 0);
+   _exit (EXIT_SUCCESS);
+}
+
+static void zygote (int sock)
+{
+   // Runners are reaped automatically; the daemon handles SIGINT and the
+   // zygote exits when the daemon closes its end of the socket.
+   signal (SIGCHLD, SIG_IGN);
+   signal (SIGINT, SIG_IGN);
+   signal (SIGPIPE, SIG_IGN);
+
+   char *buf = malloc (REQUEST_MAX);
+   if (!buf) {
+      _exit (EXIT_FAILURE);
+   }
+
+   while (true) {
+      union {
+         struct cmsghdr hdr;
+         char buf[CMSG_SPACE (3 * sizeof (int))];
+      } control;
+      struct iovec iov = { buf, REQUEST_MAX };
+      struct msghdr msg;
+      memset (&msg, 0, sizeof msg);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof control.buf;
+
+      ssize_t nbytes = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC);
+      if (nbytes < 0 && errno == EINTR) {
+         continue;
+      }
+      if (nbytes <= 0) {
+         break;
+      }
+
+      // The output and reply descriptors, and the stdin of the command if
+      // it has one.
+      int fds[3] = { -1, -1, -1 };
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+      if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+            && (cmsg->cmsg_len == CMSG_LEN (2 * sizeof (int))
+               || cmsg->cmsg_len == CMSG_LEN (3 * sizeof (int)))) {
+         memcpy (fds, CMSG_DATA (cmsg), cmsg->cmsg_len - CMSG_LEN (0));
+      }
+      if (fds[0] < 0 || fds[1] < 0) {
+         if (fds[2] >= 0) {
+            close (fds[2]);
+         }
+         continue;
+      }
+
+      if ((size_t)nbytes < sizeof (struct request_t)
+            || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+         reply (fds[1], -1, EINVAL);
+      } else {
+         pid_t pid = fork ();
+         if (pid == 0) {
+            close (sock);
+            runner (buf, (size_t)nbytes, fds[2], fds[0], fds[1]);
+         }
+         if (pid < 0) {
+            reply (fds[1], -1, errno);
+         }
+      }
+      close (fds[0]);
+      close (fds[1]);
+      if (fds[2] >= 0) {
+         close (fds[2]);
+      }
+   }
+
+   _exit (EXIT_SUCCESS);
+}
+
+/* ************************************************************************
+ * The daemon side.
+ */
+
+bool kbzygote_start (void)
+{
+   int sv[2];
+
+   if (g_sock >= 0) {
+      return true;
+   }
+
+   if ((socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) != 0) {
+      KBXERROR ("Failed to create zygote socket: %m\n");
+      return false;
+   }
+
+   pid_t pid = fork ();
+   if (pid < 0) {
+      KBXERROR ("Failed to start zygote: %m\n");
+      close (sv[0]);
+      close (sv[1]);
+      return false;
+   }
+   if (pid == 0) {
+      close (sv[0]);
+      zygote (sv[1]);
+   }
+
+   close (sv[1]);
+   g_sock = sv[0];
+   g_pid = pid;
+   return true;
+}
+
+void kbzygote_stop (void)
+{
+   if (g_sock < 0) {
+      return;
+   }
+   close (g_sock);
+   g_sock = -1;
+   while ((waitpid (g_pid, NULL, 0)) < 0 && errno == EINTR)
+      ;
+   g_pid = -1;
+}
+
+bool kbzygote_running (void)
+{
+   return g_sock >= 0;
+}
+
+int kbzygote_spawn (const char *command, const char *wdir, const kbctx_t *ctx,
+                    char *const *envp, int infd, int outfd)
+{
+   const kbctx_t self = KBCTX_INIT;
+   if (!ctx) {
+      ctx = &self;
+   }
+   struct request_t req = { (uint32_t)ctx->uid, (uint32_t)ctx->gid,
+                            (uint32_t)ctx->ngroups, 0, 0 };
+   char *buf = NULL;
+   int rp[2] = { -1, -1 };
+   int ret = -1;
+
+   if (g_sock < 0) {
+      errno = ENOTCONN;
+      return -1;
+   }
+
+   // The environment is sent with every request, as each node can have its
+   // own.
+   if (!envp) {
+      envp = environ;
+   }
+   size_t len = sizeof req + ctx->ngroups * sizeof *ctx->groups
+              + strlen (command) + 1 + strlen (wdir) + 1;
+   for (size_t i=0; envp && envp[i]; i++) {
+      len += strlen (envp[i]) + 1;
+      req.nenv++;
+   }
+   if (len > REQUEST_MAX) {
+      errno = E2BIG;
+      return -1;
+   }
+   req.len = (uint32_t)len;
+
+   if (!(buf = malloc (len))) {
+      return -1;
+   }
+   char *cursor = buf;
+   memcpy (cursor, &req, sizeof req);
+   cursor += sizeof req;
+   if (ctx->ngroups) {
+      memcpy (cursor, ctx->groups, ctx->ngroups * sizeof *ctx->groups);
+      cursor += ctx->ngroups * sizeof *ctx->groups;
+   }
+   cursor = stpcpy (cursor, command) + 1;
+   cursor = stpcpy (cursor, wdir) + 1;
+   for (size_t i=0; envp && envp[i]; i++) {
+      cursor = stpcpy (cursor, envp[i]) + 1;
+   }
+
+   if ((socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, rp)) != 0) {
+      goto cleanup;
+   }
+
+   int fds[3] = { outfd, rp[1], infd };
+   size_t nfds = infd >= 0 ? 3 : 2;
+   union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE (sizeof fds)];
+   } control;
+   memset (&control, 0, sizeof control);
+   struct iovec iov = { buf, len };
+   struct msghdr msg;
+   memset (&msg, 0, sizeof msg);
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control.buf;
+   msg.msg_controllen = CMSG_SPACE (nfds * sizeof *fds);
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN (nfds * sizeof *fds);
+   memcpy (CMSG_DATA (cmsg), fds, nfds * sizeof *fds);
+
+   // A single datagram, so requests from several threads never interleave.
+   ssize_t nbytes;
+   while ((nbytes = sendmsg (g_sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+      ;
+   if (nbytes < 0) {
+      goto cleanup;
+   }
+
+   ret = rp[0];
+   rp[0] = -1;
+
+cleanup:
+   free (buf);
+   if (rp[0] >= 0) {
+      int saved = errno;
+      close (rp[0]);
+      errno = saved;
+   }
+   if (rp[1] >= 0) {
+      close (rp[1]);
+   }
+   return ret;
+}
+
+pid_t kbzygote_started (int replyfd)
+{
+   struct reply_t r = { -1, EPIPE };
+   if (!(read_all (replyfd, &r, sizeof r))) {
+      r.status = -1;
+      r.error = EPIPE;
+   }
+   if (r.status < 0) {
+      errno = r.error;
+      return -1;
+   }
+   return (pid_t)r.status;
+}
+
+int kbzygote_wait (int replyfd)
+{
+   struct reply_t r = { -1, EPIPE };
+   if (!(read_all (replyfd, &r, sizeof r))) {
+      r.status = -1;
+      r.error = EPIPE;
+   }
+   close (replyfd);
+   if (r.status < 0) {
+      errno = r.error;
+      return -1;
+   }
+   return r.status;
+}
+
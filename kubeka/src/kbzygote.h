@@ -0,0 +1,51 @@
+
+#ifndef H_KBZYGOTE
+#define H_KBZYGOTE
+
+// The zygote is a small helper process, forked before any configuration is
+// loaded, that spawns commands on behalf of the daemon. As it never grows, the
+// cost of its fork() stays the same however large the daemon becomes.
+//
+// Each request carries the command, working directory, user and environment,
+// and passes the write end of the output pipe with SCM_RIGHTS. The zygote
+// forks a runner for the request, which starts the shell, waits for it and
+// sends its pid and then its wait status back on a reply socket that is also
+// passed with the request.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Start the zygote. This must be called while the process is still small,
+   // and before any threads are started. Stopping the zygote closes the
+   // socket, upon which the zygote exits.
+   bool kbzygote_start (void);
+   void kbzygote_stop (void);
+   bool kbzygote_running (void);
+
+   // Ask the zygote to run `command` with its stdout on `outfd`, with the
+   // credentials `ctx` and in the environment `envp` (those of this process
+   // if they are NULL), and with `infd` as its stdin (that of the zygote if
+   // it is -1). Returns the socket on which the result will arrive,
+   // or -1 if the request could not be sent (in which case the caller can run
+   // the command itself).
+   int kbzygote_spawn (const char *command, const char *wdir, const kbctx_t *ctx,
+                       char *const *envp, int infd, int outfd);
+
+   // Wait until the shell of a request has started, and return its pid,
+   // which leads its own process group. Returns -1 (with errno set) if it
+   // could not be started; kbzygote_wait() must still be called.
+   pid_t kbzygote_started (int reply);
+
+   // Wait for the result of a request, and close the `reply` socket. Returns
+   // the wait status of the command, or -1 (with errno set) if it could not
+   // be run.
+   int kbzygote_wait (int reply);
+
+#ifdef __cplusplus
+};
+#endif
+
+
+#endif
+
@@ -9,18 +9,40 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <time.h>
+
+#include <pthread.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "ds_array.h"
 #include "ds_set.h"
 #include "ds_str.h"
 
 #include "kbnode.h"
+#include "kbindex.h"
+#include "kblint.h"
 #include "kbsym.h"
 #include "kbtree.h"
+#include "kbcancel.h"
 #include "kbbi.h"
+#include "kbutil.h"
+#include "kbcmd.h"
+#include "kbctx.h"
+#include "kbsink.h"
+#include "kbwork.h"
+#include "kbcache.h"
+#include "kbart.h"
+#include "kbmux.h"
+#include "kbshell.h"
+#include "kbzygote.h"
 
 #define PIDFILE      ("/tmp/kubeka.pid")
 
+// The milliseconds that commands get to exit after SIGTERM on shutdown.
+#define CANCEL_GRACE    (250)
+
 #define IERROR(...)      do {\
    fprintf (stderr, "%s:%i Internal error: ", __FILE__, __LINE__);\
    fprintf (stderr, __VA_ARGS__);\
@@ -45,14 +67,24 @@
    fflush (stderr);\
 } while (0);
 
-static volatile sig_atomic_t g_endloop = 0;
+// Fired by SIGINT or SIGTERM, and passed to everything that runs commands.
+static kbcancel_t *g_cancel = NULL;
 static void sigh (int n)
 {
-   if (n == SIGINT) {
-      g_endloop = 1;
+   if (n == SIGINT || n == SIGTERM) {
+      kbcancel_fire (g_cancel);
    }
 }
 
+// Stops the commands that are running once the token fires.
+static void *th_cancel (void *arg)
+{
+   kbcancel_t *cancel = arg;
+   kbcancel_wait (cancel, -1);
+   kbcancel_terminate (cancel, CANCEL_GRACE);
+   return NULL;
+}
+
 /* ****************************************************************************
  * The following functions together implement a sane c/line argument processing
  * mechanism for both long options and short options, implementing a subset
@@ -166,6 +198,7 @@ static void print_help_msg (void)
 "  -l | --lint",
 "              Read and parse all files for errors and warnings. Do not attempt",
 "              to execute any node. Any `--daemon` or `--job` flags are ignored.",
+"              Nodes that cannot be reached from any entrypoint are listed.",
 "  -p | --path",
 "              Path containing additional configuration *.kubeka files. This",
 "              option can be specified multiple times, once for each path that",
@@ -177,6 +210,55 @@ static void print_help_msg (void)
 "              The single job to execute. This is to allow execution of jobs from",
 "              the command-line. The job has to be of type `entrypoint`. Note that",
 "              exactly ONE OF `--daemon` or `--job` MUST BE SPECIFIED.",
+"  --jobs=<n>",
+"              The number of threads used to check the nodes and to instantiate",
+"              and evaluate the entrypoints (default 1). The diagnostics are",
+"              printed in the same order regardless of the number of threads.",
+"  -z | --zygote",
+"              Start a small helper process before loading the configuration,",
+"              and spawn all commands from it. The cost of spawning a command",
+"              then does not grow with the size of the configuration.",
+"  --log-dir=<dir>",
+"              Write the output of every command to its own file in <dir>,",
+"              moving it there without copying it through this process. Only",
+"              the last OUTPUT_LIMIT bytes (default 1MB) of the output of a",
+"              command are then kept in memory and printed.",
+"  --workspace-root=<dir>",
+"              Create the workspaces of nodes without a DIRECTORY in <dir>",
+"              instead of /tmp.",
+"  --workspace-size=<n>",
+"              Mount a tmpfs of <n> bytes (with an optional K, M or G suffix)",
+"              on the workspace root, so that the workspaces are in memory and",
+"              cannot fill the disk. Requires --workspace-root.",
+"  --workspace-budget=<n>",
+"              Limit the persistent workspaces (of nodes with WORKSPACE set to",
+"              persistent:<name>) to a total of <n> bytes (with an optional K,",
+"              M or G suffix). The least recently used ones that are not in use",
+"              are removed when a run ends with the workspaces over the budget.",
+"  --artifact-dir=<dir>",
+"              Keep the files that jobs pass to each other with ARTIFACTS_OUT and",
+"              ARTIFACTS_IN in <dir> instead of /tmp/kubeka-artifacts. The files",
+"              are linked into the directories of the jobs that use them, so",
+"              <dir> should be on the same filesystem as the workspaces.",
+"  --cache-dir=<dir>",
+"              Keep the results of nodes that set CACHE_INPUTS or CACHE_OUTPUTS",
+"              in <dir> instead of /tmp/kubeka-cache.",
+"  --cache-size=<n>",
+"              Limit the cached results to a total of <n> bytes (with an",
+"              optional K, M or G suffix, default 1G). The least recently used",
+"              results are removed when a new one takes the cache over <n>.",
+"  --shell-pool=<n>",
+"              Start <n> long-lived shells once the configuration is loaded, and",
+"              run the commands of nodes without a RUNAS_USER in them. This",
+"              removes the cost of starting a shell from every short command.",
+"  --io-uring",
+"              Read the output of commands with io_uring, batching the reads of",
+"              all the running commands into a single system call. Epoll is",
+"              used if the kernel does not allow io_uring.",
+"  --rollback-on-cancel",
+"              Run the ROLLBACK actions of a job that was stopped by SIGINT or",
+"              SIGTERM. By default nothing more is run once the commands that",
+"              are running have been stopped.",
 "  -W | --Werror",
 "              Treat all warnings as errors.",
 "",
@@ -253,6 +335,49 @@ static void dumpnode (const void *param_node, void *param_file)
 }
 #endif
 
+static int cmp_srcdef (const void *lhs, const void *rhs)
+{
+   const char *lid, *lfname, *rid, *rfname;
+   size_t lline, rline;
+   kbnode_get_srcdef (*(const kbnode_t **)lhs, &lid, &lfname, &lline);
+   kbnode_get_srcdef (*(const kbnode_t **)rhs, &rid, &rfname, &rline);
+   int rc = strcmp (lfname, rfname);
+   if (rc) {
+      return rc;
+   }
+   return lline < rline ? -1 : lline > rline ? 1 : 0;
+}
+
+// Lists the nodes in source order, so that the listing does not depend on the
+// order in which the nodes were collected.
+static void print_unreachable (const ds_array_t *nodes)
+{
+   size_t nnodes = ds_array_length (nodes);
+   if (!nnodes) {
+      return;
+   }
+
+   const kbnode_t **sorted = calloc (nnodes + 1, sizeof *sorted);
+   if (!sorted) {
+      IERROR ("OOM sorting %zu unreachable nodes\n", nnodes);
+      return;
+   }
+   for (size_t i=0; i<nnodes; i++) {
+      sorted[i] = ds_array_get (nodes, i);
+   }
+   qsort (sorted, nnodes, sizeof *sorted, cmp_srcdef);
+
+   printf ("Found %zu unreachable node%s (not used by any entrypoint):\n",
+            nnodes, nnodes == 1 ? "" : "s");
+   for (size_t i=0; i<nnodes; i++) {
+      const char *id, *fname;
+      size_t line;
+      kbnode_get_srcdef (sorted[i], &id, &fname, &line);
+      printf ("   [%s] %s:%zu\n", id, fname, line);
+   }
+   free (sorted);
+}
+
 int main (int argc, char **argv)
 {
    int ret = EXIT_FAILURE;
@@ -261,8 +386,15 @@ int main (int argc, char **argv)
    ds_array_t *nodes = NULL;
    ds_array_t *dedup_nodes = NULL;
    ds_array_t *entrypoints = NULL;
+   ds_array_t *reachable = NULL;
+   ds_array_t *unreachable = NULL;
    ds_array_t *trees = NULL;
+   kblint_t *lint = NULL;
+   kbindex_t *node_index = NULL;
    struct kbbi_thread_t *threads = NULL;
+   size_t nthreads = 0;
+   pthread_t watcher;
+   bool watching = false;
 
 
    /* ***********************************************************************
@@ -308,8 +440,8 @@ int main (int argc, char **argv)
    // 1.3 Read all -f/--file options
    const char *opt_file = NULL;
    while ((opt_file = opt_long (argc, argv, "file"))) {
-      if (!(ds_array_ins_tail (paths, (void *)ds_str_dup (opt_path)))) {
-         IERROR ("OOM storing --file=%s (%zu)\n", opt_path, counter);
+      if (!(ds_array_ins_tail (paths, (void *)ds_str_dup (opt_file)))) {
+         IERROR ("OOM storing --file=%s (%zu)\n", opt_file, counter);
          goto cleanup;
       }
       counter++;
@@ -323,6 +455,21 @@ int main (int argc, char **argv)
       counter++;
    }
 
+   // 1.4 Number of lint workers. Must be read before --job, which is a prefix
+   // of --jobs.
+   size_t opt_jobs = 1;
+   const char *opt_jobs_value = opt_long (argc, argv, "jobs");
+   if (opt_jobs_value) {
+      char *end = NULL;
+      unsigned long tmp = strtoul (opt_jobs_value, &end, 10);
+      if (!opt_jobs_value[0] || *end || tmp < 1 || tmp > 1024) {
+         XERROR ("Invalid value for --jobs=%s (must be from 1 to 1024)\n",
+               opt_jobs_value);
+         goto cleanup;
+      }
+      opt_jobs = (size_t)tmp;
+   }
+
    // 1.4.1 Check if running in single-shot mode.
    const char *opt_entry = opt_short (argc, argv, 'j');
    if (!opt_entry) {
@@ -379,6 +526,52 @@ int main (int argc, char **argv)
 
    // 1.7 Set the remaining options
    bool opt_werror = opt_bool (argc, argv, "Werror", 'W');
+   bool opt_zygote = opt_bool (argc, argv, "zygote", 'z');
+   size_t opt_shell_pool = 0;
+   const char *opt_shell_pool_value = opt_long (argc, argv, "shell-pool");
+   if (opt_shell_pool_value) {
+      char *end = NULL;
+      unsigned long tmp = strtoul (opt_shell_pool_value, &end, 10);
+      if (!opt_shell_pool_value[0] || *end || tmp < 1 || tmp > 1024) {
+         XERROR ("Invalid value for --shell-pool=%s (must be from 1 to 1024)\n",
+               opt_shell_pool_value);
+         goto cleanup;
+      }
+      opt_shell_pool = (size_t)tmp;
+   }
+   const char *opt_log_dir = opt_long (argc, argv, "log-dir");
+   const char *opt_workspace_root = opt_long (argc, argv, "workspace-root");
+   size_t opt_workspace_size = 0;
+   size_t opt_workspace_budget = 0;
+   const char *opt_workspace_budget_value = opt_long (argc, argv, "workspace-budget");
+   if (opt_workspace_budget_value
+         && !(kbsink_parse_limit (opt_workspace_budget_value, &opt_workspace_budget))) {
+      XERROR ("Invalid value for --workspace-budget=%s (must be a number of "
+              "bytes)\n", opt_workspace_budget_value);
+      goto cleanup;
+   }
+   const char *opt_artifact_dir = opt_long (argc, argv, "artifact-dir");
+   const char *opt_cache_dir = opt_long (argc, argv, "cache-dir");
+   size_t opt_cache_size = KBCACHE_DEFAULT_SIZE;
+   const char *opt_cache_size_value = opt_long (argc, argv, "cache-size");
+   if (opt_cache_size_value
+         && !(kbsink_parse_limit (opt_cache_size_value, &opt_cache_size))) {
+      XERROR ("Invalid value for --cache-size=%s (must be a number of "
+              "bytes)\n", opt_cache_size_value);
+      goto cleanup;
+   }
+   const char *opt_workspace_size_value = opt_long (argc, argv, "workspace-size");
+   if (opt_workspace_size_value) {
+      if (!opt_workspace_root
+            || !(kbsink_parse_limit (opt_workspace_size_value, &opt_workspace_size))
+            || !opt_workspace_size) {
+         XERROR ("Invalid value for --workspace-size=%s (must be a number of "
+                 "bytes, and needs --workspace-root)\n", opt_workspace_size_value);
+         goto cleanup;
+      }
+   }
+   bool opt_io_uring = opt_long (argc, argv, "io-uring") != NULL;
+   bool opt_rollback_on_cancel = opt_long (argc, argv, "rollback-on-cancel") != NULL;
 
    // At this point we have completed all option processing, may as well check if any
    // unrecognised options were specified and exit with a message if so.
@@ -388,6 +581,12 @@ int main (int argc, char **argv)
       goto cleanup;
    }
 
+   // 1.8 Start the zygote now, while this process is as small as it will ever
+   // be. Commands are spawned directly if it fails to start.
+   if (opt_zygote && !opt_lint && !(kbzygote_start ())) {
+      XWARNING ("Failed to start zygote, commands will be spawned directly\n");
+   }
+
 
 
    /* ***********************************************************************
@@ -457,7 +656,7 @@ int main (int argc, char **argv)
    }
 
    if (ndups) {
-      printf ("Found %zu duplicate%s in node list\n", ndups, ndups ? "" : "s");
+      printf ("Found %zu duplicate%s in node list\n", ndups, ndups == 1 ? "" : "s");
       nerrors += ndups;
    } else {
       printf ("none\n");
@@ -465,26 +664,28 @@ int main (int argc, char **argv)
    nwarnings += warnings;
    nerrors += errors;
 
+   // Index the nodes by type and by key for all the queries that follow.
+   if (!(node_index = kbindex_new (dedup_nodes))) {
+      IERROR ("OOM creating node index\n");
+      nerrors++;
+      goto cleanup;
+   }
+
 
    /* ***********************************************************************
     * 5. Perform a basic sanity check on every node:
     *    1. Conflicting variables?
     *    2. Missing mandatory/required variables?
-    * ***********************************************************************/
-
-
-
-   size_t nnodes = ds_array_length (dedup_nodes);
-   for (size_t i=0; i<nnodes; i++) {
-      kbnode_t *node = ds_array_get (dedup_nodes, i);
-      kbnode_check (node, &nerrors, &nwarnings);
-   }
-
-
-   /* ***********************************************************************
+    *
     * 6. Instantiate all the entrypoints. This doesn't run them, though, it
     * simply creates a runtime tree with each entrypoint as the root node, to
     * be evaluated at a later time.
+    *
+    * 7. Evaluate all the entrypoints. This *still** doesn't run them, though.
+    * The evaluation attempts to resolve every symbol only.
+    *
+    * Every check, and every instantiation and evaluation of a tree, is
+    * independent of all the others, so these are run by `--jobs` workers.
     * ***********************************************************************/
 
 
@@ -495,44 +696,26 @@ int main (int argc, char **argv)
       goto cleanup;
    }
 
-   entrypoints = kbnode_filter_types (dedup_nodes, KBNODE_TYPE_PERIODIC,
-                                                   KBNODE_TYPE_ENTRYPOINT,
-                                                   NULL);
-
-   nnodes = ds_array_length (entrypoints);
-   printf ("Found %zu entrypoint nodes\n", nnodes);
-   for (size_t i=0; i<nnodes; i++) {
-      const kbnode_t *ep = ds_array_get (entrypoints, i);
-      kbnode_t *newnode = kbnode_instantiate (ep, dedup_nodes, &nerrors, &nwarnings);
-      if (!newnode) {
-         XERROR ("Node instantiation failure\n");
-      } else {
-         if (!(ds_array_ins_tail (trees, newnode))) {
-            IERROR ("OOM storing new root node\n");
-         }
-      }
+   // Only the nodes that some entrypoint can reach are instantiated. The rest
+   // are checked, and are listed in the lint summary.
+   if (!(reachable = kbindex_reachable (node_index, &unreachable))) {
+      IERROR ("OOM determining reachable nodes\n");
+      nerrors++;
+      goto cleanup;
    }
 
+   entrypoints = kbindex_filter_types (node_index, KBNODE_TYPE_PERIODIC,
+                                                    KBNODE_TYPE_ENTRYPOINT,
+                                                    NULL);
 
-
-   /* ***********************************************************************
-    * 7. Evaluate all the entrypoints. This *still** doesn't run them, though.
-    * The evaluation attempts to resolve every symbol only.
-    * ***********************************************************************/
-
-
-
-   nnodes = ds_array_length (trees);
-   for (size_t i=0; i<nnodes; i++) {
-      kbnode_t *root = ds_array_get (trees, i);
-      size_t errors = 0,
-             warnings = 0;
-
-      kbtree_eval (root, &errors, &warnings);
-      printf ("Node [%s]: %zu errors, %zu warnings\n",
-               kbnode_getvalue_first (root, KBNODE_KEY_ID), errors, warnings);
-      nerrors += errors;
-      nwarnings += warnings;
+   printf ("Found %zu entrypoint nodes\n", ds_array_length (entrypoints));
+   if (!(lint = kblint_new (dedup_nodes, entrypoints, reachable, opt_jobs))) {
+      IERROR ("OOM creating lint tasks\n");
+      nerrors++;
+      goto cleanup;
+   }
+   if (!(kblint_run (lint, trees, &nerrors, &nwarnings))) {
+      nerrors++;
    }
 
 
@@ -548,6 +731,9 @@ int main (int argc, char **argv)
    printf ("Found %zu errors and %zu warnings\n", nerrors, nwarnings);
    printf ("Found %zu nodes (%zu runnable)\n",
             ds_array_length (nodes), ds_array_length (trees));
+   if (opt_lint) {
+      print_unreachable (unreachable);
+   }
 
    if (nerrors) {
       fprintf (stderr, "Aborting due to %zu error%s\n",
@@ -575,17 +761,101 @@ int main (int argc, char **argv)
 
 
    /* ***********************************************************************
-    * 10. Finally, run all the entrypoints. For a daemon, we create a new thread
+    * 10. A daemon only needs the runtime trees from here on. Free the source
+    * nodes and everything derived from them, and pack the trees into a compact
+    * image.
+    * ***********************************************************************/
+
+
+   if (opt_daemon && ds_array_length (trees)) {
+      size_t rss_before = kbutil_rss ();
+
+      kbindex_del (node_index);
+      node_index = NULL;
+      ds_array_del (entrypoints);
+      entrypoints = NULL;
+      ds_array_del (reachable);
+      reachable = NULL;
+      ds_array_del (unreachable);
+      unreachable = NULL;
+      ds_array_del (dedup_nodes);
+      dedup_nodes = NULL;
+      ds_array_fptr (nodes, (void (*) (void *))kbnode_del);
+      ds_array_del (nodes);
+      nodes = NULL;
+
+      size_t image_size = 0;
+      for (size_t i=0; i<kblint_nregions (lint); i++) {
+         image_size += kbnode_region_compact (kblint_region (lint, i));
+      }
+#ifdef __GLIBC__
+      // Hand the freed memory back, so that the RSS reflects the compaction
+      malloc_trim (0);
+#endif
+      size_t rss_after = kbutil_rss ();
+      printf ("Compacted runtime image to %zu bytes: RSS %zu KB -> %zu KB\n",
+               image_size, rss_before / 1024, rss_after / 1024);
+   }
+
+
+
+   /* ***********************************************************************
+    * 11. Finally, run all the entrypoints. For a daemon, we create a new thread
     * for each entrypoint, which waits until it is triggered. For a command-line
     * invocation, we sequentially step through the entrypoints in `tree` and
     * execute each one in turn.
     * ***********************************************************************/
 
+   if (opt_log_dir && !opt_lint && !(kbsink_set_logdir (opt_log_dir))) {
+      XERROR ("Cannot write logs to [%s]\n", opt_log_dir);
+      goto cleanup;
+   }
+
+   if (opt_workspace_root && !opt_lint
+         && !(kbwork_set_root (opt_workspace_root, opt_workspace_size))) {
+      XERROR ("Cannot create workspaces in [%s]\n", opt_workspace_root);
+      goto cleanup;
+   }
+
+   kbwork_set_budget (opt_workspace_budget);
+   kbcache_set_dir (opt_cache_dir, opt_cache_size);
+   kbart_set_dir (opt_artifact_dir);
+   kbmux_use_uring (opt_io_uring);
+   kbbi_rollback_on_cancel (opt_rollback_on_cancel);
+
+   // SIGINT and SIGTERM stop the commands that are running, which are in
+   // their own process groups and so never see the signal themselves.
+   if (!opt_lint) {
+      if (!(g_cancel = kbcancel_new ())) {
+         goto cleanup;
+      }
+      if ((signal (SIGINT, sigh) == SIG_ERR)) {
+         XERROR ("Failed to set signal handler for SIGINT: %m\n");
+         goto cleanup;
+      }
+      if ((signal (SIGTERM, sigh) == SIG_ERR)) {
+         XERROR ("Failed to set signal handler for SIGTERM: %m\n");
+         goto cleanup;
+      }
+   }
+
+   // The shells of the pool take their environment from this process, so
+   // they only run the commands of nodes that set no variables of their own.
+   if (opt_shell_pool && !opt_lint && !(kbshell_pool_start (opt_shell_pool))) {
+      XWARNING ("Failed to start shell pool, commands will be spawned\n");
+   }
 
    // If an entrypoint is specified, run it then exit.
    if (opt_entry) {
+      if ((pthread_create (&watcher, NULL, th_cancel, g_cancel)) != 0) {
+         XWARNING ("Failed to start cancellation thread, commands will not be"
+                   " stopped on SIGINT\n");
+      } else {
+         watching = true;
+      }
+
       // Set ret depending on what the execution of that job resulted in
-      ret = kbbi_launch (opt_entry, trees, &nerrors, &nwarnings);
+      ret = kbbi_launch (opt_entry, trees, g_cancel, &nerrors, &nwarnings);
       if (ret != EXIT_SUCCESS) {
          fprintf (stderr, "Failed to execute job [%s]: %zu errors, %zu warnings\n",
                opt_entry, nerrors, nwarnings);
@@ -597,12 +867,6 @@ int main (int argc, char **argv)
    // If no entrypoint specified, start a thread for each entrypoint
    if (opt_daemon) {
 
-      // Wait for SIGINT to tell us to exit
-      if ((signal (SIGINT, sigh) == SIG_ERR)) {
-         XERROR ("Failed to set signal handler for SIGINT: %m\n");
-         goto cleanup;
-      }
-
       size_t ntrees = ds_array_length (trees);
       if (!ntrees) {
          XWARNING ("No entrypoint nodes found, exiting\n");
@@ -617,33 +881,38 @@ int main (int argc, char **argv)
       }
       for (size_t i=0; i<ntrees; i++) {
          threads[i].root = ds_array_get (trees, i);
-         threads[i].endflag = &g_endloop;
+         threads[i].cancel = g_cancel;
          threads[i].retcode = EXIT_FAILURE;
-         threads[i].completed = false;
 
          if (!(kbbi_thread_launch (&threads[i]))) {
             IERROR ("Failed to launch thread %zu\n", i); // TODO: Use node name
             goto cleanup;
          }
+         nthreads++;
       }
 
-      while (g_endloop == 0) {
-         sleep (1);
-      }
-
-      // Wait for all threads to end
-      for (size_t i=0; i<ntrees; i++) {
-         while (!threads[i].completed) {
-            // Do nothing
-            sleep (1);
-         }
-
-      }
+      // Wait for SIGINT or SIGTERM to tell us to exit, then stop the
+      // commands that are still running.
+      kbcancel_wait (g_cancel, -1);
+      kbcancel_terminate (g_cancel, CANCEL_GRACE);
 
       ret = EXIT_SUCCESS;
    }
 
 cleanup:
+   if (nthreads) {
+      // Threads that are still running (because one failed to launch) are
+      // stopped first; all of them must end before their trees are deleted.
+      kbcancel_fire (g_cancel);
+      for (size_t i=0; i<nthreads; i++) {
+         kbbi_thread_join (&threads[i]);
+      }
+   }
+   if (watching) {
+      // Releases the watcher once the job is done
+      kbcancel_fire (g_cancel);
+      pthread_join (watcher, NULL);
+   }
    // ds_array_iterate (trees, (void (*) (void *, void*))kbnode_dump, stdout);
    ds_array_fptr (paths, free);
    ds_array_fptr (files, free);
@@ -652,11 +921,28 @@ cleanup:
    ds_array_del (files);
    ds_array_del (nodes);
 
+   kbindex_del (node_index);
    ds_array_del (dedup_nodes);
    ds_array_del (entrypoints);
-   ds_array_fptr (trees, (void (*) (void *))kbnode_del);
+   ds_array_del (reachable);
+   ds_array_del (unreachable);
+   // All the trees are in the regions of the linter, so they are deleted with it.
    ds_array_del (trees);
+   kblint_del (lint);
    free (threads);
+   kbmux_stop ();
+   kbshell_pool_stop ();
+   kbzygote_stop ();
+   kbcmd_cache_clear ();
+   kbctx_flush ();
+   kbsink_set_logdir (NULL);
+   kbwork_set_root (NULL, 0);
+   kbcache_set_dir (NULL, KBCACHE_DEFAULT_SIZE);
+   kbart_set_dir (NULL);
+   signal (SIGINT, SIG_DFL);
+   signal (SIGTERM, SIG_DFL);
+   kbcancel_del (g_cancel);
+   g_cancel = NULL;
 
    if (ret != EXIT_SUCCESS) {
       ret = EXIT_FAILURE;
@@ -20,6 +20,7 @@
 #include "ds_array.h"
 
 #include "kbnode.h"
+#include "kbindex.h"
 #include "kbutil.h"
 
 #define PARSER_IN       "./tests/input/kbnode.txt"
@@ -42,6 +43,20 @@ static void dump_nodelist (ds_array_t *nodes, FILE *outf)
    }
 }
 
+static bool same_nodelist (const ds_array_t *lhs, const ds_array_t *rhs)
+{
+   size_t nnodes = ds_array_length (lhs);
+   if (nnodes != ds_array_length (rhs)) {
+      return false;
+   }
+   for (size_t i=0; i<nnodes; i++) {
+      if (ds_array_get (lhs, i) != ds_array_get (rhs, i)) {
+         return false;
+      }
+   }
+   return true;
+}
+
 static int t_parser (const char *ifname, const char *ofname)
 {
    int ret = EXIT_FAILURE;
@@ -91,7 +106,8 @@ static int t_filter (const char *ifname, const char *ofname)
 
    ds_array_t *nodes = ds_array_new ();
 
-   ds_array_t *f1 = NULL, *f2 = NULL, *f3 = NULL;
+   ds_array_t *f1 = NULL, *f2 = NULL, *f3 = NULL, *f4 = NULL;
+   kbindex_t *index = NULL;
 
    FILE *outf = fopen (ofname, "w");
 
@@ -130,6 +146,22 @@ static int t_filter (const char *ifname, const char *ofname)
    }
    dump_nodelist (f2, outf);
 
+   // The index must return exactly what the filters return, in the same order
+   if (!(index = kbindex_new (nodes))) {
+      fprintf (stderr, "Failed to index nodes\n");
+      goto cleanup;
+   }
+   if (!(f3 = kbindex_filter_types (index, "periodic", "no-such-type", NULL))
+         || !(same_nodelist (f1, f3))) {
+      fprintf (stderr, "Index by type does not match filter by type\n");
+      goto cleanup;
+   }
+   if (!(f4 = kbindex_filter_keyname (index, "for_filter", "for_filter", NULL))
+         || !(same_nodelist (f2, f4))) {
+      fprintf (stderr, "Index by keyname does not match filter by keyname\n");
+      goto cleanup;
+   }
+
 
    ret = EXIT_SUCCESS;
 cleanup:
@@ -146,6 +178,8 @@ cleanup:
    ds_array_del (f1);
    ds_array_del (f2);
    ds_array_del (f3);
+   ds_array_del (f4);
+   kbindex_del (index);
 
    return ret;
 }
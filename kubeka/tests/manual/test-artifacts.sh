@@ -0,0 +1,25 @@
+#!/bin/bash
+
+. tests/manual/tests.inc
+
+# The artifacts of the run are kept in a store of their own
+TESTDIR=/tmp/kubeka-test-artifacts
+rm -rf $TESTDIR
+
+rm -f vg.txt
+$PROG \
+   --artifact-dir=$TESTDIR \
+   -f  tests/input/artifacts.kubeka \
+   -j  artifacts-1 \
+   &> tests/output/artifacts.output || failed
+
+# Nothing is left in the store once the run that used it is done
+echo "Objects in the store: `find $TESTDIR/objects -type f | wc -l`" \
+   >> tests/output/artifacts.output
+rm -rf $TESTDIR
+
+diff\
+   tests/expected/artifacts.output \
+   tests/output/artifacts.output || failed
+
+passed
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+. tests/manual/tests.inc
+
+# The node runs in, and caches into, directories of its own
+TESTDIR=/tmp/kubeka-test-cache
+rm -rf $TESTDIR
+mkdir -p $TESTDIR/work || failed
+echo "First input" > $TESTDIR/work/in.txt
+
+run_cache() {
+   $PROG \
+      --cache-dir=$TESTDIR/cache \
+      -f  tests/input/cache.kubeka \
+      -j  cache-1 \
+      &>> tests/output/cache.output || failed
+   echo "out.txt: `cat $TESTDIR/work/out.txt`" >> tests/output/cache.output
+}
+
+rm -f vg.txt
+rm -f tests/output/cache.output
+
+# The command runs, then its output is restored from the cache instead
+run_cache
+rm -f $TESTDIR/work/out.txt
+run_cache
+
+# A changed input runs the command again
+echo "Second input" > $TESTDIR/work/in.txt
+run_cache
+
+rm -rf $TESTDIR
+
+diff\
+   tests/expected/cache.output \
+   tests/output/cache.output || failed
+
+passed
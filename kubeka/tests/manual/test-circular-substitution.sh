@@ -0,0 +1,8 @@
+#!/bin/bash
+
+. tests/manual/tests.inc
+
+single_test circular-substitution failed
+
+passed
+
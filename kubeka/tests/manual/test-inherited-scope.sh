@@ -0,0 +1,16 @@
+#!/bin/bash
+
+. tests/manual/tests.inc
+
+rm -f vg.txt
+$PROG \
+   -f  tests/input/inherited-scope.kubeka \
+   -j  inherited-scope-2 \
+   &> tests/output/inherited-scope.output || failed
+
+diff\
+   tests/expected/inherited-scope.output \
+   tests/output/inherited-scope.output || failed
+
+passed
+
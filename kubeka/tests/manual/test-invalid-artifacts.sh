@@ -0,0 +1,8 @@
+#!/bin/bash
+
+. tests/manual/tests.inc
+
+single_test invalid-artifacts failed
+
+passed
+
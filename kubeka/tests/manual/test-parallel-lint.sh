@@ -0,0 +1,14 @@
+#!/bin/bash
+
+. tests/manual/tests.inc
+
+# The diagnostics must be the same, in the same order, however many workers
+# lint the nodes.
+for X in happy broken; do
+   $PROG --lint --jobs=1 -p tests/input/$X &> tests/output/parallel-lint-1.output
+   $PROG --lint --jobs=4 -p tests/input/$X &> tests/output/parallel-lint-4.output
+   diff tests/output/parallel-lint-1.output tests/output/parallel-lint-4.output \
+      || failed
+done
+
+passed
@@ -0,0 +1,15 @@
+#!/bin/bash
+
+. tests/manual/tests.inc
+
+rm -f vg.txt
+$PROG \
+   -f  tests/input/timeout.kubeka \
+   -j  timeout-1 \
+   &> tests/output/timeout.output && failed "a command that timed out succeeded"
+
+diff\
+   tests/expected/timeout.output \
+   tests/output/timeout.output || failed
+
+passed